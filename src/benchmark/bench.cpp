@@ -0,0 +1,408 @@
+#include "../utils.h"
+#include "../stereoCalib.h"
+#include "../fusedRemap.h"
+#include "../cornerTracker.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+
+/** Synthetic stereo dataset: board views projected with known intrinsics, distortion and stereo pose */
+struct SyntheticData {
+    cv::Size imgRes;
+    stereocalib::MonoCalibration camL, camR;                        // Ground truth intrinsics
+    stereocalib::StereoCalibration stereo;                          // Ground truth pose of the right camera
+    std::vector<std::vector<cv::Point2f>> cornersL, cornersR;       // Projected corners of each view
+    std::vector<cv::Mat> imgs;                                      // Rendered left images (grayscale)
+};
+
+/** One timed measurement */
+struct BenchResult {
+    std::string stage;
+    cv::Size imgRes;
+    int numViews;
+    int numThreads;
+    double seconds;
+    int numItems;                                                   // Images, solves or remaps timed
+};
+
+/**
+ * Generate a synthetic stereo dataset. Board poses are random (fixed seed) but keep the board inside both images
+ *
+ * @param imgRes        Image resolution
+ * @param board         Chessboard geometry
+ * @param numViews      Number of views
+ * @param renderImgs    Render the left images too (needed to time the detection)
+ */
+SyntheticData generateData(const cv::Size &imgRes, const stereocalib::Board &board, const int numViews, const bool renderImgs);
+
+/**
+ * Render a synthetic sequence: the board moves and turns a little from one frame to the next (a few pixels, as in a video)
+ *
+ * @param imgRes        Image resolution
+ * @param board         Chessboard geometry
+ * @param numFrames     Number of frames
+ */
+std::vector<cv::Mat> generateSequence(const cv::Size &imgRes, const stereocalib::Board &board, const int numFrames);
+
+/**
+ * Check remapToGray against cv::remap + cv::cvtColor (within 1 gray level) with every kernel the CPU can run, on color
+ * and gray sources of the size of the maps and smaller than them (most samples on or outside the border).
+ * Return false if a kernel differs by more than 1 gray level
+ *
+ * @param data          Synthetic dataset (its left camera rectification gives the maps)
+ */
+bool checkRemapToGray(const SyntheticData &data);
+
+/**
+ * Render the image of a chessboard seen with the given corners. The board is warped with the homography
+ * of its outer corners, so the rendering ignores the lens distortion
+ *
+ * @param imgRes        Image resolution
+ * @param board         Chessboard geometry
+ * @param corners       Undistorted projection of the board corners
+ */
+cv::Mat renderBoard(const cv::Size &imgRes, const stereocalib::Board &board, const std::vector<cv::Point2f> &corners);
+
+/**
+ * Parse a comma separated list of integers (i.e. "1,2,4")
+ *
+ * @param list          Input list
+ */
+std::vector<int> parseIntList(const std::string &list);
+
+/**
+ * Parse a comma separated list of resolutions (i.e. "640x480,1280x720")
+ *
+ * @param list          Input list
+ */
+std::vector<cv::Size> parseResolutionList(const std::string &list);
+
+/**
+ * Write the results as JSON
+ *
+ * @param filename      Output path
+ * @param results       Measurements
+ */
+void writeJson(const std::string &filename, const std::vector<BenchResult> &results);
+
+
+int main(int argc, char** argv){
+    if (utils::hasOptFlag(argc, argv, "--help")){
+        std::cerr << "Usage: ./bench [--resolutions 640x480,1280x720,...] [--views 10,20,...] [--threads 1,2,...] "
+            "[--repeat N] [--sequence N] [--output bench.json]\n";
+        return 1;
+    }
+    const std::vector<cv::Size> resolutions = parseResolutionList(utils::getOptArg(argc, argv, "--resolutions", "640x480,1280x720,1920x1080"));
+    const std::vector<int> viewCounts = parseIntList(utils::getOptArg(argc, argv, "--views", "10,20,40"));
+    const std::vector<int> threadCounts = parseIntList(utils::getOptArg(argc, argv, "--threads", "1,2,4"));
+    const int repeat = std::max(1, std::stoi(utils::getOptArg(argc, argv, "--repeat", "10")));     // Remaps per measurement
+    const int sequenceLength = std::stoi(utils::getOptArg(argc, argv, "--sequence", "100"));        // Frames of the tracking sequence (0: skip)
+    const std::string output = utils::getOptArg(argc, argv, "--output", "bench.json");
+    if (resolutions.empty() || viewCounts.empty() || threadCounts.empty()){
+        std::cerr << "Empty resolution, view or thread list\n";
+        return 1;
+    }
+    const stereocalib::Board board{9, 6, 0.025f};
+    const int maxViews = *std::max_element(viewCounts.begin(), viewCounts.end());
+
+    std::vector<BenchResult> results;
+    bool checksPassed = true;
+    for (const cv::Size &imgRes : resolutions){
+        std::cout << "Resolution " << imgRes << "\n";
+        const SyntheticData data = generateData(imgRes, board, maxViews, true);
+        checksPassed = checkRemapToGray(data) && checksPassed;
+
+        // Corner tracking against the full detection of every frame of a sequence (one thread: tracking runs in frame order)
+        if (sequenceLength > 0){
+            cv::setNumThreads(1);
+            const std::vector<cv::Mat> frames = generateSequence(imgRes, board, sequenceLength);
+            utils::CornerTracker tracker(board.size(), utils::DetectorSettings());
+            std::vector<cv::Point2f> detectedCorners, trackedCorners;
+            double secondsDetect = 0, secondsTrack = 0, maxDiff = 0;
+            int found = 0, tracked = 0;
+            for (const cv::Mat &frame : frames){
+                int64 start = cv::getTickCount();
+                const bool foundDetect = utils::findChessCorners(frame, board.width, board.height, detectedCorners);
+                secondsDetect += (cv::getTickCount() - start) / cv::getTickFrequency();
+                start = cv::getTickCount();
+                const bool foundTrack = tracker.find(frame, trackedCorners);
+                secondsTrack += (cv::getTickCount() - start) / cv::getTickFrequency();
+                tracked += tracker.tracked();
+                if (foundDetect && foundTrack){
+                    found++;
+                    for (size_t k = 0; k < detectedCorners.size(); k++)
+                        maxDiff = std::max(maxDiff, cv::norm(detectedCorners[k] - trackedCorners[k]));
+                }
+            }
+            results.push_back({"findChessCorners (sequence)", imgRes, sequenceLength, 1, secondsDetect, sequenceLength});
+            results.push_back({"CornerTracker", imgRes, sequenceLength, 1, secondsTrack, sequenceLength});
+            std::cout << "\tsequence of " << sequenceLength << " frames: detection " << 1000 * secondsDetect / sequenceLength
+                << " ms/frame, tracking " << 1000 * secondsTrack / sequenceLength << " ms/frame (x" << secondsDetect / secondsTrack
+                << ", " << tracked << " frames tracked, max difference " << maxDiff << " px on " << found << " frames)\n";
+        }
+
+        for (const int numThreads : threadCounts){
+            cv::setNumThreads(numThreads);
+
+            // Corner detection, parallel on the images
+            std::vector<std::vector<cv::Point2f>> detectedCorners(data.imgs.size());
+            std::vector<char> detected(data.imgs.size(), false);
+            int64 start = cv::getTickCount();
+            utils::parallelFor(data.imgs.size(), numThreads, [&](size_t v){
+                detected[v] = utils::findChessCorners(data.imgs[v], board.width, board.height, detectedCorners[v]);
+            });
+            double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+            results.push_back({"findChessCorners", imgRes, maxViews, numThreads, seconds, (int)data.imgs.size()});
+            std::cout << "\tthreads " << numThreads << ": detection " << seconds << " s, found "
+                << std::count(detected.begin(), detected.end(), true) << "/" << data.imgs.size() << "\n";
+
+            // Calibrations, on the exact projections
+            for (const int numViews : viewCounts){
+                const std::vector<std::vector<cv::Point2f>> viewsL(data.cornersL.begin(), data.cornersL.begin() + numViews);
+                const std::vector<std::vector<cv::Point2f>> viewsR(data.cornersR.begin(), data.cornersR.begin() + numViews);
+                const stereocalib::MonoCalibration calibL = stereocalib::calibrateMono(viewsL, imgRes, board);
+                results.push_back({"calibrateCamera", imgRes, numViews, numThreads, calibL.solveTime, 1});
+                const stereocalib::StereoCalibration calibStereo = stereocalib::calibrateStereo(viewsL, viewsR, data.camL, data.camR, board);
+                results.push_back({"stereoCalibrate", imgRes, numViews, numThreads, calibStereo.solveTime, 1});
+                std::cout << "\tthreads " << numThreads << ", views " << numViews << ": calibrateCamera " << calibL.solveTime
+                    << " s (error " << calibL.reprError << "), stereoCalibrate " << calibStereo.solveTime << " s\n";
+            }
+
+            // Rectification maps and remap
+            const stereocalib::Rectification rect = stereocalib::rectify(data.camL, data.camR, data.stereo);
+            cv::Mat mapX, mapY;
+            start = cv::getTickCount();
+            cv::initUndistortRectifyMap(data.camL.K, data.camL.D, rect.R1, rect.P1, imgRes, CV_32FC1, mapX, mapY);
+            seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+            results.push_back({"initUndistortRectifyMap", imgRes, 0, numThreads, seconds, 1});
+
+            cv::Mat rectified;
+            start = cv::getTickCount();
+            for (int r = 0; r < repeat; r++)
+                cv::remap(data.imgs[r % data.imgs.size()], rectified, mapX, mapY, cv::INTER_LINEAR);
+            seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+            results.push_back({"remap", imgRes, 0, numThreads, seconds, repeat});
+            std::cout << "\tthreads " << numThreads << ": remap " << 1000 * seconds / repeat << " ms\n";
+
+            // Rectification to grayscale of a color frame: remap + cvtColor against the fused kernel (fixed-point maps)
+            cv::Mat map1, map2, color(imgRes, CV_8UC3), grayRef, grayFused;
+            cv::convertMaps(mapX, mapY, map1, map2, CV_16SC2);
+            cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(256));
+            start = cv::getTickCount();
+            for (int r = 0; r < repeat; r++){
+                cv::remap(color, rectified, map1, map2, cv::INTER_LINEAR);
+                cv::cvtColor(rectified, grayRef, cv::COLOR_BGR2GRAY);
+            }
+            seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+            results.push_back({"remap+cvtColor", imgRes, 0, numThreads, seconds, repeat});
+            start = cv::getTickCount();
+            for (int r = 0; r < repeat; r++)
+                stereocalib::remapToGray(color, grayFused, map1, map2);
+            const double secondsFused = (cv::getTickCount() - start) / cv::getTickFrequency();
+            results.push_back({"remapToGray", imgRes, 0, numThreads, secondsFused, repeat});
+            std::cout << "\tthreads " << numThreads << ": remap+cvtColor " << 1000 * seconds / repeat << " ms, remapToGray "
+                << 1000 * secondsFused / repeat << " ms (max difference " << cv::norm(grayRef, grayFused, cv::NORM_INF) << ")\n";
+        }
+    }
+
+    writeJson(output, results);
+    std::cout << "Results written to " << output << "\n";
+    if (!checksPassed){
+        std::cerr << "remapToGray differs from remap + cvtColor by more than 1 gray level\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+
+SyntheticData generateData(const cv::Size &imgRes, const stereocalib::Board &board, const int numViews, const bool renderImgs){
+    SyntheticData data;
+    data.imgRes = imgRes;
+
+    // Ground truth: same intrinsics for both cameras, right camera 10 cm on the right of the left one
+    const double f = 0.8 * imgRes.width;
+    for (stereocalib::MonoCalibration *cam : {&data.camL, &data.camR}){
+        cam->imgRes = imgRes;
+        cam->K = (cv::Mat_<double>(3, 3) << f, 0, imgRes.width / 2.0, 0, f, imgRes.height / 2.0, 0, 0, 1);
+        cam->D = (cv::Mat_<double>(1, 5) << -0.1, 0.01, 0, 0, 0);
+    }
+    data.stereo.imgRes = imgRes;
+    cv::Rodrigues(cv::Vec3d(0, 0.02, 0), data.stereo.R);
+    data.stereo.T = cv::Vec3d(-0.1, 0, 0);
+
+    const std::vector<cv::Point3f> objPoints = utils::getChessObjPoints(board.width, board.height, board.cellSize);
+    const cv::Point3f boardCenter((board.width - 1) * board.cellSize / 2, (board.height - 1) * board.cellSize / 2, 0);
+    const double boardSide = std::max(board.width, board.height) * board.cellSize;
+    cv::RNG rng(42);
+    while ((int)data.cornersL.size() < numViews){
+        // Random pose: tilted board, at a distance where it fills 30-70% of the image width
+        const cv::Vec3d rVec(rng.uniform(-0.5, 0.5), rng.uniform(-0.5, 0.5), rng.uniform(-0.3, 0.3));
+        const double distance = f * boardSide / (imgRes.width * rng.uniform(0.3, 0.7));
+        cv::Mat RBoard;
+        cv::Rodrigues(rVec, RBoard);
+        const cv::Mat center = RBoard * (cv::Mat_<double>(3, 1) << boardCenter.x, boardCenter.y, boardCenter.z);
+        const cv::Vec3d tVec(rng.uniform(-0.2, 0.2) * distance - center.at<double>(0),
+                            rng.uniform(-0.15, 0.15) * distance - center.at<double>(1), distance - center.at<double>(2));
+
+        cv::Mat rVecR;
+        cv::Rodrigues(data.stereo.R * RBoard, rVecR);
+        const cv::Mat tVecR = data.stereo.R * cv::Mat(tVec) + cv::Mat(data.stereo.T);
+        std::vector<cv::Point2f> cornersL, cornersR;
+        cv::projectPoints(objPoints, rVec, tVec, data.camL.K, data.camL.D, cornersL);
+        cv::projectPoints(objPoints, rVecR, tVecR, data.camR.K, data.camR.D, cornersR);
+
+        // Keep the board far from the image borders in both cameras
+        bool inside = true;
+        for (const auto &corners : {cornersL, cornersR}){
+            for (const auto &corner : corners)
+                inside = inside && corner.x > 20 && corner.y > 20 &&
+                            corner.x < imgRes.width - 20 && corner.y < imgRes.height - 20;
+        }
+        if (!inside)
+            continue;
+
+        data.cornersL.emplace_back(cornersL);
+        data.cornersR.emplace_back(cornersR);
+        if (renderImgs){
+            std::vector<cv::Point2f> undistorted;
+            cv::projectPoints(objPoints, rVec, tVec, data.camL.K, cv::Mat(), undistorted);
+            data.imgs.emplace_back(renderBoard(imgRes, board, undistorted));
+        }
+    }
+    return data;
+}
+
+
+std::vector<cv::Mat> generateSequence(const cv::Size &imgRes, const stereocalib::Board &board, const int numFrames){
+    // Board filling half of the image width, sliding by a fifth of the distance and turning by 0.4 rad over the sequence
+    const double f = 0.8 * imgRes.width;
+    const cv::Mat K = (cv::Mat_<double>(3, 3) << f, 0, imgRes.width / 2.0, 0, f, imgRes.height / 2.0, 0, 0, 1);
+    const std::vector<cv::Point3f> objPoints = utils::getChessObjPoints(board.width, board.height, board.cellSize);
+    const cv::Vec3d boardCenter((board.width - 1) * board.cellSize / 2, (board.height - 1) * board.cellSize / 2, 0);
+    const double distance = f * std::max(board.width, board.height) * board.cellSize / (0.5 * imgRes.width);
+    std::vector<cv::Mat> frames;
+    for (int k = 0; k < numFrames; k++){
+        const double t = numFrames > 1 ? (double)k / (numFrames - 1) - 0.5 : 0;          // In [-0.5, 0.5]
+        const cv::Vec3d rVec(0.2 + 0.2 * t, -0.2 * t, 0.1 * t);
+        cv::Mat RBoard;
+        cv::Rodrigues(rVec, RBoard);
+        const cv::Mat center = RBoard * cv::Mat(boardCenter);
+        const cv::Vec3d tVec(0.2 * t * distance - center.at<double>(0), -center.at<double>(1), distance - center.at<double>(2));
+        std::vector<cv::Point2f> corners;
+        cv::projectPoints(objPoints, rVec, tVec, K, cv::Mat(), corners);
+        frames.emplace_back(renderBoard(imgRes, board, corners));
+    }
+    return frames;
+}
+
+
+bool checkRemapToGray(const SyntheticData &data){
+    const stereocalib::Rectification rect = stereocalib::rectify(data.camL, data.camR, data.stereo);
+    cv::Mat map1, map2;
+    cv::initUndistortRectifyMap(data.camL.K, data.camL.D, rect.R1, rect.P1, data.imgRes, CV_16SC2, map1, map2);
+
+    // Sources of the size of the maps and of a third of it: the small ones send most samples across the border,
+    // to the scalar fallback of the AVX2 kernel
+    std::vector<cv::Mat> sources;
+    for (const cv::Size &size : {data.imgRes, cv::Size(data.imgRes.width / 3, data.imgRes.height / 3)}){
+        for (const int type : {CV_8UC3, CV_8UC1}){
+            cv::Mat src(size, type);
+            cv::randu(src, cv::Scalar::all(0), cv::Scalar::all(256));
+            sources.emplace_back(src);
+        }
+    }
+
+    bool passed = true;
+    for (const stereocalib::RemapKernel kernel : {stereocalib::RemapKernel::SCALAR, stereocalib::RemapKernel::AVX2}){
+        const std::string kernelName = (kernel == stereocalib::RemapKernel::SCALAR) ? "scalar" : "avx2";
+        if (!stereocalib::hasRemapKernel(kernel)){
+            std::cout << "\tremapToGray " << kernelName << ": not supported by this CPU, not checked\n";
+            continue;
+        }
+        for (const cv::Mat &src : sources){
+            cv::Mat rectified, grayRef, grayFused;
+            cv::remap(src, rectified, map1, map2, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+            if (src.channels() == 3)
+                cv::cvtColor(rectified, grayRef, cv::COLOR_BGR2GRAY);
+            else
+                grayRef = rectified;
+            stereocalib::remapToGray(src, grayFused, map1, map2, kernel);
+            const double maxDiff = cv::norm(grayRef, grayFused, cv::NORM_INF);
+            passed = passed && maxDiff <= 1;
+            std::cout << "\tremapToGray " << kernelName << ", " << src.channels() << " channel source " << src.size() << ": max difference "
+                << maxDiff << (maxDiff <= 1 ? "\n" : " FAILED\n");
+        }
+    }
+    return passed;
+}
+
+
+cv::Mat renderBoard(const cv::Size &imgRes, const stereocalib::Board &board, const std::vector<cv::Point2f> &corners){
+    // Board texture: (width+1)x(height+1) squares, with a white margin of one square
+    const int cell = 40;
+    cv::Mat texture(cv::Size((board.width + 3) * cell, (board.height + 3) * cell), CV_8UC1, cv::Scalar(255));
+    for (int i = 0; i <= board.height; i++){
+        for (int j = 0; j <= board.width; j++){
+            if ((i + j) % 2 == 0)
+                texture(cv::Rect((j + 1) * cell, (i + 1) * cell, cell, cell)).setTo(cv::Scalar(0));
+        }
+    }
+
+    // Inner corner (j, i) of the texture is at ((j + 2) * cell, (i + 2) * cell)
+    const int w = board.width, h = board.height;
+    const std::vector<cv::Point2f> src = {cv::Point2f(2 * cell, 2 * cell), cv::Point2f((w + 1) * cell, 2 * cell),
+                                        cv::Point2f(2 * cell, (h + 1) * cell), cv::Point2f((w + 1) * cell, (h + 1) * cell)};
+    const std::vector<cv::Point2f> dst = {corners[0], corners[w - 1], corners[(h - 1) * w], corners[h * w - 1]};
+    cv::Mat img;
+    cv::warpPerspective(texture, img, cv::getPerspectiveTransform(src, dst), imgRes, cv::INTER_LINEAR,
+                        cv::BORDER_CONSTANT, cv::Scalar(128));
+    return img;
+}
+
+
+std::vector<int> parseIntList(const std::string &list){
+    std::vector<int> values;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        values.emplace_back(std::stoi(item));
+    return values;
+}
+
+
+std::vector<cv::Size> parseResolutionList(const std::string &list){
+    std::vector<cv::Size> values;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')){
+        const size_t x = item.find('x');
+        if (x != std::string::npos)
+            values.emplace_back(std::stoi(item.substr(0, x)), std::stoi(item.substr(x + 1)));
+    }
+    return values;
+}
+
+
+void writeJson(const std::string &filename, const std::vector<BenchResult> &results){
+    std::ofstream out(filename);
+    out << "{\n  \"opencv_version\": \"" << CV_VERSION << "\",\n"
+        << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"results\": [\n";
+    for (size_t k = 0; k < results.size(); k++){
+        const BenchResult &r = results[k];
+        out << "    {\"stage\": \"" << r.stage << "\", \"width\": " << r.imgRes.width << ", \"height\": " << r.imgRes.height
+            << ", \"views\": " << r.numViews << ", \"threads\": " << r.numThreads << ", \"seconds\": " << r.seconds
+            << ", \"items\": " << r.numItems << ", \"ms_per_item\": " << 1000 * r.seconds / r.numItems << "}"
+            << (k + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
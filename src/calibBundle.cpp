@@ -0,0 +1,224 @@
+#include "calibBundle.h"
+#include "trace.h"
+
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <fstream>
+#include <map>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace stereocalib {
+
+    namespace {
+
+        const uint32_t BUNDLE_VERSION = 2;                          // 1: a single checksum of the whole file (write again)
+        const size_t DATA_ALIGNMENT = 64;
+
+        struct BundleHeader {
+            char magic[4];
+            uint32_t version;
+            uint32_t numEntries;
+            uint32_t reserved;
+            uint64_t checksum;
+        };
+
+        struct BundleEntry {
+            char name[24];
+            int32_t type;
+            int32_t rows;
+            int32_t cols;
+            uint32_t reserved;
+            uint64_t offset;                // From the beginning of the file
+            uint64_t size;
+            uint64_t checksum;              // Of the data
+        };
+
+        /** FNV-1a on 64-bit words (then on the last bytes): fast enough to verify the maps at startup */
+        uint64_t checksum(const unsigned char *data, const size_t size){
+            uint64_t hash = 14695981039346656037ull;
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8){
+                uint64_t word;
+                std::memcpy(&word, data + i, 8);
+                hash = (hash ^ word) * 1099511628211ull;
+            }
+            for (; i < size; i++)
+                hash = (hash ^ data[i]) * 1099511628211ull;
+            return hash;
+        }
+
+        /** Named matrices of a set, in the order they are written */
+        std::vector<std::pair<std::string, cv::Mat>> getEntries(const CalibrationSet &set){
+            std::vector<std::pair<std::string, cv::Mat>> entries;
+            auto add = [&](const std::string &name, const cv::Mat &mat){
+                if (!mat.empty())
+                    entries.emplace_back(name, mat.isContinuous() ? mat : mat.clone());
+            };
+            add("board", cv::Mat((cv::Mat_<double>(1, 3) << set.board.width, set.board.height, set.board.cellSize)));
+            for (size_t c = 0; c < set.serials.size(); c++)
+                add("serial_" + std::to_string(c), cv::Mat(1, set.serials[c].size(), CV_8UC1, (void*)set.serials[c].data()).clone());
+            for (size_t c = 0; c < set.cameras.size(); c++){
+                add("img_res_" + std::to_string(c), cv::Mat((cv::Mat_<int>(1, 2) << set.cameras[c].imgRes.width, set.cameras[c].imgRes.height)));
+                add("K_" + std::to_string(c), set.cameras[c].K);
+                add("D_" + std::to_string(c), set.cameras[c].D);
+            }
+            if (!set.stereo.R.empty()){
+                add("R", set.stereo.R);
+                add("T", cv::Mat(set.stereo.T).clone());
+                add("E", set.stereo.E);
+                add("F", set.stereo.F);
+            }
+            add("R1", set.rect.R1);
+            add("R2", set.rect.R2);
+            add("P1", set.rect.P1);
+            add("P2", set.rect.P2);
+            add("Q", set.rect.Q);
+            for (int c = 0; c < 2; c++){
+                add("map1_" + std::to_string(c), set.map1[c]);
+                add("map2_" + std::to_string(c), set.map2[c]);
+            }
+            return entries;
+        }
+
+    } // namespace
+
+    bool writeCalibBundle(const std::string &filename, const CalibrationSet &set){
+        TRACE_SCOPE("writeCalibBundle");
+        const std::vector<std::pair<std::string, cv::Mat>> entries = getEntries(set);
+
+        // Entry table, then the data: the whole file is assembled in memory and written at once
+        size_t offset = sizeof(BundleHeader) + entries.size() * sizeof(BundleEntry);
+        std::vector<BundleEntry> table(entries.size());
+        for (size_t e = 0; e < entries.size(); e++){
+            const cv::Mat &mat = entries[e].second;
+            BundleEntry &entry = table[e];
+            std::memset(&entry, 0, sizeof(entry));
+            std::strncpy(entry.name, entries[e].first.c_str(), sizeof(entry.name) - 1);
+            entry.type = mat.type();
+            entry.rows = mat.rows;
+            entry.cols = mat.cols;
+            offset = (offset + DATA_ALIGNMENT - 1) / DATA_ALIGNMENT * DATA_ALIGNMENT;
+            entry.offset = offset;
+            entry.size = mat.total() * mat.elemSize();
+            entry.checksum = checksum(mat.data, entry.size);
+            offset += entry.size;
+        }
+        std::vector<unsigned char> file(offset, 0);
+        std::memcpy(file.data() + sizeof(BundleHeader), table.data(), table.size() * sizeof(BundleEntry));
+        for (size_t e = 0; e < entries.size(); e++)
+            std::memcpy(file.data() + table[e].offset, entries[e].second.data, table[e].size);
+
+        BundleHeader header;
+        std::memcpy(header.magic, "SCB1", 4);
+        header.version = BUNDLE_VERSION;
+        header.numEntries = entries.size();
+        header.reserved = 0;
+        header.checksum = checksum(file.data() + sizeof(BundleHeader), table.size() * sizeof(BundleEntry));
+        std::memcpy(file.data(), &header, sizeof(header));
+
+        std::ofstream out(filename, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(file.data()), file.size());
+        return (bool)out;
+    }
+
+    bool readCalibBundle(const std::string &filename, CalibrationSet &set, const bool verifyMaps){
+        TRACE_SCOPE("readCalibBundle");
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BundleHeader)){
+            close(fd);
+            return false;
+        }
+        const size_t fileSize = st.st_size;
+        // Private writable mapping: a consumer modifying a matrix gets a copy of the page, never touches the file
+        void *addr = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);                                                  // The mapping stays valid
+        if (addr == MAP_FAILED)
+            return false;
+        std::shared_ptr<const void> mapping(addr, [fileSize](const void *p){ munmap(const_cast<void*>(p), fileSize); });
+        const unsigned char *data = static_cast<const unsigned char*>(addr);
+
+        BundleHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, "SCB1", 4) != 0 || header.version != BUNDLE_VERSION ||
+            sizeof(BundleHeader) + (size_t)header.numEntries * sizeof(BundleEntry) > fileSize ||
+            checksum(data + sizeof(BundleHeader), header.numEntries * sizeof(BundleEntry)) != header.checksum)
+            return false;
+
+        // Matrices pointing into the mapping: only the pages of the verified ones are read now
+        std::map<std::string, cv::Mat> mats;
+        for (uint32_t e = 0; e < header.numEntries; e++){
+            BundleEntry entry;
+            std::memcpy(&entry, data + sizeof(BundleHeader) + e * sizeof(BundleEntry), sizeof(entry));
+            const std::string name(entry.name, strnlen(entry.name, sizeof(entry.name)));
+            if (entry.offset > fileSize || entry.size > fileSize - entry.offset || entry.rows < 0 || entry.cols < 0)
+                return false;
+            const cv::Mat mat(entry.rows, entry.cols, entry.type, const_cast<unsigned char*>(data + entry.offset));
+            if (mat.total() * mat.elemSize() != entry.size)
+                return false;
+            if ((verifyMaps || name.compare(0, 3, "map") != 0) && checksum(data + entry.offset, entry.size) != entry.checksum)
+                return false;
+            mats[name] = mat;
+        }
+        auto get = [&](const std::string &name){
+            const auto it = mats.find(name);
+            return it == mats.end() ? cv::Mat() : it->second;
+        };
+
+        set = CalibrationSet();
+        const cv::Mat board = get("board");
+        if (!board.empty())
+            set.board = Board{(int)board.at<double>(0), (int)board.at<double>(1), (float)board.at<double>(2)};
+        for (int c = 0; !get("K_" + std::to_string(c)).empty(); c++){
+            const cv::Mat serial = get("serial_" + std::to_string(c)), imgRes = get("img_res_" + std::to_string(c));
+            set.serials.emplace_back(serial.empty() ? "" : std::string(reinterpret_cast<const char*>(serial.data), serial.total()));
+            MonoCalibration camera;
+            if (!imgRes.empty())
+                camera.imgRes = cv::Size(imgRes.at<int>(0), imgRes.at<int>(1));
+            camera.K = get("K_" + std::to_string(c));
+            camera.D = get("D_" + std::to_string(c));
+            set.cameras.emplace_back(camera);
+        }
+        set.stereo.R = get("R");
+        if (!set.stereo.R.empty()){
+            set.stereo.imgRes = set.cameras.empty() ? cv::Size() : set.cameras[0].imgRes;
+            const cv::Mat T = get("T");
+            set.stereo.T = cv::Vec3d(T.at<double>(0), T.at<double>(1), T.at<double>(2));
+            set.stereo.E = get("E");
+            set.stereo.F = get("F");
+        }
+        set.rect.R1 = get("R1");
+        set.rect.R2 = get("R2");
+        set.rect.P1 = get("P1");
+        set.rect.P2 = get("P2");
+        set.rect.Q = get("Q");
+        for (int c = 0; c < 2; c++){
+            set.map1[c] = get("map1_" + std::to_string(c));
+            set.map2[c] = get("map2_" + std::to_string(c));
+        }
+        set.mapping = mapping;
+        return !set.cameras.empty();
+    }
+
+    bool isCalibBundle(const std::string &filename){
+        std::ifstream in(filename, std::ios::binary);
+        char magic[4];
+        return in.read(magic, 4) && std::memcmp(magic, "SCB1", 4) == 0;
+    }
+
+    void addRectificationMaps(CalibrationSet &set){
+        TRACE_SCOPE("initUndistortRectifyMap");
+        const cv::Mat R[2] = {set.rect.R1, set.rect.R2}, P[2] = {set.rect.P1, set.rect.P2};
+        for (size_t c = 0; c < 2 && c < set.cameras.size(); c++)
+            cv::initUndistortRectifyMap(set.cameras[c].K, set.cameras[c].D, R[c], P[c], set.cameras[c].imgRes, CV_16SC2,
+                                        set.map1[c], set.map2[c]);
+    }
+
+} // namespace stereocalib
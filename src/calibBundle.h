@@ -0,0 +1,56 @@
+#pragma once
+
+#include "stereoCalib.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace stereocalib {
+
+    /** Everything a calibration consumer needs, from one file. Missing parts are left empty
+     * (i.e. a single camera bundle has one camera and empty stereo, rectification and maps)
+    */
+    struct CalibrationSet {
+        Board board;
+        std::vector<std::string> serials;                   // Serial of each camera (1 or 2)
+        std::vector<MonoCalibration> cameras;               // Intrinsics of each camera (K, D and imgRes only)
+        StereoCalibration stereo;                           // Pose of the right camera (R, T, E, F and imgRes only)
+        Rectification rect;
+        cv::Mat map1[2], map2[2];                           // Fixed-point rectification maps (CV_16SC2 and CV_16UC1)
+
+        std::shared_ptr<const void> mapping;                // Memory mapping the matrices point to (when read from a bundle)
+    };
+
+    /** Write a calibration bundle: versioned binary file with checksums, holding the matrices of a CalibrationSet.
+     * Layout (native byte order):
+     *      header:     "SCB1", uint32 version, uint32 numEntries, uint32 reserved, uint64 checksum (of the entry table)
+     *      entries:    numEntries x (char name[24], int32 type, int32 rows, int32 cols, uint32 reserved, uint64 offset, uint64 size,
+     *                  uint64 checksum (of the data of the entry))
+     *      data:       matrix data, each one 64-byte aligned
+     * The per-entry checksums let a reader verify the calibration without reading the (large) maps
+     * Return false if the file cannot be written
+     * @param filename      Output path (.scb)
+     * @param set           Calibration to write
+    */
+    bool writeCalibBundle(const std::string &filename, const CalibrationSet &set);
+
+    /** Read a calibration bundle. The file is memory mapped and the matrices point into the mapping
+     * (zero-copy: kept alive by set.mapping). Return false if missing, of an unknown version or corrupted.
+     * The entry table and the calibration matrices are always verified (a few KB)
+     * @param filename      Bundle path
+     * @param set           Output calibration
+     * @param verifyMaps    Verify the rectification maps too (reads them whole). Without it their pages are
+     *                      not even read: pass false when the maps are not used
+    */
+    bool readCalibBundle(const std::string &filename, CalibrationSet &set, const bool verifyMaps = true);
+
+    /** Return true if the file is a calibration bundle (checks the magic number) */
+    bool isCalibBundle(const std::string &filename);
+
+    /** Compute the fixed-point rectification maps of a stereo set and add them to it */
+    void addRectificationMaps(CalibrationSet &set);
+
+} // namespace stereocalib
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "utils.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <thread>
+#include <cstdint>
+#include <unistd.h>
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+namespace utils {
+
+    /** 64-bit FNV-1a hash of a buffer
+     * @param data          Source buffer
+     * @param size          Size of the buffer in bytes
+     * @param seed          Hash of the previous buffers, to chain multiple buffers
+    */
+    inline uint64_t hashBytes(const void *data, const size_t size, uint64_t seed = 14695981039346656037ull){
+        const unsigned char *bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++){
+            seed ^= bytes[i];
+            seed *= 1099511628211ull;
+        }
+        return seed;
+    }
+
+    /** Describe the board and the detector settings as a string, used to build the cache keys.
+     * Any setting that changes the detected corners must be part of it
+     * @param boardSize     Width and height of the chessboard
+     * @param settings      Detector settings
+    */
+    inline std::string getDetectorKey(const cv::Size &boardSize, const DetectorSettings &settings){
+        std::stringstream ss;
+        ss << "v1_" << boardSize.width << "x" << boardSize.height << "_pyr" << settings.pyramidLevel;
+        if (settings.backend == DetectorBackend::SB)                    // Default settings keep the keys of the older entries
+            ss << "_sb";
+        if (settings.fastReject)
+            ss << "_fastreject";
+        return ss.str();
+    }
+
+    /** On-disk cache of detected chessboard corners. Each entry is a small binary file named after the hash
+     * of the image content and of the detector key, so that images are recognised regardless of their path.
+     * Entries are written to a temporary file (named after the process and the thread) and renamed, so the cache can be
+     * shared by concurrent workers and processes.
+     *
+     * Entry format (native byte order): "CRN1", uint8 found, uint32 numCorners, numCorners x (float x, float y)
+    */
+    class CornerCache {
+    public:
+        /** @param folder    Cache directory, created if missing. An empty string disables the cache */
+        explicit CornerCache(const std::string &folder) : folder_(folder) {
+            if (enabled())
+                fs::create_directories(folder_);
+        }
+
+        bool enabled() const { return !folder_.empty(); }
+
+        /** Return the corners of an image, running detect() only if the cache has no entry for it
+         * @param content       Encoded image (file content)
+         * @param detectorKey   Board and detector description (see getDetectorKey), plus any other input of detect()
+         * @param numCorners    Number of corners of the board: entries that do not match are ignored and detected again
+         * @param detect        Detector, called on cache misses
+         * @param chessCorners  Output corners
+        */
+        bool findChessCorners(const std::vector<unsigned char> &content, const std::string &detectorKey, const int numCorners,
+                            const std::function<bool(std::vector<cv::Point2f>&)> &detect, std::vector<cv::Point2f> &chessCorners) const {
+            if (!enabled())
+                return detect(chessCorners);
+
+            bool found;
+            if (lookup(content, detectorKey, numCorners, found, chessCorners))
+                return found;
+            found = detect(chessCorners);
+            insert(content, detectorKey, found, chessCorners);
+            return found;
+        }
+
+        /** Return true, and the cached detection, if the cache has an entry for the image (see findChessCorners) */
+        bool lookup(const std::vector<unsigned char> &content, const std::string &detectorKey, const int numCorners,
+                    bool &found, std::vector<cv::Point2f> &chessCorners) const {
+            if (!enabled())
+                return false;
+            TRACE_SCOPE("cornerCacheLookup");
+            return load(getEntryPath(content, detectorKey), numCorners, found, chessCorners);
+        }
+
+        /** Store the detection of an image. Only results of the detector described by detectorKey belong in the cache */
+        void insert(const std::vector<unsigned char> &content, const std::string &detectorKey, const bool found,
+                    const std::vector<cv::Point2f> &chessCorners) const {
+            if (enabled())
+                store(getEntryPath(content, detectorKey), found, chessCorners);
+        }
+
+    private:
+        std::string getEntryPath(const std::vector<unsigned char> &content, const std::string &detectorKey) const {
+            std::stringstream ss;
+            ss << folder_ << "/" << std::hex << hashBytes(content.data(), content.size()) << "_"
+                << hashBytes(detectorKey.data(), detectorKey.size()) << "_" << content.size() << ".bin";
+            return ss.str();
+        }
+
+        /** Read an entry. A board found has all its corners, a board not found at most all of them (partial detection):
+         * any other count means a corrupt or foreign entry, rejected before allocating the corners
+        */
+        bool load(const std::string &entryPath, const int expectedCorners, bool &found, std::vector<cv::Point2f> &chessCorners) const {
+            std::ifstream in(entryPath, std::ios::binary);
+            char magic[4];
+            uint8_t foundFlag;
+            uint32_t numCorners;
+            if (!in.read(magic, 4) || std::string(magic, 4) != "CRN1" ||
+                !in.read(reinterpret_cast<char*>(&foundFlag), sizeof(foundFlag)) ||
+                !in.read(reinterpret_cast<char*>(&numCorners), sizeof(numCorners)))
+                return false;
+            if (foundFlag ? numCorners != (uint32_t)expectedCorners : numCorners > (uint32_t)expectedCorners)
+                return false;
+
+            chessCorners.resize(numCorners);
+            if (!in.read(reinterpret_cast<char*>(chessCorners.data()), numCorners * sizeof(cv::Point2f)))
+                return false;
+            found = foundFlag != 0;
+            return true;
+        }
+
+        void store(const std::string &entryPath, const bool found, const std::vector<cv::Point2f> &chessCorners) const {
+            std::stringstream tmpPath;
+            tmpPath << entryPath << ".tmp" << getpid() << "_" << std::this_thread::get_id();
+            bool written;
+            {
+                std::ofstream out(tmpPath.str(), std::ios::binary);
+                const uint8_t foundFlag = found;
+                const uint32_t numCorners = chessCorners.size();
+                out.write("CRN1", 4);
+                out.write(reinterpret_cast<const char*>(&foundFlag), sizeof(foundFlag));
+                out.write(reinterpret_cast<const char*>(&numCorners), sizeof(numCorners));
+                out.write(reinterpret_cast<const char*>(chessCorners.data()), numCorners * sizeof(cv::Point2f));
+                written = out.good();
+            }
+            // A failed write only costs a detection on the next run
+            std::error_code ec;
+            if (written)
+                fs::rename(tmpPath.str(), entryPath, ec);
+            else
+                fs::remove(tmpPath.str(), ec);
+        }
+
+        std::string folder_;
+    };
+
+    /** Open the corner cache given by the optional command line argument "--corner-cache dir|off"
+     * (default: ./cornerCache)
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+    */
+    inline CornerCache getCornerCache(int argc, char** argv){
+        const std::string folder = getOptArg(argc, argv, "--corner-cache", "./cornerCache");
+        return CornerCache(folder == "off" ? "" : folder);
+    }
+
+} // namespace utils
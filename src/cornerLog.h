@@ -0,0 +1,163 @@
+#pragma once
+
+#include "utils.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+namespace utils {
+
+    /** Formats of the corner logs */
+    enum class CornerLogFormat { YAML, BINARY, BOTH };
+
+    /** Parse the corner log format from the optional command line argument "--corner-log yaml|binary|both"
+     * (default: yaml)
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+    */
+    inline CornerLogFormat getCornerLogFormat(int argc, char** argv){
+        const std::string format = getOptArg(argc, argv, "--corner-log", "yaml");
+        if (format == "binary")
+            return CornerLogFormat::BINARY;
+        if (format == "both")
+            return CornerLogFormat::BOTH;
+        return CornerLogFormat::YAML;
+    }
+
+    /** Log of the detected chess corners. The files are opened once and the entries are buffered,
+     * instead of reopening the log for each image.
+     *
+     * The YAML log has one "<keyPrefix><imgIdx>" node per image. The binary log (same path, ".bin" extension)
+     * is "CLG1" followed by one record per image (native byte order):
+     *      int32 imgIdx, uint32 numCorners, numCorners x (float x, float y)
+    */
+    class CornerLogWriter {
+    public:
+        /**
+         * @param yamlPath      Path of the YAML log. The binary log has the same path with the ".bin" extension
+         * @param keyPrefix     Prefix of the YAML keys (i.e. "image_")
+         * @param format        Formats to write
+        */
+        CornerLogWriter(const std::string &yamlPath, const std::string &keyPrefix, const CornerLogFormat format) : keyPrefix_(keyPrefix) {
+            if (format != CornerLogFormat::BINARY)
+                yaml_.open(yamlPath, cv::FileStorage::WRITE);
+            if (format != CornerLogFormat::YAML){
+                binary_.open(fs::path(yamlPath).replace_extension(".bin").u8string(), std::ios::binary);
+                binary_.write("CLG1", 4);
+            }
+        }
+
+        ~CornerLogWriter(){
+            flush();
+            if (yaml_.isOpened())
+                yaml_.release();
+        }
+
+        CornerLogWriter(const CornerLogWriter&) = delete;
+        CornerLogWriter& operator=(const CornerLogWriter&) = delete;
+
+        /** Add the corners of an image to the log
+         * @param imgIdx        Index of the image in the dataset
+         * @param chessCorners  Detected corners
+        */
+        void write(const int imgIdx, const std::vector<cv::Point2f> &chessCorners){
+            if (yaml_.isOpened())
+                yaml_ << keyPrefix_ + std::to_string(imgIdx) << chessCorners;
+            if (binary_.is_open()){
+                const int32_t idx = imgIdx;
+                const uint32_t numCorners = chessCorners.size();
+                append(&idx, sizeof(idx));
+                append(&numCorners, sizeof(numCorners));
+                append(chessCorners.data(), numCorners * sizeof(cv::Point2f));
+                if (buffer_.size() > (1 << 20))
+                    flush();
+            }
+        }
+
+    private:
+        void append(const void *data, const size_t size){
+            const char *bytes = static_cast<const char*>(data);
+            buffer_.insert(buffer_.end(), bytes, bytes + size);
+        }
+
+        void flush(){
+            if (binary_.is_open() && !buffer_.empty()){
+                binary_.write(buffer_.data(), buffer_.size());
+                buffer_.clear();
+            }
+        }
+
+        std::string keyPrefix_;
+        cv::FileStorage yaml_;
+        std::ofstream binary_;
+        std::vector<char> buffer_;
+    };
+
+    /** Read a binary corner log (see CornerLogWriter). Return false if the file is missing or malformed
+     * (including an entry with more corners than the rest of the file holds, e.g. a truncated or corrupt log)
+     * @param binPath       Path of the binary log
+     * @param imgIdxs       Index of the image of each entry (output)
+     * @param chessCorners  Corners of each entry (output)
+    */
+    inline bool readCornerLog(const std::string &binPath, std::vector<int> &imgIdxs, std::vector<std::vector<cv::Point2f>> &chessCorners){
+        std::ifstream in(binPath, std::ios::binary | std::ios::ate);
+        const std::streamoff fileSize = in.tellg();
+        in.seekg(0);
+        char magic[4];
+        if (!in.read(magic, 4) || std::string(magic, 4) != "CLG1")
+            return false;
+
+        imgIdxs.clear();
+        chessCorners.clear();
+        int32_t idx;
+        uint32_t numCorners;
+        while (in.read(reinterpret_cast<char*>(&idx), sizeof(idx))){
+            if (!in.read(reinterpret_cast<char*>(&numCorners), sizeof(numCorners)))
+                return false;
+            if (numCorners > (uint64_t)(fileSize - in.tellg()) / sizeof(cv::Point2f))
+                return false;
+            std::vector<cv::Point2f> corners(numCorners);
+            if (!in.read(reinterpret_cast<char*>(corners.data()), numCorners * sizeof(cv::Point2f)))
+                return false;
+            imgIdxs.emplace_back(idx);
+            chessCorners.emplace_back(std::move(corners));
+        }
+        return true;
+    }
+
+    /** Read the views of one or more binary corner logs, i.e. the history of previous calibrations.
+     * Views with a number of corners different from numCorners (another board) are skipped
+     * @param binPaths      Comma separated paths of the binary logs
+     * @param numCorners    Number of corners of the board
+     * @param imgIdxs       Index of the image of each view (output)
+     * @param chessCorners  Corners of each view (output)
+    */
+    inline bool readCornerHistory(const std::string &binPaths, const size_t numCorners, std::vector<int> &imgIdxs, 
+                            std::vector<std::vector<cv::Point2f>> &chessCorners){
+        imgIdxs.clear();
+        chessCorners.clear();
+        std::stringstream ss(binPaths);
+        std::string binPath;
+        while (std::getline(ss, binPath, ',')){
+            std::vector<int> logIdxs;
+            std::vector<std::vector<cv::Point2f>> logCorners;
+            if (!readCornerLog(binPath, logIdxs, logCorners))
+                return false;
+            for (size_t k = 0; k < logCorners.size(); k++){
+                if (logCorners[k].size() != numCorners)
+                    continue;
+                imgIdxs.emplace_back(logIdxs[k]);
+                chessCorners.emplace_back(std::move(logCorners[k]));
+            }
+        }
+        return true;
+    }
+
+} // namespace utils
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "utils.h"
+#include "cornerCache.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+namespace utils {
+
+    /** Return true if the corners form a plausible chessboard grid: neighbouring corners at least minSpacing pixels apart,
+     * corners evenly spaced along each row and column (perspective only changes the spacing gradually)
+     * and every cell with the same orientation (no fold or flip)
+     * @param corners       Corners, row by row
+     * @param boardSize     Width and height of the chessboard
+     * @param minSpacing    Minimum distance between neighbouring corners [px]
+    */
+    inline bool isValidGrid(const std::vector<cv::Point2f> &corners, const cv::Size &boardSize, const float minSpacing = 3){
+        if ((int)corners.size() != boardSize.area())
+            return false;
+        auto at = [&](const int r, const int c){ return corners[r * boardSize.width + c]; };
+        auto norm = [](const cv::Point2f &p){ return std::sqrt(p.dot(p)); };
+        const float maxBend = 0.3f;                         // Second difference, relative to the spacing
+        int orientation = 0;
+        for (int r = 0; r < boardSize.height; r++){
+            for (int c = 0; c < boardSize.width; c++){
+                if (c + 1 < boardSize.width && norm(at(r, c + 1) - at(r, c)) < minSpacing)
+                    return false;
+                if (r + 1 < boardSize.height && norm(at(r + 1, c) - at(r, c)) < minSpacing)
+                    return false;
+                if (c > 0 && c + 1 < boardSize.width){
+                    const cv::Point2f prev = at(r, c) - at(r, c - 1), next = at(r, c + 1) - at(r, c);
+                    if (norm(next - prev) > maxBend * std::max(norm(prev), norm(next)))
+                        return false;
+                }
+                if (r > 0 && r + 1 < boardSize.height){
+                    const cv::Point2f prev = at(r, c) - at(r - 1, c), next = at(r + 1, c) - at(r, c);
+                    if (norm(next - prev) > maxBend * std::max(norm(prev), norm(next)))
+                        return false;
+                }
+                if (c + 1 < boardSize.width && r + 1 < boardSize.height){
+                    const cv::Point2f right = at(r, c + 1) - at(r, c), down = at(r + 1, c) - at(r, c);
+                    const float cross = right.x * down.y - right.y * down.x;
+                    const int sign = cross > 0 ? 1 : -1;
+                    if (orientation != 0 && sign != orientation)
+                        return false;
+                    orientation = sign;
+                }
+            }
+        }
+        return true;
+    }
+
+    /** Corner finder for the frames of a sequence. The corners of the previous frame are carried forward with pyramidal
+     * Lucas-Kanade optical flow on a downscaled copy of the frames (min side of about 240 px), refined with cornerSubPix
+     * from that scale up to the full resolution and checked (all tracked, valid grid); the full detector
+     * (findChessCorners) runs only when there is nothing to track or tracking fails.
+     * Frames must be given in sequence order, from a single camera: use one tracker per camera (and per thread)
+    */
+    class CornerTracker {
+    public:
+        /**
+         * @param boardSize     Width and height of the chessboard
+         * @param settings      Settings of the full detector
+         * @param enabled       Track the corners (false: always run the full detector)
+        */
+        CornerTracker(const cv::Size &boardSize, const DetectorSettings &settings, const bool enabled = true)
+            : boardSize_(boardSize), settings_(settings), enabled_(enabled) {}
+
+        /** Find the chessboard corners of the next frame of the sequence
+         * @param imgGray       Gray frame (copied when tracking: the caller can reuse the buffer)
+         * @param chessCorners  Output corners
+         * @param detect        Run the full detector when tracking fails (false: only carry the corners forward,
+         *                      i.e. through the frames that are not used)
+        */
+        bool find(const cv::Mat &imgGray, std::vector<cv::Point2f> &chessCorners, const bool detect = true){
+            tracked_ = false;
+            if (!enabled_)
+                return detect && findChessCorners(imgGray, boardSize_.width, boardSize_.height, chessCorners, settings_);
+
+            // Flow on the full frame costs as much as the detector on large images: the motion is found at a coarse scale
+            // and cornerSubPix brings the corners back to full precision. The downscaled frame is kept for the next one
+            std::vector<cv::Mat> pyramid(1, imgGray);
+            {
+                TRACE_SCOPE("pyrDown");
+                while (std::min(pyramid.back().cols, pyramid.back().rows) / 2 >= 240){
+                    pyramid.emplace_back();
+                    cv::pyrDown(pyramid[pyramid.size() - 2], pyramid.back());
+                }
+            }
+            const int level = pyramid.size() - 1;
+
+            bool found = false;
+            DetectorStats &stats = DetectorStats::get();
+            if (!prevCorners_.empty() && prevRes_ == imgGray.size()){
+                TRACE_SCOPE("trackCorners");
+                stats.tracked++;
+                std::vector<cv::Point2f> prevCorners(prevCorners_.size());
+                for (size_t i = 0; i < prevCorners_.size(); i++)
+                    prevCorners[i] = prevCorners_[i] * (1.f / (1 << level));
+                std::vector<unsigned char> status;
+                std::vector<float> err;
+                cv::calcOpticalFlowPyrLK(prevImg_, pyramid[level], prevCorners, chessCorners, status, err, cv::Size(21,21), 2);
+                found = std::all_of(status.begin(), status.end(), [](const unsigned char s){ return s != 0; });
+                const cv::TermCriteria subPixCrit(cv::TermCriteria::Type::EPS | cv::TermCriteria::Type::MAX_ITER, 30, 0.001);
+                for (int l = level; found && l >= 0; l--){
+                    if (l < level)
+                        for (auto &p : chessCorners)
+                            p *= 2.f;
+                    found = std::all_of(chessCorners.begin(), chessCorners.end(), [&](const cv::Point2f &p){
+                                return p.x >= 0 && p.y >= 0 && p.x <= pyramid[l].cols - 1 && p.y <= pyramid[l].rows - 1; });
+                    if (found)
+                        cv::cornerSubPix(pyramid[l], chessCorners, cv::Size(5,5), cv::Size(-1,-1), subPixCrit);
+                }
+                found = found && isValidGrid(chessCorners, boardSize_);
+                if (found)
+                    stats.trackPassed++;
+                tracked_ = found;
+            }
+            if (!found && detect)
+                found = findChessCorners(imgGray, boardSize_.width, boardSize_.height, chessCorners, settings_);
+
+            // Track from this frame only if the board is in it
+            prevRes_ = imgGray.size();
+            prevImg_ = level > 0 ? pyramid[level] : imgGray.clone();
+            if (found)
+                prevCorners_ = chessCorners;
+            else
+                prevCorners_.clear();
+            return found;
+        }
+
+        /** Forget the previous frame: the next one is detected, not tracked (i.e. after a frame not seen by the tracker) */
+        void reset(){
+            prevCorners_.clear();
+            prevImg_.release();
+        }
+
+        /** Return true if the corners of the last frame come from tracking, not from the full detector */
+        bool tracked() const { return tracked_; }
+
+        cv::Size getBoardSize() const { return boardSize_; }
+
+    private:
+        cv::Size boardSize_;
+        DetectorSettings settings_;
+        bool enabled_;
+        bool tracked_ = false;
+        cv::Size prevRes_;
+        cv::Mat prevImg_;                                   // Previous frame, downscaled to the tracking scale
+        std::vector<cv::Point2f> prevCorners_;              // Corners of the previous frame (empty: board not found)
+    };
+
+    /** Find the corners of the next image of a sequence, unless they are in the corner cache. A cache hit resets the tracker,
+     * so the next image is never tracked from an older one. Only the results of the full detector are stored: the entries
+     * stay content-addressed (the same for any split of the sequence) and are shared with the runs without tracking
+     * @param cornerCache   Corner cache
+     * @param detectorKey   Key of the full detector (see getDetectorKey)
+     * @param img           Next image of the sequence
+     * @param tracker       Tracker of the sequence
+     * @param chessCorners  Output corners
+    */
+    inline bool findSequenceCorners(const CornerCache &cornerCache, const std::string &detectorKey, ImgSource &img, CornerTracker &tracker,
+                                    std::vector<cv::Point2f> &chessCorners){
+        bool found;
+        if (cornerCache.lookup(img.encoded(), detectorKey, tracker.getBoardSize().area(), found, chessCorners)){
+            tracker.reset();
+            return found;
+        }
+        found = tracker.find(img.gray(), chessCorners);
+        if (!tracker.tracked())
+            cornerCache.insert(img.encoded(), detectorKey, found, chessCorners);
+        return found;
+    }
+
+} // namespace utils
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "utils.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+namespace utils {
+
+    /** Which debug images are written */
+    enum class DebugMode { OFF, FOUND, FAILED, OUTLIERS, ALL };
+
+    /** Settings of the debug image writer */
+    struct DebugSettings {
+        DebugMode mode = DebugMode::FOUND;
+        double scale = 1.0;                             // Scale of the written images (< 1 for thumbnails)
+        size_t memoryBudget = 256 << 20;                // Max bytes of images waiting to be written
+        unsigned int numThreads = 0;                    // Writer threads (0: a quarter of the hardware threads, 1 to 4)
+    };
+
+    /** Parse the debug settings from the optional command line arguments:
+     *      --debug-images off|found|failed|outliers|all    Which views are written
+     *      --debug-scale S                                 Scale of the written images
+     *      --debug-memory MB                               Memory budget of the images waiting to be written
+     *      --debug-threads N                               Number of writer threads
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+     * @param defaultMode   Mode used when --debug-images is not given
+    */
+    inline DebugSettings getDebugSettings(int argc, char** argv, const std::string &defaultMode){
+        DebugSettings settings;
+        const std::string mode = getOptArg(argc, argv, "--debug-images", defaultMode);
+        if (mode == "off")
+            settings.mode = DebugMode::OFF;
+        else if (mode == "failed")
+            settings.mode = DebugMode::FAILED;
+        else if (mode == "outliers")
+            settings.mode = DebugMode::OUTLIERS;
+        else if (mode == "all")
+            settings.mode = DebugMode::ALL;
+        else
+            settings.mode = DebugMode::FOUND;
+        settings.scale = std::stod(getOptArg(argc, argv, "--debug-scale", "1"));
+        settings.memoryBudget = std::stoul(getOptArg(argc, argv, "--debug-memory", "256")) << 20;
+        settings.numThreads = std::stoul(getOptArg(argc, argv, "--debug-threads", "0"));
+        return settings;
+    }
+
+    /** Return the indices of the views whose reprojection error is larger than factor times the median one
+     * @param perViewReprErr    Per-view reprojection error
+     * @param factor            Outlier threshold, relative to the median error
+    */
+    inline std::vector<size_t> getOutlierViews(const std::vector<double> &perViewReprErr, const double factor = 2.0){
+        std::vector<size_t> outliers;
+        if (perViewReprErr.empty())
+            return outliers;
+        std::vector<double> sorted = perViewReprErr;
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+        const double threshold = factor * sorted[sorted.size() / 2];
+        for (size_t k = 0; k < perViewReprErr.size(); k++){
+            if (perViewReprErr[k] > threshold)
+                outliers.push_back(k);
+        }
+        return outliers;
+    }
+
+    /** Write debug images (with the chessboard corners drawn on them) from a small pool of background threads, so that
+     * decoding, drawing and encoding never run on the detection or calibration path, and keep up with parallel detection.
+     * Images waiting to be written are limited by a memory budget (images given by path count with their decoded size):
+     * when it is exceeded, write() waits for the queue to drain. The destructor writes all the pending images.
+    */
+    class DebugWriter {
+    public:
+        explicit DebugWriter(const DebugSettings &settings) : settings_(settings) {
+            if (settings_.mode == DebugMode::OFF)
+                return;
+            unsigned int numThreads = settings_.numThreads;
+            if (numThreads == 0)
+                numThreads = std::min(4u, std::max(1u, std::thread::hardware_concurrency() / 4));
+            for (unsigned int t = 0; t < numThreads; t++)
+                threads_.emplace_back(&DebugWriter::run, this);
+        }
+
+        ~DebugWriter(){
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cvPush_.notify_all();
+            for (auto &thread : threads_)
+                thread.join();
+        }
+
+        DebugWriter(const DebugWriter&) = delete;
+        DebugWriter& operator=(const DebugWriter&) = delete;
+
+        /** Return true if a view with the given detection outcome has to be written now */
+        bool wants(const bool found) const {
+            switch (settings_.mode){
+                case DebugMode::FOUND:  return found;
+                case DebugMode::FAILED: return !found;
+                case DebugMode::ALL:    return true;
+                default:                return false;
+            }
+        }
+
+        /** Return true if the views with a high reprojection error have to be written after the calibration */
+        bool wantsOutliers() const { return settings_.mode == DebugMode::OUTLIERS; }
+
+        /** Queue an image for writing. The image data is shared, not copied: the caller must not modify it
+         * @param filepath      File output path
+         * @param img           Image to be written
+         * @param boardSize     Width and height of the chessboard
+         * @param chessCorners  Chess corners
+         * @param found         Whether the board was found (changes how the corners are drawn)
+        */
+        void write(const std::string &filepath, const cv::Mat &img, const cv::Size &boardSize,
+                    const std::vector<cv::Point2f> &chessCorners, const bool found){
+            push(Job{filepath, "", img, boardSize, chessCorners, found, img.total() * img.elemSize()});
+        }
+
+        /** Queue an image for writing. The source image is read and decoded by a writer thread
+         * @param filepath      File output path
+         * @param srcPath       Path of the source image
+        */
+        void write(const std::string &filepath, const std::string &srcPath, const cv::Size &boardSize,
+                    const std::vector<cv::Point2f> &chessCorners, const bool found){
+            push(Job{filepath, srcPath, cv::Mat(), boardSize, chessCorners, found, getDecodedSize(srcPath)});
+        }
+
+    private:
+        struct Job {
+            std::string filepath, srcPath;
+            cv::Mat img;
+            cv::Size boardSize;
+            std::vector<cv::Point2f> chessCorners;
+            bool found;
+            size_t bytes;                               // Memory held by the job once decoded
+        };
+
+        /** Estimate the size of the decoded color image from the header of the file, else from the last decoded image */
+        size_t getDecodedSize(const std::string &srcPath) const {
+            cv::Size imgRes;
+            if (readImgResFromHeader(srcPath, imgRes))
+                return (size_t)imgRes.area() * 3;
+            return lastDecodedBytes_;
+        }
+
+        void push(Job &&job){
+            if (settings_.mode == DebugMode::OFF)
+                return;
+            std::unique_lock<std::mutex> lock(mutex_);
+            // Wait for room, but always accept a job when nothing is pending (an image larger than the budget)
+            cvPop_.wait(lock, [&](){ return queuedBytes_ == 0 || queuedBytes_ + job.bytes <= settings_.memoryBudget; });
+            queuedBytes_ += job.bytes;
+            queue_.emplace_back(std::move(job));
+            cvPush_.notify_one();
+        }
+
+        void run(){
+            while (true){
+                Job job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cvPush_.wait(lock, [&](){ return stop_ || !queue_.empty(); });
+                    if (queue_.empty())
+                        return;
+                    job = std::move(queue_.front());
+                    queue_.pop_front();
+                }
+                writeJob(job);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    queuedBytes_ -= job.bytes;
+                }
+                cvPop_.notify_all();
+            }
+        }
+
+        void writeJob(Job &job){
+            TRACE_SCOPE("debugImage");
+            cv::Mat img = job.img.empty() ? cv::imread(job.srcPath, cv::IMREAD_COLOR) : job.img;
+            if (img.empty()){
+                std::cerr << "\tCannot write debug image " << job.filepath << "\n";
+                return;
+            }
+            if (job.img.empty())
+                lastDecodedBytes_ = img.total() * img.elemSize();
+
+            // Downscale to a thumbnail, corners included
+            if (settings_.scale > 0 && settings_.scale < 1){
+                cv::Mat thumb;
+                cv::resize(img, thumb, cv::Size(), settings_.scale, settings_.scale, cv::INTER_AREA);
+                img = thumb;
+                for (auto &corner : job.chessCorners)
+                    corner *= (float)settings_.scale;
+            }
+
+            if (job.chessCorners.empty()){
+                cv::imwrite(job.filepath, img);
+            } else if (job.found){
+                saveChessCornersAsImg(job.filepath, img, job.boardSize, job.chessCorners);
+            } else {
+                // Partial detections are drawn in red, without the grid lines
+                cv::Mat chessImg = img.clone();
+                cv::drawChessboardCorners(chessImg, job.boardSize, job.chessCorners, false);
+                cv::imwrite(job.filepath, chessImg);
+            }
+        }
+
+        DebugSettings settings_;
+        std::deque<Job> queue_;
+        size_t queuedBytes_ = 0;
+        bool stop_ = false;
+        std::mutex mutex_;
+        std::condition_variable cvPush_, cvPop_;
+        std::atomic<size_t> lastDecodedBytes_{0};
+        std::vector<std::thread> threads_;
+    };
+
+} // namespace utils
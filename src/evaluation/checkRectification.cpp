@@ -1,4 +1,12 @@
 #include "../utils.h"
+#include "../cornerCache.h"
+#include "../debugWriter.h"
+#include "../gridMap.h"
+#include "../rectifier.h"
+#include "../stereoCalib.h"
+#include "../calibBundle.h"
+#include "../cornerLog.h"
+#include "../streamingStats.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -10,6 +18,11 @@
 #include <iostream>
 #include <fstream>
 #include <numeric>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <functional>
+#include <memory>
 #include <regex>
 #include <math.h>
 namespace fs = std::experimental::filesystem;
@@ -20,50 +33,108 @@ const std::string logFolder = "./logCheckRectification";           // Script out
 
 
 /**
- * Save rectified image in the log folder
+ * Return the path of a rectified image in the log folder
  * 
- * @param imgRect       Rectified image
  * @param refImgPath    Absolute filepath of the original image (from which the rectified image was generated).
  *                      This is used to name the rectified image as the original image.
  * @param serial        Serial of the camera that acquired the image. Used to name the rectified image
  */  
-void saveRectifiedImage(const cv::Mat &imgRect, const std::string &origImgPath, const std::string &serial);
+std::string getRectifiedImagePath(const std::string &origImgPath, const std::string &serial);
+
+/**
+ * Hash the content of a list of matrices (i.e. the calibration parameters used to rectify an image)
+ * 
+ * @param mats          Input matrices
+ */
+uint64_t hashMats(const std::vector<cv::Mat> &mats);
 
 /**
  * Compute median, mean and standard deviation of a vector of float
  * 
- * @param vec           Input vector
+ * @param vec           Input vector (reordered)
  * @param median        Output median
  * @param mean          Output mean
  * @param std           Output standard deviation
  */
-void computeStatistics(std::vector<float> vec, float &median, float &mean, float &std);
+void computeStatistics(std::vector<float> &vec, float &median, float &mean, float &std);
+
+/**
+ * Evaluate the image pairs in parallel. Log the statistics of each pair to yDisparities.txt (in input order),
+ * and the statistics of all the Y disparities of the dataset: exact mean and standard deviation, quantiles
+ * from a mergeable sketch (0.5% relative accuracy). Return the number of valid pairs
+ * 
+ * @param numPairs      Number of image pairs
+ * @param numThreads    Number of threads (0: one per core)
+ * @param evaluatePair  Compute the Y disparities of a pair. Return false if the chessboard is not found in both images
+ */
+int evaluateDataset(const size_t numPairs, const unsigned int numThreads,
+                    const std::function<bool(size_t, std::vector<float>&)> &evaluatePair);
+
+/**
+ * Sparse evaluation: map the corners detected on the original images (or read from the corner logs of a
+ * calibration) to the rectified images with cv::undistortPoints, without remapping the images.
+ * Write the same Y disparity statistics of the image-based evaluation. Return the exit code
+ * 
+ * @param imgPathsL     Left image paths
+ * @param imgPathsR     Right image paths
+ * @param boardSize     Chessboard size (corner intersections)
+ * @param camL          Left camera matrix, distortion, rectification rotation and projection
+ * @param camR          Right camera matrix, distortion, rectification rotation and projection
+ * @param settings      Detector settings
+ * @param cornerCache   Cache of the corners detected on the original images
+ * @param cornerLogL    Binary corner log of the left images (empty: detect the corners)
+ * @param cornerLogR    Binary corner log of the right images (empty: detect the corners)
+ * @param numThreads    Number of threads (0: one per core)
+ */
+int evaluateSparse(const std::vector<std::string> &imgPathsL, const std::vector<std::string> &imgPathsR, const cv::Size &boardSize,
+                    const std::vector<cv::Mat> &camL, const std::vector<cv::Mat> &camR, const utils::DetectorSettings &settings,
+                    const utils::CornerCache &cornerCache, const std::string &cornerLogL, const std::string &cornerLogR,
+                    const unsigned int numThreads);
 
 
 int main(int argc, char** argv) {
     if (argc < 8){
-        std::cerr << "Usage: ./checkRectification calibL calibR calibStereo calibRectify imgFolderL imgFolderR extension\n";
+        std::cerr << "Usage: ./checkRectification calibL calibR calibStereo calibRectify imgFolderL imgFolderR extension "
+            "[--mode images|sparse] [--threads N] [--corners-left log.bin --corners-right log.bin] [--map-format float|fixed|grid] [--grid-step px] [--grid-interp linear|cubic] [--grid-map gridmapL.yml gridmapR.yml] [--pyramid off|auto|N] [--detector classic|sb] [--fast-reject] [--corner-cache dir|off] "
+            "[--debug-images off|found|failed|all] [--debug-scale S] [--debug-memory MB] [--debug-threads N] [--trace trace.json]\n";
         return 1;
     }
-    cv::FileStorage fsL(argv[1], cv::FileStorage::READ);        // Reader of left camera calibration file
-    cv::FileStorage fsR(argv[2], cv::FileStorage::READ);        // Reader of right camera calibration file
-    cv::FileStorage fsS(argv[3], cv::FileStorage::READ);        // Reader of stereo calibration file
-    cv::FileStorage fsRect(argv[4], cv::FileStorage::READ);     // Reader of the rectificaton file
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
     const std::string imgFolderL = argv[5];                     // Path to the left image folder
     const std::string imgFolderR = argv[6];                     // Path to the right image folder
     const std::string extension = argv[7];                      // Image extension/format
-    //
-    std::string serialL, serialR;                               // Serial of the left and right cameras
-    //
-    int boardWidth, boardHeight;                                // Chessboard width, height and cell size.
-    float cellSize;                                             // Chessboard cell size
-    //
-    cv::Mat KL, DL, KR, DR;                                     // Instrinsic parameters of the cameras
-    cv::Mat R;                                                  // Relative rotation of the left camera wrt the right camera                   
-    cv::Vec3d T;                                                // Relative translation the left camera wrt the right camera
-    cv::Mat RL, RR, PL, PR;                                     // Rectification projection and rotation m
-    
-
+    const std::string evalMode = utils::getOptArg(argc, argv, "--mode", "images");         // Rectify the images or only the corners
+    const std::string cornerLogL = utils::getOptArg(argc, argv, "--corners-left", "");      // Corner logs (sparse mode only)
+    const std::string cornerLogR = utils::getOptArg(argc, argv, "--corners-right", "");
+    const unsigned int numThreads = std::stoul(utils::getOptArg(argc, argv, "--threads", "0"));    // Image pairs evaluated in parallel (0: one per core)
+    const std::string mapFormat = utils::getOptArg(argc, argv, "--map-format", "float");   // Rectification maps format
+    const int gridStep = std::stoi(utils::getOptArg(argc, argv, "--grid-step", "16"));      // Control point distance of the grid maps [px]
+    const std::string gridInterp = utils::getOptArg(argc, argv, "--grid-interp", "cubic");
+    const std::vector<std::string> gridMapPaths = utils::getOptArgs(argc, argv, "--grid-map", 2);  // Grid maps exported by stereoRectify
+    const utils::DetectorSettings detectorSettings = utils::getDetectorSettings(argc, argv);
+    const utils::CornerCache cornerCache = utils::getCornerCache(argc, argv);
+    utils::DebugWriter debugWriter(utils::getDebugSettings(argc, argv, "all"));         // Writer of the rectified images
+    stereocalib::GridInterpolation gridInterpolation;
+    if (evalMode != "images" && evalMode != "sparse"){
+        std::cerr << "Unknown evaluation mode " << evalMode << ", use images or sparse\n";
+        return 1;
+    }
+    if (cornerLogL.empty() != cornerLogR.empty()){
+        std::cerr << "Give the corner logs of both cameras\n";
+        return 1;
+    }
+    if (mapFormat != "float" && mapFormat != "fixed" && mapFormat != "grid"){
+        std::cerr << "Unknown map format " << mapFormat << ", use float, fixed or grid\n";
+        return 1;
+    }
+    if (!stereocalib::parseGridInterpolation(gridInterp, gridInterpolation) || gridStep <= 0){
+        std::cerr << "Invalid grid map settings, use a positive step and linear or cubic interpolation\n";
+        return 1;
+    }
+    if (!gridMapPaths.empty() && mapFormat != "grid"){
+        std::cerr << "--grid-map needs --map-format grid\n";
+        return 1;
+    }
     // Load left and right image paths
     const std::vector<std::string> imgPathsL = utils::getImgPaths(imgFolderL, extension);
     const std::vector<std::string> imgPathsR = utils::getImgPaths(imgFolderR, extension);
@@ -76,31 +147,43 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    // Load camera serials
-    fsS["Serial_left"] >> serialL;
-    fsS["Serial_right"] >> serialR;
+    // All the images must have the same resolution, as the rectification maps are computed once
+    cv::Size imgResL, imgResR;
+    if (evalMode == "images" && (!utils::checkImgsResolution(imgPathsL, imgResL) || !utils::checkImgsResolution(imgPathsR, imgResR))){
+        std::cerr << "Found inconsistencies in the image resolutions. Check your data\n";
+        return 1;
+    }
 
-    // Load chessboard information
-    if (!utils::loadAndCheckChessboardData(fsL, fsR, boardWidth, boardHeight, cellSize)){
+    // Load the calibration: everything from a bundle (calibL; calibR, calibStereo and calibRectify are not read),
+    // or the single camera and rectification YAML files (the stereo pose is not needed)
+    const bool bundleInput = stereocalib::isCalibBundle(argv[1]);
+    const std::string calibPathR = bundleInput ? argv[1] : argv[2];
+    const std::string rectPath = bundleInput ? argv[1] : argv[4];
+    stereocalib::MonoCalibration calibL, calibR;
+    stereocalib::Rectification rect;
+    stereocalib::Board board, boardR;
+    std::string serialL, serialR;                               // Serial of the left and right cameras
+    if (!stereocalib::readMonoCalibration(argv[1], calibL, 0) || !stereocalib::readMonoCalibration(calibPathR, calibR, 1) ||
+        !stereocalib::readRectification(rectPath, rect) || !stereocalib::readBoard(argv[1], board) || !stereocalib::readBoard(calibPathR, boardR) ||
+        !stereocalib::readSerial(argv[1], serialL, 0) || !stereocalib::readSerial(calibPathR, serialR, 1)){
+        std::cerr << "Cannot read the stereo calibration from " << (bundleInput ? argv[1] : "the calibration files") << "\n";
+        return 1;
+    }
+    if (board.width != boardR.width || board.height != boardR.height || board.cellSize != boardR.cellSize){
         std::cerr << "Chessboard data inconsistencies between left and right calibrations. Check your data\n";
         return 1;
     }
+    const int boardWidth = board.width, boardHeight = board.height;
 
-    // Load intrinsic parameters of the cameras
-    fsL["K"] >> KL;
-    fsL["D"] >> DL;
-    fsR["K"] >> KR;
-    fsR["D"] >> DR;
-
-    // Load stereo calibration (R and t between left and right cameras)
-    fsS["R"] >> R;
-    fsS["T"] >> T;
-
-    // Load rectification matrices
-    fsRect["R1"] >> RL;
-    fsRect["R2"] >> RR;
-    fsRect["P1"] >> PL;
-    fsRect["P2"] >> PR;
+    if (evalMode == "sparse")
+        return evaluateSparse(imgPathsL, imgPathsR, board.size(), {calibL.K, calibL.D, rect.R1, rect.P1}, {calibR.K, calibR.D, rect.R2, rect.P2},
+                                detectorSettings, cornerCache, cornerLogL, cornerLogR, numThreads);
+    if (imgResL != imgResR){
+        std::cerr << "Left and right images must have the same resolution\n";
+        return 1;
+    }
+    calibL.imgRes = imgResL;                                    // The maps are computed for the resolution of the images
+    calibR.imgRes = imgResR;
 
     // Create output/log folder and folders for the rectified images
     fs::create_directory(logFolder);
@@ -108,78 +191,121 @@ int main(int argc, char** argv) {
     fs::create_directory(logFolder + "/" + serialR + "Rect");
 
 
-    /* EVALUATION LOOP
+    // Compute the rectification maps once. CV_16SC2 maps store fixed-point coordinates and interpolation 
+    // indices: they take half the memory of the CV_32F ones and make remap faster, at the cost of 
+    // a 1/32 pixel quantization of the sampling positions. Grid maps only store a control point every
+    // gridStep pixels and interpolate the dense map on the fly, trading accuracy for memory.
+    // The pairs are evaluated in parallel: the rectifier has no worker of its own (see StereoRectifier::rectifyImage)
+    std::unique_ptr<stereocalib::StereoRectifier> rectifier;
+    stereocalib::GridMap grids[2];
+    if (mapFormat == "grid" && !gridMapPaths.empty()) {
+        // Exported grid maps (stereoRectify --export-grid): nothing to compute, and no dense map to compare with
+        if (!stereocalib::readGridMap(gridMapPaths[0], grids[0]) || grids[0].imgRes != imgResL ||
+            !stereocalib::readGridMap(gridMapPaths[1], grids[1]) || grids[1].imgRes != imgResR){
+            std::cerr << "Invalid grid maps " << gridMapPaths[0] << " and " << gridMapPaths[1] << " for images of resolution "
+                << imgResL << " and " << imgResR << "\n";
+            return 1;
+        }
+        std::cout << "Rectification grid maps loaded (step " << grids[0].step << "): " << (grids[0].memory() + grids[1].memory()) / 1024.0 << " KB\n";
+        rectifier.reset(new stereocalib::StereoRectifier(grids, 1));
+    } else if (mapFormat == "grid") {
+        grids[0] = stereocalib::computeGridMap(calibL.K, calibL.D, rect.R1, rect.P1, imgResL, gridStep, gridInterpolation);
+        grids[1] = stereocalib::computeGridMap(calibR.K, calibR.D, rect.R2, rect.P2, imgResR, gridStep, gridInterpolation);
+        std::cout << "Rectification grid maps computed (step " << gridStep << ", " << gridInterp << "): "
+            << (grids[0].memory() + grids[1].memory()) / 1024.0 << " KB instead of " << 8.0 * (imgResL.area() + imgResR.area()) / (1024 * 1024)
+            << " MB, max deviation from the dense maps " << stereocalib::gridMapMaxError(grids[0], calibL.K, calibL.D, rect.R1, rect.P1) << " px (left) "
+            << stereocalib::gridMapMaxError(grids[1], calibR.K, calibR.D, rect.R2, rect.P2) << " px (right)\n";
+        rectifier.reset(new stereocalib::StereoRectifier(grids, 1));
+    } else {
+        rectifier.reset(new stereocalib::StereoRectifier(calibL, calibR, rect, mapFormat == "fixed", 1));
+        std::cout << "Rectification maps computed (" << mapFormat << ")\n";
+    }
+
+    // The corners are detected on the rectified images: their cache keys also depend on the rectification.
+    // Grid maps are described by their own step and interpolation (the loaded ones may differ from --grid-step and --grid-interp)
+    const std::string detectorKey = utils::getDetectorKey(board.size(), detectorSettings) + "_rect" + mapFormat;
+    auto getGridKey = [&](const stereocalib::GridMap &grid) {
+        if (mapFormat != "grid")
+            return std::string();
+        return std::to_string(grid.step) + (grid.interpolation == stereocalib::GridInterpolation::LINEAR ? "linear" : "cubic");
+    };
+    const std::string detectorKeyL = detectorKey + getGridKey(grids[0]) +
+        std::to_string(gridMapPaths.empty() ? hashMats({calibL.K, calibL.D, rect.R1, rect.P1}) : hashMats({grids[0].points}));
+    const std::string detectorKeyR = detectorKey + getGridKey(grids[1]) +
+        std::to_string(gridMapPaths.empty() ? hashMats({calibR.K, calibR.D, rect.R2, rect.P2}) : hashMats({grids[1].points}));
+
+
+    /* EVALUATION LOOP (parallel on the image pairs)
     For each image pair (l,r), compute:
         1) Rectified images (lRect, rRect)
         2) Chess corners on lRect and rRect
         3) For each corner pair (cl,cr), compute yDisparity = abs(cl.y - cr.y)
     */
-    int validPairs = 0;                                                                 // Number of pairs with detected chessboard corners in both images (left,right)
-    float accumMedian = 0, accumMean = 0, accumStd = 0;                                 // Dataset Y disparity statistics
-    //
-    std::ofstream evalOut;                                                              // File logger                                                      
-    evalOut.open(logFolder + "/yDisparities.txt", std::ios::app);
-    evalOut << "#Median mean std\n";                                                    // Each line is an image in reading order (images sorted alphabetically)
-    //
-    for (unsigned int i=0; i<imgPathsL.size(); i++) {
-        cv::Mat imgL, imgR, imgRectL, imgRectR;
-        imgL = cv::imread(imgPathsL[i], cv::IMREAD_COLOR);
-        imgR = cv::imread(imgPathsR[i], cv::IMREAD_COLOR);
-
-        // Rectify the images
-        cv::Mat mapXL, mapYL, mapXR, mapYR;
-        cv::initUndistortRectifyMap(KL, DL, RL, PL, imgL.size(), CV_32F, mapXL, mapYL); 
-        cv::initUndistortRectifyMap(KR, DR, RR, PR, imgR.size(), CV_32F, mapXR, mapYR);
-        cv::remap(imgL, imgRectL, mapXL, mapYL, cv::INTER_LINEAR);
-        cv::remap(imgR, imgRectR, mapXR, mapYR, cv::INTER_LINEAR);
+    std::vector<double> rectTimes(imgPathsL.size(), 0);                                // Time spent remapping each pair [ms]
+    evaluateDataset(imgPathsL.size(), numThreads, [&](const size_t i, std::vector<float> &yDisparities) {
+        TRACE_SCOPE("imagePair");
+
+        // The rectified images are saved in color, so this is the only decode needed
+        utils::ImgSource imgSrcL(imgPathsL[i]), imgSrcR(imgPathsR[i]);
+        const cv::Mat &imgL = imgSrcL.color(), &imgR = imgSrcR.color();
+        cv::Mat imgRectL, imgRectR;                                                     // Color rectified images (only when written)
+        cv::Mat imgRectGrayL, imgRectGrayR;
+
+        // Rectify the images straight to grayscale: with fixed-point maps, sampling and color conversion are
+        // fused in one pass (no intermediate color image). Otherwise the color image is kept for the debug writer
+        const int64 rectStart = cv::getTickCount();
+        {
+            TRACE_SCOPE("remap");
+            if (mapFormat == "fixed") {
+                rectifier->rectifyImage(0, imgL, imgRectGrayL, true);
+                rectifier->rectifyImage(1, imgR, imgRectGrayR, true);
+            } else {
+                rectifier->rectifyImage(0, imgL, imgRectL);
+                rectifier->rectifyImage(1, imgR, imgRectR);
+                cv::cvtColor(imgRectL, imgRectGrayL, cv::COLOR_BGR2GRAY);
+                cv::cvtColor(imgRectR, imgRectGrayR, cv::COLOR_BGR2GRAY);
+            }
+        }
+        rectTimes[i] = 1000.0 * (cv::getTickCount() - rectStart) / cv::getTickFrequency();
+        std::ostringstream progress;                                                    // One write per line: the threads do not interleave
+        progress << "\t" << imgPathsL[i] << " - " << imgPathsR[i] << ": rectified in " << rectTimes[i] << " ms\n";
+        std::cout << progress.str();
 
         // Compute the chess corners and save them (on the rectified images)
         std::vector<cv::Point2f> chessCornersL, chessCornersR;
-        cv::Mat imgRectGrayL, imgRectGrayR;
-        cv::cvtColor(imgRectL, imgRectGrayL, cv::COLOR_BGR2GRAY);
-        cv::cvtColor(imgRectR, imgRectGrayR, cv::COLOR_BGR2GRAY);
-        const bool cornersFoundL = utils::findChessCorners(imgRectGrayL, boardWidth, boardHeight, chessCornersL);
-        const bool cornersFoundR = utils::findChessCorners(imgRectGrayR, boardWidth, boardHeight, chessCornersR);
-        //
-        cv::drawChessboardCorners(imgRectL, cv::Size(boardWidth, boardHeight), chessCornersL, cornersFoundL);
-        cv::drawChessboardCorners(imgRectR, cv::Size(boardWidth, boardHeight), chessCornersR, cornersFoundR);
-        saveRectifiedImage(imgRectL, imgPathsL[i], serialL);
-        saveRectifiedImage(imgRectR, imgPathsR[i], serialR);
+        const bool cornersFoundL = cornerCache.findChessCorners(imgSrcL.encoded(), detectorKeyL, boardWidth * boardHeight, [&](std::vector<cv::Point2f> &chessCorners){
+            return utils::findChessCorners(imgRectGrayL, boardWidth, boardHeight, chessCorners, detectorSettings);
+        }, chessCornersL);
+        const bool cornersFoundR = cornerCache.findChessCorners(imgSrcR.encoded(), detectorKeyR, boardWidth * boardHeight, [&](std::vector<cv::Point2f> &chessCorners){
+            return utils::findChessCorners(imgRectGrayR, boardWidth, boardHeight, chessCorners, detectorSettings);
+        }, chessCornersR);
         //
-        if (!cornersFoundL || !cornersFoundR) {
-            evalOut << "Nan Nan NaN\n"; 
-            continue;
+        if (debugWriter.wants(cornersFoundL && cornersFoundR)) {
+            if (imgRectL.empty()) {
+                TRACE_SCOPE("remapColor");
+                rectifier->rectifyImage(0, imgL, imgRectL);
+                rectifier->rectifyImage(1, imgR, imgRectR);
+            }
+            debugWriter.write(getRectifiedImagePath(imgPathsL[i], serialL), imgRectL, cv::Size(boardWidth, boardHeight), chessCornersL, cornersFoundL);
+            debugWriter.write(getRectifiedImagePath(imgPathsR[i], serialR), imgRectR, cv::Size(boardWidth, boardHeight), chessCornersR, cornersFoundR);
         }
+        //
+        if (!cornersFoundL || !cornersFoundR)
+            return false;
 
         // Compute y disparities between left and right corners
-        std::vector<float> yDisparities;
         yDisparities.reserve(chessCornersL.size());
-        for (unsigned int i=0; i<chessCornersL.size(); i++) {
-            yDisparities.emplace_back(sqrt(pow(chessCornersL[i].y - chessCornersR[i].y, 2)));
+        for (unsigned int k=0; k<chessCornersL.size(); k++) {
+            yDisparities.emplace_back(std::abs(chessCornersL[k].y - chessCornersR[k].y));
         }
-
-        // Compute statistics 
-        float median, mean, std;
-        computeStatistics(yDisparities, mean, median, std);
-        evalOut << median << " " << mean << " " << std << std::endl;
-
-        // Update dataset statistics
-        accumMedian += median;
-        accumMean += mean;
-        accumStd += std;
-        validPairs++;
-    }
-    evalOut.close();
-    std::cout << "\nEVALUATION TERMINATED***\n\tY disparity on the whole dataset (" <<
-        validPairs << " valid image pairs) [median, mean, std]: [" <<
-        accumMedian / (float) validPairs << ", " <<
-        accumMean / (float) validPairs <<  ", " <<
-        accumStd / (float) validPairs << "]" << std::endl;
+        return true;
+    });
+    std::cout << "\tAverage rectification time per pair: " << std::accumulate(rectTimes.begin(), rectTimes.end(), 0.0) / imgPathsL.size() << " ms" << std::endl;
 
     return 0;
 }
 
-void saveRectifiedImage(const cv::Mat &imgRect, const std::string &origImgPath, const std::string &serial) {
+std::string getRectifiedImagePath(const std::string &origImgPath, const std::string &serial) {
     // Get the original image name from the absolute path
     std::regex reg("([^\\/]+)+$");
     auto words_begin = std::regex_iterator(origImgPath.begin(), origImgPath.end(), reg);
@@ -189,22 +315,142 @@ void saveRectifiedImage(const cv::Mat &imgRect, const std::string &origImgPath,
         origImgName = i->str();
     }
 
-    // Save the rectified image
-    cv::imwrite(logFolder + "/" + serial + "Rect/" + origImgName, imgRect);
+    return logFolder + "/" + serial + "Rect/" + origImgName;
 }
 
-void computeStatistics(std::vector<float> vec, float &median, float &mean, float &std) {
-    // Sort the vector and compute the median
-    std::sort(vec.begin(), vec.end());
+void computeStatistics(std::vector<float> &vec, float &median, float &mean, float &std) {
+    // Partial sort for the median: only the middle element is put in place
+    std::nth_element(vec.begin(), vec.begin() + vec.size()/2, vec.end());
     median = vec[vec.size()/2];
 
-    // Compute the mean
-    mean = (std::accumulate(vec.begin(), vec.end(), 0.0) / vec.size());
+    // Mean and standard deviation in one pass
+    utils::RunningStats stats;
+    for (const float d : vec)
+        stats.add(d);
+    mean = stats.mean();
+    std = stats.std();
+}
+
+uint64_t hashMats(const std::vector<cv::Mat> &mats) {
+    uint64_t hash = utils::hashBytes(nullptr, 0);
+    for (const cv::Mat &mat : mats) {
+        const cv::Mat cont = mat.clone();                                  // clone() returns a continuous matrix
+        hash = utils::hashBytes(cont.data, cont.total() * cont.elemSize(), hash);
+    }
+    return hash;
+}
+
+int evaluateDataset(const size_t numPairs, const unsigned int numThreads,
+                    const std::function<bool(size_t, std::vector<float>&)> &evaluatePair) {
+    struct PairStats { bool valid = false; float median = 0, mean = 0, std = 0; };
+    std::vector<PairStats> pairStats(numPairs);
+    utils::RunningStats datasetStats;                                                   // All the Y disparities of the dataset
+    utils::QuantileSketch datasetQuantiles;
+    std::mutex mutex;
+    utils::parallelFor(numPairs, numThreads, [&](size_t i) {
+        std::vector<float> yDisparities;
+        if (!evaluatePair(i, yDisparities) || yDisparities.empty())
+            return;
+
+        // Accumulate the pair on its own, then merge into the dataset statistics
+        utils::RunningStats stats;
+        utils::QuantileSketch quantiles;
+        for (const float d : yDisparities) {
+            stats.add(d);
+            quantiles.add(d);
+        }
+        PairStats &pair = pairStats[i];
+        computeStatistics(yDisparities, pair.median, pair.mean, pair.std);
+        pair.valid = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        datasetStats.merge(stats);
+        datasetQuantiles.merge(quantiles);
+    });
+
+    std::ofstream evalOut;                                                              // File logger
+    evalOut.open(logFolder + "/yDisparities.txt", std::ios::app);
+    evalOut << "#Median mean std\n";                                                    // Each line is an image in reading order (images sorted alphabetically)
+    int validPairs = 0;                                                                 // Number of pairs with detected chessboard corners in both images (left,right)
+    for (const PairStats &pair : pairStats) {
+        if (!pair.valid) {
+            evalOut << "Nan Nan NaN\n";
+            continue;
+        }
+        evalOut << pair.median << " " << pair.mean << " " << pair.std << "\n";
+        validPairs++;
+    }
+    evalOut.close();
+    std::cout << "\nEVALUATION TERMINATED***\n\tY disparity on the whole dataset (" << validPairs << " valid image pairs, "
+        << datasetStats.count() << " corners) [median, mean, std]: [" << datasetQuantiles.quantile(0.5) << ", "
+        << datasetStats.mean() << ", " << datasetStats.std() << "]\n"
+        << "\tPercentiles [p90, p99, max]: [" << datasetQuantiles.quantile(0.9) << ", " << datasetQuantiles.quantile(0.99)
+        << ", " << datasetStats.max() << "]" << std::endl;
+    return validPairs;
+}
+
+int evaluateSparse(const std::vector<std::string> &imgPathsL, const std::vector<std::string> &imgPathsR, const cv::Size &boardSize,
+                    const std::vector<cv::Mat> &camL, const std::vector<cv::Mat> &camR, const utils::DetectorSettings &settings,
+                    const utils::CornerCache &cornerCache, const std::string &cornerLogL, const std::string &cornerLogR,
+                    const unsigned int numThreads) {
+    // Corners from the logs, indexed by image pair
+    std::map<int, std::vector<cv::Point2f>> loggedL, loggedR;
+    if (!cornerLogL.empty()) {
+        std::vector<int> imgIdxsL, imgIdxsR;
+        std::vector<std::vector<cv::Point2f>> cornersL, cornersR;
+        if (!utils::readCornerHistory(cornerLogL, boardSize.area(), imgIdxsL, cornersL) ||
+            !utils::readCornerHistory(cornerLogR, boardSize.area(), imgIdxsR, cornersR)) {
+            std::cerr << "Cannot read the corner logs " << cornerLogL << " and " << cornerLogR << "\n";
+            return 1;
+        }
+        for (size_t k = 0; k < imgIdxsL.size(); k++)
+            loggedL[imgIdxsL[k]] = cornersL[k];
+        for (size_t k = 0; k < imgIdxsR.size(); k++)
+            loggedR[imgIdxsR[k]] = cornersR[k];
+        std::cout << "Corners read from the logs (" << loggedL.size() << " left and " << loggedR.size() << " right views)\n";
+    }
+    // Same cache keys of the calibration tools: the corners detected during the calibration are reused
+    const std::string detectorKey = utils::getDetectorKey(boardSize, settings);
+    auto getCorners = [&](const std::string &imgPath, const std::map<int, std::vector<cv::Point2f>> &logged, const int idx,
+                          std::vector<cv::Point2f> &chessCorners) {
+        if (!cornerLogL.empty()) {
+            const auto entry = logged.find(idx);
+            if (entry == logged.end())
+                return false;
+            chessCorners = entry->second;
+            return true;
+        }
+        utils::ImgSource imgSrc(imgPath);
+        return cornerCache.findChessCorners(imgSrc.encoded(), detectorKey, boardSize.area(), [&](std::vector<cv::Point2f> &corners){
+            return utils::findChessCorners(imgSrc.gray(), boardSize.width, boardSize.height, corners, settings);
+        }, chessCorners);
+    };
+
+    fs::create_directory(logFolder);
+    std::vector<double> mapTimes(imgPathsL.size(), 0);                                 // Time spent mapping the corners of each pair [ms]
+    const int validPairs = evaluateDataset(imgPathsL.size(), numThreads, [&](const size_t i, std::vector<float> &yDisparities) {
+        TRACE_SCOPE("imagePair");
+        std::vector<cv::Point2f> chessCornersL, chessCornersR;
+        if (!getCorners(imgPathsL[i], loggedL, i, chessCornersL) || !getCorners(imgPathsR[i], loggedR, i, chessCornersR))
+            return false;
 
-    // Compute the standard deviation
-    double accum = 0.0;
-    std::for_each (std::begin(vec), std::end(vec), [&](const double d) {
-        accum += (d - mean) * (d - mean);
+        // Rectified position of the corners
+        std::vector<cv::Point2f> rectCornersL, rectCornersR;
+        const int64 mapStart = cv::getTickCount();
+        {
+            TRACE_SCOPE("undistortPoints");
+            cv::undistortPoints(chessCornersL, rectCornersL, camL[0], camL[1], camL[2], camL[3]);
+            cv::undistortPoints(chessCornersR, rectCornersR, camR[0], camR[1], camR[2], camR[3]);
+        }
+        mapTimes[i] = 1000.0 * (cv::getTickCount() - mapStart) / cv::getTickFrequency();
+
+        yDisparities.reserve(rectCornersL.size());
+        for (unsigned int k=0; k<rectCornersL.size(); k++) {
+            yDisparities.emplace_back(std::abs(rectCornersL[k].y - rectCornersR[k].y));
+        }
+        return true;
     });
-    std = sqrt(accum / (vec.size()-1));
-}
\ No newline at end of file
+    std::cout << "\tAverage corner mapping time per pair: " << std::accumulate(mapTimes.begin(), mapTimes.end(), 0.0) / std::max(validPairs, 1)
+        << " ms" << std::endl;
+
+    return 0;
+}
@@ -1,3 +1,6 @@
+#include "../utils.h"
+#include "../stereoCalib.h"
+
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -5,11 +8,17 @@
 
 int main(int argc, char** argv){
     if (argc < 2){
-        std::cerr << "Usage: ./configOpenvslam calib\n";
+        std::cerr << "Usage: ./configOpenvslam calib|bundle.scb [--camera 0|1]\n";
+        exit(1);
+    }
+    const int camera = std::stoi(utils::getOptArg(argc, argv, "--camera", "0"));             // Camera of a calibration bundle
+    stereocalib::MonoCalibration calib;
+    std::string serial;
+    if (!stereocalib::readMonoCalibration(argv[1], calib, camera) || !stereocalib::readSerial(argv[1], serial, camera)){
+        std::cerr << "Cannot read the calibration " << argv[1] << "\n";
         exit(1);
     }
-    cv::Mat K, D;
-    cv::FileStorage fs(argv[1], cv::FileStorage::READ);
+    const cv::Mat &K = calib.K, &D = calib.D;
     
     // Quantities to be written
     const std::string camName = "\"GetCameras mono\"";
@@ -31,12 +40,9 @@ int main(int argc, char** argv){
     const int gcExposure = 10000;
     const int gcGain = 12;
     const std::string gcDecime = "true";
-    std::string serial;
 
 
-    // Load data from the config files
-    fs["K"] >> K;
-    fs["D"] >> D;
+    // Load data from the calibration
     //--
     fx = K.at<double>(0,0);
     fy = K.at<double>(1,1);
@@ -48,12 +54,8 @@ int main(int argc, char** argv){
     p2 = D.at<double>(0,3);
     k3 = D.at<double>(0,4);
     //--
-    cv::Size imgRes;
-    fs["Img_res"] >> imgRes;
-    cols = imgRes.width;
-    rows = imgRes.height;
-    //--
-    fs["Serial"] >> serial; 
+    cols = calib.imgRes.width;
+    rows = calib.imgRes.height;
 
 
     // Write the .yml file --> Cannot use Filestorage because it does not support attributes names containing "."
@@ -1,3 +1,5 @@
+#include "../stereoCalib.h"
+
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -5,13 +7,20 @@
 
 int main(int argc, char** argv){
     if (argc < 4){
-        std::cerr << "Usage: ./configOpenvslam calibL calibR calibRectify\n";
+        std::cerr << "Usage: ./configOpenvslam calibL calibR calibRectify (YAML files, or the same calibration bundle three times)\n";
+        exit(1);
+    }
+    stereocalib::MonoCalibration calibL, calibR;
+    stereocalib::Rectification rect;
+    std::string serialL, serialR;
+    if (!stereocalib::readMonoCalibration(argv[1], calibL, 0) || !stereocalib::readMonoCalibration(argv[2], calibR, 1) ||
+        !stereocalib::readRectification(argv[3], rect) || !stereocalib::readSerial(argv[1], serialL, 0) ||
+        !stereocalib::readSerial(argv[2], serialR, 1)){
+        std::cerr << "Cannot read the calibration files\n";
         exit(1);
     }
-    cv::Mat KL, DL, KR, DR, PL, PR, RL, RR;                     // PR not needed,as PL = PR
-    cv::FileStorage fsL(argv[1], cv::FileStorage::READ);
-    cv::FileStorage fsR(argv[2], cv::FileStorage::READ);
-    cv::FileStorage fsRect(argv[3], cv::FileStorage::READ);
+    const cv::Mat &KL = calibL.K, &DL = calibL.D, &KR = calibR.K, &DR = calibR.D;
+    const cv::Mat &RL = rect.R1, &PL = rect.P1, &RR = rect.R2, &PR = rect.P2;      // PR not needed,as PL = PR
     
     // Quantities to be written
     const std::string camName = "\"GetCameras stereo\"";
@@ -41,27 +50,16 @@ int main(int argc, char** argv){
     const int gcExposure = 10000;
     const int gcGain = 12;
     const std::string gcDecime = "true";
-    std::string serialL, serialR;
 
 
-    // Load data from the config files
-    fsL["K"] >> KL;
-    fsL["D"] >> DL;
-    fsRect["R1"] >> RL;
-    fsRect["P1"] >> PL;
-    fsR["K"] >> KR;
-    fsR["D"] >> DR;
-    fsRect["R2"] >> RR;
-    fsRect["P2"] >> PR;
+    // Load data from the calibration
     //--
     fx = PL.at<double>(0,0);
     fy = PL.at<double>(1,1);
     cx = PL.at<double>(0,2);
     cy = PL.at<double>(1,2);
     //--
-    cv::Size imgResL, imgResR;
-    fsL["Img_res"] >> imgResL;
-    fsR["Img_res"] >> imgResR;
+    const cv::Size imgResL = calibL.imgRes, imgResR = calibR.imgRes;
     if (imgResL != imgResR){
         std::cerr << "Left and right calibration has different value of ImgRes. Check your data\n";
         exit(1);
@@ -70,9 +68,6 @@ int main(int argc, char** argv){
     rows = imgResL.height;
     //--
     focalXBaseline = -PR.at<double>(0,3);
-    //--
-    fsL["Serial"] >> serialL; 
-    fsR["Serial"] >> serialR;
 
 
     // Write the .yml file --> Cannot use Filestorage because it does not support attributes names containing "."
@@ -0,0 +1,362 @@
+#include "utils.h"
+#include "cornerCache.h"
+#include "cornerLog.h"
+#include "stereoCalib.h"
+#include "taskPool.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+
+// Global variables: the outputs of the separate tools, for every rig
+const std::string logFolderSingle = "./logSingleCamCalib";
+const std::string logFolderStereo = "./logStereoCamCalib";
+const std::string logFolderRectify = "./logStereoRectify";
+
+
+/** A stereo rig of the fleet and the state of its calibration */
+struct Rig {
+    std::string serials[2];                                     // Left and right serials
+    std::string imgFolders[2];                                  // Left and right image folders
+    std::vector<std::string> imgPaths[2];
+    cv::Size imgRes;
+    std::vector<std::vector<cv::Point2f>> detectedCorners[2];
+    std::vector<char> detected[2];
+    stereocalib::MonoCalibration calib[2];
+    stereocalib::StereoCalibration calibStereo;
+
+    std::atomic<size_t> pendingDetections{0};                   // The last detection starts the single camera calibrations
+    std::atomic<int> pendingCalibs{0};                          // The last single camera calibration starts the stereo one
+    std::atomic<bool> failed{false};
+    std::string error;                                          // Written once, by the task that sets failed
+
+    std::string name() const { return serials[0] + "_to_" + serials[1]; }
+};
+
+/** Settings shared by the tasks of all the rigs */
+struct FleetContext {
+    utils::TaskPool &pool;
+    stereocalib::Board board;
+    std::string extension;                                      // Image extension
+    utils::DetectorSettings detectorSettings;
+    std::string detectorKey;
+    const utils::CornerCache &cornerCache;
+    utils::CornerLogFormat cornerLogFormat;
+    size_t maxViews;
+    std::mutex printMutex;
+};
+
+
+/**
+ * Read the rigs to calibrate, either:
+ *      - a directory with one folder per rig, named <serialL>_to_<serialR> and holding the image folders <serialL> and <serialR>
+ *      - a job list (YAML) with a "Rigs" sequence of {Serial_left, Serial_right, Images_left, Images_right}
+ * Return false if the input cannot be read
+ *
+ * @param input         Rig directory or job list
+ * @param rigs          Output rigs
+ */
+bool loadRigs(const std::string &input, std::vector<std::unique_ptr<Rig>> &rigs);
+
+/**
+ * Run a stage of a rig, unless the rig already failed. An exception marks the rig as failed, the other rigs go on
+ *
+ * @param ctx           Fleet settings
+ * @param rig           Rig to process
+ * @param stage         Stage name, for the error message
+ * @param task          Stage; it returns an error message, empty on success
+ */
+void runStage(FleetContext &ctx, Rig &rig, const std::string &stage, const std::function<std::string()> &task);
+
+/**
+ * List and check the images of a rig, then submit one detection task per image
+ *
+ * @param ctx           Fleet settings
+ * @param rig           Rig to process
+ */
+std::string prepareRig(FleetContext &ctx, Rig &rig);
+
+/**
+ * Find the corners of an image; the last detection of the rig writes the corner logs and submits the single camera calibrations
+ *
+ * @param ctx           Fleet settings
+ * @param rig           Rig to process
+ * @param j             Image index (0..numImgs-1: left images, then the right ones)
+ */
+void detectImage(FleetContext &ctx, Rig &rig, const size_t j);
+
+/**
+ * Calibrate a camera of a rig and write logSingleCamCalib; the last one submits the stereo calibration
+ *
+ * @param ctx           Fleet settings
+ * @param rig           Rig to process
+ * @param c             Camera (0: left, 1: right)
+ */
+std::string calibrateCamera(FleetContext &ctx, Rig &rig, const int c);
+
+/**
+ * Stereo calibration and rectification of a rig, written to logStereoCamCalib and logStereoRectify
+ *
+ * @param ctx           Fleet settings
+ * @param rig           Rig to process
+ */
+std::string calibrateRig(FleetContext &ctx, Rig &rig);
+
+
+/*
+Calibrate a fleet of stereo rigs in one run (as singleCamCalib, stereoCamCalib and stereoRectify on each rig).
+The stages of all the rigs (listing, corner detection, single camera and stereo solvers) are tasks of one shared
+work-stealing pool, so the serial phases of a rig overlap with the detections of the others.
+A rig that fails is reported at the end and does not stop the others.
+*/
+int main(int argc, char** argv){
+    if (argc < 6){
+        std::cerr << "Usage: ./fleetCalib rigFolder|jobs.yml boardWidth boardHeight cellSize extension "
+            "[--threads N] [--pyramid off|auto|N] [--detector classic|sb] [--fast-reject] [--corner-cache dir|off] [--corner-log yaml|binary|both] [--max-views N] [--trace trace.json]\n";
+        return 1;
+    }
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
+    const std::string input = argv[1];
+    const stereocalib::Board board{std::stoi(argv[2]), std::stoi(argv[3]), std::stof(argv[4])};
+    const std::string extension = argv[5];
+    const unsigned int numThreads = std::stoul(utils::getOptArg(argc, argv, "--threads", "0"));    // 0: one thread per core
+    const size_t maxViews = std::stoul(utils::getOptArg(argc, argv, "--max-views", "0"));          // 0: use all the views
+    const utils::CornerCache cornerCache = utils::getCornerCache(argc, argv);
+
+    std::vector<std::unique_ptr<Rig>> rigs;
+    if (!loadRigs(input, rigs) || rigs.empty()){
+        std::cerr << "No rig found in " << input << "\n";
+        return 1;
+    }
+    std::cout << "Calibrating " << rigs.size() << " rigs\n";
+
+    // Create log folders
+    fs::create_directory(logFolderSingle);
+    fs::create_directory(logFolderStereo);
+    fs::create_directory(logFolderRectify);
+
+    // Everything runs on the pool: this thread only waits for the last task
+    const int64 start = cv::getTickCount();
+    {
+        utils::TaskPool pool(numThreads);
+        const utils::DetectorSettings detectorSettings = utils::getDetectorSettings(argc, argv);
+        FleetContext ctx{pool, board, extension, detectorSettings, utils::getDetectorKey(board.size(), detectorSettings), cornerCache,
+                        utils::getCornerLogFormat(argc, argv), maxViews, {}};
+        for (auto &rig : rigs){
+            Rig *r = rig.get();
+            pool.submit([&ctx, r](){ runStage(ctx, *r, "preparation", [&](){ return prepareRig(ctx, *r); }); });
+        }
+        pool.wait();
+    }
+    const double elapsed = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+    // Summary
+    size_t numFailed = 0;
+    std::cout << "Fleet calibrated in " << elapsed << " s\n";
+    utils::DetectorStats::get().print();
+    for (const auto &rig : rigs){
+        if (rig->failed){
+            numFailed++;
+            std::cout << "\t" << rig->name() << ": FAILED (" << rig->error << ")\n";
+        } else {
+            std::cout << "\t" << rig->name() << ": reprojection errors " << rig->calib[0].reprError << " - " << rig->calib[1].reprError
+                << ", stereo " << rig->calibStereo.reprError << "\n";
+        }
+    }
+    if (numFailed > 0){
+        std::cerr << numFailed << " of " << rigs.size() << " rigs failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+
+bool loadRigs(const std::string &input, std::vector<std::unique_ptr<Rig>> &rigs){
+    if (fs::is_directory(input)){
+        std::vector<fs::path> rigFolders;
+        for (const auto &entry : fs::directory_iterator(input)){
+            if (fs::is_directory(entry.path()))
+                rigFolders.emplace_back(entry.path());
+        }
+        std::sort(rigFolders.begin(), rigFolders.end());
+        for (const fs::path &folder : rigFolders){
+            const std::string name = folder.filename().u8string();
+            const size_t sep = name.find("_to_");
+            if (sep == std::string::npos){
+                std::cerr << "\tSkipping " << folder << ": not named <serialL>_to_<serialR>\n";
+                continue;
+            }
+            std::unique_ptr<Rig> rig(new Rig());
+            rig->serials[0] = name.substr(0, sep);
+            rig->serials[1] = name.substr(sep + 4);
+            for (int c = 0; c < 2; c++)
+                rig->imgFolders[c] = (folder / rig->serials[c]).u8string();
+            rigs.emplace_back(std::move(rig));
+        }
+        return true;
+    }
+
+    cv::FileStorage jobs(input, cv::FileStorage::READ);
+    if (!jobs.isOpened())
+        return false;
+    const cv::FileNode rigNodes = jobs["Rigs"];
+    for (auto it = rigNodes.begin(); it != rigNodes.end(); ++it){
+        std::unique_ptr<Rig> rig(new Rig());
+        (*it)["Serial_left"] >> rig->serials[0];
+        (*it)["Serial_right"] >> rig->serials[1];
+        (*it)["Images_left"] >> rig->imgFolders[0];
+        (*it)["Images_right"] >> rig->imgFolders[1];
+        rigs.emplace_back(std::move(rig));
+    }
+    return true;
+}
+
+
+void runStage(FleetContext &ctx, Rig &rig, const std::string &stage, const std::function<std::string()> &task){
+    if (rig.failed)
+        return;
+    std::string error;
+    try {
+        error = task();
+    } catch (const std::exception &e){
+        error = e.what();
+    }
+    if (error.empty())
+        return;
+    bool expected = false;
+    if (rig.failed.compare_exchange_strong(expected, true)){
+        rig.error = stage + ": " + error;
+        std::lock_guard<std::mutex> lock(ctx.printMutex);
+        std::cerr << "\t" << rig.name() << " failed in " << rig.error << "\n";
+    }
+}
+
+
+std::string prepareRig(FleetContext &ctx, Rig &rig){
+    TRACE_SCOPE("prepareRig");
+    cv::Size imgRes[2];
+    for (int c = 0; c < 2; c++){
+        // A missing folder (a typo in the job list) fails this rig only
+        if (!fs::is_directory(rig.imgFolders[c]))
+            return "no image folder " + rig.imgFolders[c];
+        rig.imgPaths[c] = utils::getImgPaths(rig.imgFolders[c], ctx.extension);
+        if (rig.imgPaths[c].empty())
+            return "no images in " + rig.imgFolders[c];
+        if (!utils::checkImgsResolution(rig.imgPaths[c], imgRes[c]))
+            return "inconsistent image resolutions in " + rig.imgFolders[c];
+    }
+    if (rig.imgPaths[0].size() != rig.imgPaths[1].size())
+        return "left and right images must be of the same number";
+    if (imgRes[0] != imgRes[1])
+        return "left and right images must have the same resolution";
+    rig.imgRes = imgRes[0];
+
+    const size_t numImgs = rig.imgPaths[0].size();
+    for (int c = 0; c < 2; c++){
+        rig.detectedCorners[c].resize(numImgs);
+        rig.detected[c].resize(numImgs, false);
+        fs::create_directory(logFolderSingle + "/" + rig.serials[c]);
+        fs::create_directory(logFolderStereo + "/" + rig.serials[c]);
+    }
+    rig.pendingDetections = 2 * numImgs;
+    Rig *r = &rig;
+    for (size_t j = 0; j < 2 * numImgs; j++)
+        ctx.pool.submit([&ctx, r, j](){ detectImage(ctx, *r, j); });
+    return "";
+}
+
+
+void detectImage(FleetContext &ctx, Rig &rig, const size_t j){
+    const size_t numImgs = rig.imgPaths[0].size();
+    runStage(ctx, rig, "detection", [&](){
+        TRACE_SCOPE("image");
+        const int c = j / numImgs;
+        const size_t i = j % numImgs;
+        utils::ImgSource img(rig.imgPaths[c][i]);
+        rig.detected[c][i] = ctx.cornerCache.findChessCorners(img.encoded(), ctx.detectorKey, ctx.board.width * ctx.board.height, [&](std::vector<cv::Point2f> &chessCorners){
+            return utils::findChessCorners(img.gray(), ctx.board.width, ctx.board.height, chessCorners, ctx.detectorSettings);
+        }, rig.detectedCorners[c][i]);
+        return std::string();
+    });
+    if (--rig.pendingDetections > 0)
+        return;
+
+    // Last detection of the rig (its results are visible: the atomic decrement orders them)
+    runStage(ctx, rig, "corner logs", [&](){
+        TRACE_SCOPE("writeCornerLogs");
+        utils::CornerLogWriter cornerLogSingle[2] = {
+            {logFolderSingle + "/" + rig.serials[0] + "/chessCorners.yml", "image_", ctx.cornerLogFormat},
+            {logFolderSingle + "/" + rig.serials[1] + "/chessCorners.yml", "image_", ctx.cornerLogFormat}};
+        utils::CornerLogWriter cornerLogStereo[2] = {
+            {logFolderStereo + "/" + rig.serials[0] + "/chesscorners.yml", "Image_", ctx.cornerLogFormat},
+            {logFolderStereo + "/" + rig.serials[1] + "/chesscorners.yml", "Image_", ctx.cornerLogFormat}};
+        for (size_t i = 0; i < numImgs; i++){
+            for (int c = 0; c < 2; c++){
+                if (rig.detected[c][i])
+                    cornerLogSingle[c].write(i, rig.detectedCorners[c][i]);
+                if (rig.detected[0][i] && rig.detected[1][i])
+                    cornerLogStereo[c].write(i, rig.detectedCorners[c][i]);
+            }
+        }
+        for (int c = 0; c < 2; c++){
+            if (std::count(rig.detected[c].begin(), rig.detected[c].end(), true) == 0)
+                return "no chessboard found in the images of " + rig.serials[c];
+        }
+        return std::string();
+    });
+    if (rig.failed)
+        return;
+    rig.pendingCalibs = 2;
+    Rig *r = &rig;
+    for (int c = 0; c < 2; c++){
+        ctx.pool.submit([&ctx, r, c](){
+            runStage(ctx, *r, "calibration of " + r->serials[c], [&](){ return calibrateCamera(ctx, *r, c); });
+            if (--r->pendingCalibs == 0)
+                runStage(ctx, *r, "stereo calibration", [&](){ return calibrateRig(ctx, *r); });
+        });
+    }
+}
+
+
+std::string calibrateCamera(FleetContext &ctx, Rig &rig, const int c){
+    std::vector<std::vector<cv::Point2f>> chessCorners2D;
+    for (size_t i = 0; i < rig.detected[c].size(); i++){
+        if (rig.detected[c][i])
+            chessCorners2D.emplace_back(rig.detectedCorners[c][i]);
+    }
+    rig.calib[c] = stereocalib::calibrateMono(chessCorners2D, rig.imgRes, ctx.board, ctx.maxViews);
+    stereocalib::writeMonoCalibration(logFolderSingle + "/calib_" + rig.serials[c] + ".yml", logFolderSingle + "/info_" + rig.serials[c] + ".yml",
+                                    rig.serials[c], ctx.board, rig.calib[c]);
+    std::lock_guard<std::mutex> lock(ctx.printMutex);
+    std::cout << "\t" << rig.serials[c] << ": reprojection error " << rig.calib[c].reprError << " with " << rig.calib[c].views.size() << " views\n";
+    return "";
+}
+
+
+std::string calibrateRig(FleetContext &ctx, Rig &rig){
+    std::vector<std::vector<cv::Point2f>> chessCorners2DL, chessCorners2DR;
+    for (size_t i = 0; i < rig.detected[0].size(); i++){
+        if (rig.detected[0][i] && rig.detected[1][i]){
+            chessCorners2DL.emplace_back(rig.detectedCorners[0][i]);
+            chessCorners2DR.emplace_back(rig.detectedCorners[1][i]);
+        }
+    }
+    if (chessCorners2DL.empty())
+        return "no image pair with the chessboard found in both the images";
+    rig.calibStereo = stereocalib::calibrateStereo(chessCorners2DL, chessCorners2DR, rig.calib[0], rig.calib[1], ctx.board, ctx.maxViews);
+    stereocalib::writeStereoCalibration(logFolderStereo + "/calib_stereo_" + rig.name() + ".yml", logFolderStereo + "/info_stereo_" + rig.name() + ".yml",
+                                        rig.serials[0], rig.serials[1], rig.calibStereo);
+    stereocalib::writeRectification(logFolderRectify + "/rectify_" + rig.name() + ".yml",
+                                    stereocalib::rectify(rig.calib[0], rig.calib[1], rig.calibStereo));
+    std::lock_guard<std::mutex> lock(ctx.printMutex);
+    std::cout << "\t" << rig.name() << ": stereo reprojection error " << rig.calibStereo.reprError << " with "
+        << rig.calibStereo.views.size() << " views\n";
+    return "";
+}
@@ -0,0 +1,192 @@
+#include "fusedRemap.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FUSED_REMAP_AVX2
+#endif
+
+namespace stereocalib {
+
+    namespace {
+
+        // Fixed-point bilinear weights, as in cv::remap: 5 fractional bits per coordinate (32x32 table entries),
+        // weights scaled by 2^15 and summing to 2^15
+        const int INTER_BITS = 5;
+        const int INTER_TAB_SIZE = 1 << INTER_BITS;
+        const int COEF_BITS = 15;
+
+        // BGR to gray weights, as in cv::cvtColor for 8-bit images (scaled by 2^14)
+        const int GRAY_BITS = 14;
+        const int B2Y = 1868, G2Y = 9617, R2Y = 4899;
+
+        /** Weights of the 4 neighbours (top-left, top-right, bottom-left, bottom-right) for each table index */
+        struct WeightTable {
+            int w[4][INTER_TAB_SIZE * INTER_TAB_SIZE];
+
+            WeightTable(){
+                for (int ty = 0; ty < INTER_TAB_SIZE; ty++){
+                    for (int tx = 0; tx < INTER_TAB_SIZE; tx++){
+                        const int idx = ty * INTER_TAB_SIZE + tx;
+                        const int scale = (1 << COEF_BITS) / (INTER_TAB_SIZE * INTER_TAB_SIZE);
+                        w[0][idx] = (INTER_TAB_SIZE - tx) * (INTER_TAB_SIZE - ty) * scale;
+                        w[1][idx] = tx * (INTER_TAB_SIZE - ty) * scale;
+                        w[2][idx] = (INTER_TAB_SIZE - tx) * ty * scale;
+                        w[3][idx] = tx * ty * scale;
+                    }
+                }
+            }
+        };
+
+        const WeightTable& getWeightTable(){
+            static const WeightTable table;
+            return table;
+        }
+
+        inline int toGray(const int b, const int g, const int r){
+            return (b * B2Y + g * G2Y + r * R2Y + (1 << (GRAY_BITS - 1))) >> GRAY_BITS;
+        }
+
+        /** Scalar kernel: one output pixel, with the border handling of cv::remap (BORDER_CONSTANT 0) */
+        template <int CN>
+        inline uchar samplePixel(const cv::Mat &src, const int sx, const int sy, const int idx, const WeightTable &table){
+            int accum[3] = {0, 0, 0};
+            for (int k = 0; k < 4; k++){
+                const int x = sx + (k & 1), y = sy + (k >> 1);
+                if (x < 0 || y < 0 || x >= src.cols || y >= src.rows)
+                    continue;
+                const uchar *p = src.ptr<uchar>(y) + CN * x;
+                for (int c = 0; c < CN; c++)
+                    accum[c] += table.w[k][idx] * p[c];
+            }
+            int value[3];
+            for (int c = 0; c < CN; c++)
+                value[c] = (accum[c] + (1 << (COEF_BITS - 1))) >> COEF_BITS;
+            return (CN == 1) ? value[0] : toGray(value[0], value[1], value[2]);
+        }
+
+        template <int CN>
+        void remapRowScalar(const cv::Mat &src, uchar *dst, const short *xy, const ushort *idx, const int begin, const int end,
+                            const WeightTable &table){
+            for (int x = begin; x < end; x++)
+                dst[x] = samplePixel<CN>(src, xy[2 * x], xy[2 * x + 1], idx[x] & (INTER_TAB_SIZE * INTER_TAB_SIZE - 1), table);
+        }
+
+#ifdef FUSED_REMAP_AVX2
+        /** AVX2 kernel: 8 output pixels per iteration, gathering the 4 neighbours of each pixel as 32-bit words.
+         * Groups with a neighbour close to the image border are left to the scalar kernel. Return the pixels processed
+        */
+        template <int CN>
+        __attribute__((target("avx2")))
+        int remapRowAVX2(const cv::Mat &src, uchar *dst, const short *xy, const ushort *idx, const int width, const WeightTable &table){
+            const int step = (int)src.step;
+            const int maxX = src.cols - (CN == 3 ? 3 : 5);              // The 32-bit loads must not cross the end of the row
+            const int maxY = src.rows - 2;
+            const __m256i byteMask = _mm256_set1_epi32(0xFF);
+            const __m256i tabMask = _mm256_set1_epi32(INTER_TAB_SIZE * INTER_TAB_SIZE - 1);
+            const __m256i coefRound = _mm256_set1_epi32(1 << (COEF_BITS - 1));
+            const __m256i grayRound = _mm256_set1_epi32(1 << (GRAY_BITS - 1));
+            const __m256i minusOne = _mm256_set1_epi32(-1);
+            const int *base = reinterpret_cast<const int*>(src.data);
+
+            int x = 0;
+            for (; x + 8 <= width; x += 8){
+                const __m256i packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(xy + 2 * x));
+                const __m256i sx = _mm256_srai_epi32(_mm256_slli_epi32(packed, 16), 16);
+                const __m256i sy = _mm256_srai_epi32(packed, 16);
+                const __m256i inside = _mm256_and_si256(
+                    _mm256_and_si256(_mm256_cmpgt_epi32(sx, minusOne), _mm256_cmpgt_epi32(sy, minusOne)),
+                    _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(sx, _mm256_set1_epi32(maxX)),
+                                                        _mm256_cmpgt_epi32(sy, _mm256_set1_epi32(maxY))), minusOne));
+                if (_mm256_movemask_epi8(inside) != -1){
+                    remapRowScalar<CN>(src, dst, xy, idx, x, x + 8, table);
+                    continue;
+                }
+
+                const __m256i tab = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(idx + x))), tabMask);
+                const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(sy, _mm256_set1_epi32(step)),
+                                                        _mm256_mullo_epi32(sx, _mm256_set1_epi32(CN)));
+                __m256i pixels[4], weights[4];
+                for (int k = 0; k < 4; k++){
+                    const int delta = (k & 1) * CN + (k >> 1) * step;
+                    pixels[k] = _mm256_i32gather_epi32(base, _mm256_add_epi32(offset, _mm256_set1_epi32(delta)), 1);
+                    weights[k] = _mm256_i32gather_epi32(table.w[k], tab, 4);
+                }
+
+                __m256i value[3];
+                for (int c = 0; c < CN; c++){
+                    __m256i accum = coefRound;
+                    for (int k = 0; k < 4; k++){
+                        const __m256i channel = _mm256_and_si256(_mm256_srli_epi32(pixels[k], 8 * c), byteMask);
+                        accum = _mm256_add_epi32(accum, _mm256_mullo_epi32(channel, weights[k]));
+                    }
+                    value[c] = _mm256_srai_epi32(accum, COEF_BITS);
+                }
+                __m256i gray = value[0];
+                if (CN == 3){
+                    gray = _mm256_add_epi32(grayRound, _mm256_mullo_epi32(value[0], _mm256_set1_epi32(B2Y)));
+                    gray = _mm256_add_epi32(gray, _mm256_mullo_epi32(value[1], _mm256_set1_epi32(G2Y)));
+                    gray = _mm256_add_epi32(gray, _mm256_mullo_epi32(value[2], _mm256_set1_epi32(R2Y)));
+                    gray = _mm256_srai_epi32(gray, GRAY_BITS);
+                }
+
+                // 8 x int32 -> 8 x uint8 (the packs work on 128-bit lanes: 4 pixels in each lane)
+                const __m256i gray16 = _mm256_packus_epi32(gray, gray);
+                const __m256i gray8 = _mm256_packus_epi16(gray16, gray16);
+                const int lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(gray8));
+                const int hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(gray8, 1));
+                std::memcpy(dst + x, &lo, 4);
+                std::memcpy(dst + x + 4, &hi, 4);
+            }
+            return x;
+        }
+#endif
+
+        template <int CN>
+        void remapRows(const cv::Mat &src, cv::Mat &dst, const cv::Mat &map1, const cv::Mat &map2, const cv::Range &rows, const bool useAVX2){
+            const WeightTable &table = getWeightTable();
+            for (int y = rows.start; y < rows.end; y++){
+                const short *xy = map1.ptr<short>(y);
+                const ushort *idx = map2.ptr<ushort>(y);
+                uchar *out = dst.ptr<uchar>(y);
+                int x = 0;
+#ifdef FUSED_REMAP_AVX2
+                if (useAVX2)
+                    x = remapRowAVX2<CN>(src, out, xy, idx, dst.cols, table);
+#endif
+                remapRowScalar<CN>(src, out, xy, idx, x, dst.cols, table);
+            }
+        }
+
+    } // namespace
+
+    bool hasRemapKernel(const RemapKernel kernel){
+#ifdef FUSED_REMAP_AVX2
+        // OpenCV knows the CPU features (and honours OPENCV_CPU_DISABLE)
+        static const bool hasAVX2 = cv::checkHardwareSupport(CV_CPU_AVX2);
+#else
+        const bool hasAVX2 = false;
+#endif
+        return kernel != RemapKernel::AVX2 || hasAVX2;
+    }
+
+    void remapToGray(const cv::Mat &src, cv::Mat &dst, const cv::Mat &map1, const cv::Mat &map2, const RemapKernel kernel){
+        CV_Assert(src.type() == CV_8UC3 || src.type() == CV_8UC1);
+        CV_Assert(map1.type() == CV_16SC2 && map2.type() == CV_16UC1 && map1.size() == map2.size());
+        CV_Assert(hasRemapKernel(kernel));
+        dst.create(map1.size(), CV_8UC1);
+
+        // Runtime dispatch
+        const bool useAVX2 = (kernel == RemapKernel::AUTO) ? hasRemapKernel(RemapKernel::AVX2) : (kernel == RemapKernel::AVX2);
+        cv::parallel_for_(cv::Range(0, dst.rows), [&](const cv::Range &rows){
+            if (src.channels() == 3)
+                remapRows<3>(src, dst, map1, map2, rows, useAVX2);
+            else
+                remapRows<1>(src, dst, map1, map2, rows, useAVX2);
+        });
+    }
+
+} // namespace stereocalib
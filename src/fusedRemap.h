@@ -0,0 +1,27 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+namespace stereocalib {
+
+    /** Kernels of remapToGray. AUTO picks the fastest one the CPU supports */
+    enum class RemapKernel { AUTO, SCALAR, AVX2 };
+
+    /** Return true if the kernel can run on this build and CPU (SCALAR and AUTO always can) */
+    bool hasRemapKernel(const RemapKernel kernel);
+
+    /** Rectify an image straight to grayscale: sample the source through the rectification maps and convert
+     * the interpolated BGR value to gray in the same pass, without the intermediate color image.
+     * Same result as cv::remap (INTER_LINEAR, BORDER_CONSTANT 0) followed by cv::cvtColor (COLOR_BGR2GRAY),
+     * within 1 gray level. Uses AVX2 when the CPU supports it (checked at runtime), a portable scalar kernel otherwise
+     *
+     * @param src           Source image (CV_8UC3 BGR or CV_8UC1)
+     * @param dst           Output grayscale image (CV_8UC1, same size of the maps)
+     * @param map1          Fixed-point map (CV_16SC2), see cv::initUndistortRectifyMap and cv::convertMaps
+     * @param map2          Interpolation table indices (CV_16UC1)
+     * @param kernel        Kernel to run (only to check the kernels against each other: see hasRemapKernel)
+    */
+    void remapToGray(const cv::Mat &src, cv::Mat &dst, const cv::Mat &map1, const cv::Mat &map2,
+                    const RemapKernel kernel = RemapKernel::AUTO);
+
+} // namespace stereocalib
@@ -0,0 +1,172 @@
+#include "gridMap.h"
+#include "trace.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace stereocalib {
+
+    namespace {
+
+        const int BAND_ROWS = 32;                   // Rows of dense map interpolated at a time
+
+        /** Source position of rectified pixels: back-project with the rectified camera, then project with the
+         * distorted one (the model of cv::initUndistortRectifyMap)
+        */
+        void mapPoints(const cv::Mat &K, const cv::Mat &D, const cv::Mat &R, const cv::Mat &P,
+                        const std::vector<cv::Point2f> &rectified, std::vector<cv::Point2f> &source){
+            const cv::Matx33d rotation = R.empty() ? cv::Matx33d::eye() : cv::Matx33d(cv::Mat_<double>(R));
+            const cv::Matx33d newK(cv::Mat_<double>(P.colRange(0, 3)));
+            const cv::Matx33d iR = (newK * rotation).inv();
+            std::vector<cv::Point3d> rays;
+            rays.reserve(rectified.size());
+            for (const cv::Point2f &p : rectified)
+                rays.emplace_back(iR * cv::Vec3d(p.x, p.y, 1));
+            cv::projectPoints(rays, cv::Vec3d(0, 0, 0), cv::Vec3d(0, 0, 0), K, D, source);
+        }
+
+        /** Interpolation weights of the control points around position t (in [0,1) from control point 0).
+         * Linear: points 0 and 1. Cubic (Keys, a = -0.5): points -1, 0, 1 and 2
+        */
+        inline void getWeights(const GridInterpolation interpolation, const float t, float w[4]){
+            if (interpolation == GridInterpolation::LINEAR){
+                w[0] = 0; w[1] = 1 - t; w[2] = t; w[3] = 0;
+                return;
+            }
+            w[0] = ((-0.5f * t + 1) * t - 0.5f) * t;
+            w[1] = (1.5f * t - 2.5f) * t * t + 1;
+            w[2] = ((-1.5f * t + 2) * t + 0.5f) * t;
+            w[3] = (0.5f * t - 0.5f) * t * t;
+        }
+
+    } // namespace
+
+    GridMap computeGridMap(const cv::Mat &K, const cv::Mat &D, const cv::Mat &R, const cv::Mat &P, const cv::Size &imgRes,
+                            const int step, const GridInterpolation interpolation){
+        TRACE_SCOPE("computeGridMap");
+        CV_Assert(step > 0);
+        GridMap grid;
+        grid.imgRes = imgRes;
+        grid.step = step;
+        grid.interpolation = interpolation;
+
+        // One control point before the first pixel and two after the last one, so that the cubic
+        // interpolation never clamps at the borders
+        const int cols = (imgRes.width - 1) / step + 4, rows = (imgRes.height - 1) / step + 4;
+        std::vector<cv::Point2f> rectified, source;
+        rectified.reserve(rows * cols);
+        for (int i = 0; i < rows; i++)
+            for (int j = 0; j < cols; j++)
+                rectified.emplace_back((j - 1) * step, (i - 1) * step);
+        mapPoints(K, D, R, P, rectified, source);
+        grid.points = cv::Mat(source, true).reshape(2, rows);
+        return grid;
+    }
+
+    void expandGridMap(const GridMap &grid, const int rowStart, const int rowEnd, cv::Mat &map){
+        const int width = grid.imgRes.width;
+        map.create(rowEnd - rowStart, width, CV_32FC2);
+
+        // Horizontal weights, the same for all the rows
+        std::vector<int> colIdx(width);
+        std::vector<float> colWeights(4 * width);
+        for (int x = 0; x < width; x++){
+            colIdx[x] = x / grid.step + 1;
+            getWeights(grid.interpolation, (float)(x % grid.step) / grid.step, &colWeights[4 * x]);
+        }
+
+        // Vertical interpolation of the control points first (one row of them), then horizontal
+        std::vector<cv::Point2f> gridRow(grid.points.cols);
+        for (int y = rowStart; y < rowEnd; y++){
+            const int i = y / grid.step + 1;
+            float w[4];
+            getWeights(grid.interpolation, (float)(y % grid.step) / grid.step, w);
+            for (int j = 0; j < grid.points.cols; j++){
+                cv::Point2f p(0, 0);
+                for (int k = 0; k < 4; k++)
+                    if (w[k] != 0)
+                        p += w[k] * grid.points.at<cv::Point2f>(i + k - 1, j);
+                gridRow[j] = p;
+            }
+
+            cv::Point2f *out = map.ptr<cv::Point2f>(y - rowStart);
+            for (int x = 0; x < width; x++){
+                const float *wx = &colWeights[4 * x];
+                const cv::Point2f *p = &gridRow[colIdx[x] - 1];
+                out[x] = wx[0] * p[0] + wx[1] * p[1] + wx[2] * p[2] + wx[3] * p[3];
+            }
+        }
+    }
+
+    double gridMapMaxError(const GridMap &grid, const cv::Mat &K, const cv::Mat &D, const cv::Mat &R, const cv::Mat &P){
+        TRACE_SCOPE("gridMapMaxError");
+        // Compare with the exact positions band by band: the dense map is never allocated whole
+        double maxError = 0;
+        std::vector<cv::Point2f> rectified, exact;
+        cv::Mat map;
+        for (int rowStart = 0; rowStart < grid.imgRes.height; rowStart += BAND_ROWS){
+            const int rowEnd = std::min(rowStart + BAND_ROWS, grid.imgRes.height);
+            rectified.clear();
+            for (int y = rowStart; y < rowEnd; y++)
+                for (int x = 0; x < grid.imgRes.width; x++)
+                    rectified.emplace_back(x, y);
+            mapPoints(K, D, R, P, rectified, exact);
+            expandGridMap(grid, rowStart, rowEnd, map);
+            const cv::Point2f *interpolated = map.ptr<cv::Point2f>(0);         // Continuous: allocated by expandGridMap
+            for (size_t k = 0; k < exact.size(); k++)
+                maxError = std::max(maxError, cv::norm(exact[k] - interpolated[k]));
+        }
+        return maxError;
+    }
+
+    void remapGrid(const cv::Mat &src, cv::Mat &dst, const GridMap &grid, const int interpolation){
+        dst.create(grid.imgRes, src.type());
+        const int numBands = (grid.imgRes.height + BAND_ROWS - 1) / BAND_ROWS;
+        cv::parallel_for_(cv::Range(0, numBands), [&](const cv::Range &bands){
+            cv::Mat map;                            // Dense map of a band, reused by the bands of this stripe
+            for (int band = bands.start; band < bands.end; band++){
+                const int rowStart = band * BAND_ROWS, rowEnd = std::min(rowStart + BAND_ROWS, grid.imgRes.height);
+                expandGridMap(grid, rowStart, rowEnd, map);
+                cv::Mat dstBand = dst.rowRange(rowStart, rowEnd);
+                cv::remap(src, dstBand, map, cv::noArray(), interpolation);
+            }
+        });
+    }
+
+    void writeGridMap(const std::string &filename, const GridMap &grid){
+        cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+        fs << "Img_res" << grid.imgRes;
+        fs << "Grid_step" << grid.step;
+        fs << "Interpolation" << (grid.interpolation == GridInterpolation::LINEAR ? "linear" : "cubic");
+        fs << "Points" << grid.points;
+        fs.release();
+    }
+
+    bool readGridMap(const std::string &filename, GridMap &grid){
+        cv::FileStorage fs(filename, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        std::string interpolation;
+        fs["Img_res"] >> grid.imgRes;
+        fs["Grid_step"] >> grid.step;
+        fs["Interpolation"] >> interpolation;
+        fs["Points"] >> grid.points;
+        if (grid.step <= 0 || grid.points.type() != CV_32FC2 || !parseGridInterpolation(interpolation, grid.interpolation))
+            return false;
+        return grid.points.rows == (grid.imgRes.height - 1) / grid.step + 4 && grid.points.cols == (grid.imgRes.width - 1) / grid.step + 4;
+    }
+
+    bool parseGridInterpolation(const std::string &name, GridInterpolation &interpolation){
+        if (name == "linear")
+            interpolation = GridInterpolation::LINEAR;
+        else if (name == "cubic")
+            interpolation = GridInterpolation::CUBIC;
+        else
+            return false;
+        return true;
+    }
+
+} // namespace stereocalib
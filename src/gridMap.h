@@ -0,0 +1,78 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+
+namespace stereocalib {
+
+    /** Interpolation of the control points of a GridMap */
+    enum class GridInterpolation { LINEAR, CUBIC };
+
+    /** Compact rectification map: the source position of the pixels on a coarse grid of control points, every
+     * step pixels. The dense map is interpolated on the fly, a few rows at a time, so a rectification takes
+     * (width/step) * (height/step) * 8 bytes instead of width * height * 8 bytes per camera
+    */
+    struct GridMap {
+        cv::Size imgRes;                                            // Resolution of the rectified image
+        int step = 0;                                               // Distance between the control points [px]
+        GridInterpolation interpolation = GridInterpolation::CUBIC;
+        cv::Mat points;                                             // Source positions of the control points (CV_32FC2). Point (i,j)
+                                                                    // maps pixel ((j-1)*step, (i-1)*step): one extra point around the image
+
+        size_t memory() const { return points.total() * points.elemSize(); }
+    };
+
+    /** Compute the grid map of a camera (same inputs of cv::initUndistortRectifyMap)
+     * @param K             Camera matrix
+     * @param D             Distortion vector
+     * @param R             Rectification rotation
+     * @param P             Rectified projection matrix
+     * @param imgRes        Resolution of the rectified image
+     * @param step          Distance between the control points [px]
+     * @param interpolation Interpolation of the control points
+    */
+    GridMap computeGridMap(const cv::Mat &K, const cv::Mat &D, const cv::Mat &R, const cv::Mat &P, const cv::Size &imgRes,
+                            const int step, const GridInterpolation interpolation);
+
+    /** Interpolate the rows [rowStart, rowEnd) of the dense map (CV_32FC2, as cv::remap map1)
+     * @param grid          Grid map
+     * @param rowStart      First row
+     * @param rowEnd        Last row (excluded)
+     * @param map           Output dense map
+    */
+    void expandGridMap(const GridMap &grid, const int rowStart, const int rowEnd, cv::Mat &map);
+
+    /** Return the worst-case distance [px] between the interpolated map and the dense one of cv::initUndistortRectifyMap
+     * @param grid          Grid map
+     * @param K             Camera matrix
+     * @param D             Distortion vector
+     * @param R             Rectification rotation
+     * @param P             Rectified projection matrix
+    */
+    double gridMapMaxError(const GridMap &grid, const cv::Mat &K, const cv::Mat &D, const cv::Mat &R, const cv::Mat &P);
+
+    /** Rectify an image with a grid map, in bands of rows (same result of cv::remap with the dense map, within the grid error)
+     * @param src           Source image
+     * @param dst           Rectified image
+     * @param grid          Grid map
+     * @param interpolation Pixel interpolation (see cv::remap)
+    */
+    void remapGrid(const cv::Mat &src, cv::Mat &dst, const GridMap &grid, const int interpolation);
+
+    /** Write a grid map (gridmap_<serial>.yml format)
+     * @param filename      Output path
+     * @param grid          Grid map
+    */
+    void writeGridMap(const std::string &filename, const GridMap &grid);
+
+    /** Read a grid map. Return false if missing or malformed (control points not matching the resolution and step)
+     * @param filename      Grid map path
+     * @param grid          Output grid map
+    */
+    bool readGridMap(const std::string &filename, GridMap &grid);
+
+    /** Parse the name of a grid interpolation (linear or cubic). Return false if unknown */
+    bool parseGridInterpolation(const std::string &name, GridInterpolation &interpolation);
+
+} // namespace stereocalib
@@ -0,0 +1,166 @@
+#include "rectifier.h"
+#include "fusedRemap.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <algorithm>
+
+namespace stereocalib {
+
+    StereoRectifier::StereoRectifier(const MonoCalibration &left, const MonoCalibration &right, const Rectification &rect,
+                                    const bool fixedPointMaps, unsigned int numThreads, unsigned int numBands) : imgRes_(left.imgRes) {
+        TRACE_SCOPE("initUndistortRectifyMap");
+        const int mapType = fixedPointMaps ? CV_16SC2 : CV_32FC1;
+        cv::initUndistortRectifyMap(left.K, left.D, rect.R1, rect.P1, imgRes_, mapType, map1_[0], map2_[0]);
+        cv::initUndistortRectifyMap(right.K, right.D, rect.R2, rect.P2, imgRes_, mapType, map1_[1], map2_[1]);
+        startWorkers(numThreads, numBands);
+    }
+
+    StereoRectifier::StereoRectifier(const cv::Mat map1[2], const cv::Mat map2[2], unsigned int numThreads, unsigned int numBands)
+        : imgRes_(map1[0].size()) {
+        CV_Assert(map1[1].size() == imgRes_);
+        for (int c = 0; c < 2; c++){
+            map1_[c] = map1[c];
+            map2_[c] = map2[c];
+        }
+        startWorkers(numThreads, numBands);
+    }
+
+    StereoRectifier::StereoRectifier(const GridMap grid[2], unsigned int numThreads, unsigned int numBands) : imgRes_(grid[0].imgRes) {
+        CV_Assert(grid[1].imgRes == imgRes_);
+        grid_[0] = grid[0];
+        grid_[1] = grid[1];
+        startWorkers(numThreads, numBands);
+    }
+
+    void StereoRectifier::startWorkers(unsigned int numThreads, unsigned int numBands){
+        if (numThreads == 0)
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        numBands_ = std::min((unsigned int)imgRes_.height, numBands > 0 ? numBands : numThreads);
+        for (unsigned int t = 1; t < numThreads; t++)          // The calling thread is a worker too
+            workers_.emplace_back(&StereoRectifier::run, this);
+    }
+
+    StereoRectifier::~StereoRectifier(){
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cvStart_.notify_all();
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    const StereoFrame& StereoRectifier::rectify(const cv::Mat &imgL, const cv::Mat &imgR){
+        TRACE_SCOPE("rectify");
+        const int64_t start = cv::getTickCount();
+        if (firstTick_ == 0)
+            firstTick_ = start;
+
+        // Allocate the output buffer (only on the first calls), then publish the job
+        outIdx_ = 1 - outIdx_;
+        StereoFrame &out = out_[outIdx_];
+        out.left.create(imgRes_, imgL.type());
+        out.right.create(imgRes_, imgR.type());
+        src_[0] = &imgL;
+        src_[1] = &imgR;
+        doneBands_ = 0;
+        nextBand_ = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            generation_++;
+        }
+        cvStart_.notify_all();
+
+        // Work with the pool, then wait for the bands still running on the other threads
+        processBands();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cvDone_.wait(lock, [&](){ return doneBands_ == 2 * numBands_; });
+        }
+
+        lastTick_ = cv::getTickCount();
+        latencies_.emplace_back(1000.0 * (lastTick_ - start) / cv::getTickFrequency());
+        return out;
+    }
+
+    void StereoRectifier::rectifyImage(const int camera, const cv::Mat &src, cv::Mat &dst, const bool gray) const {
+        const bool fixedPointMaps = !map1_[camera].empty() && map1_[camera].type() == CV_16SC2;
+        if (gray && fixedPointMaps && (src.type() == CV_8UC3 || src.type() == CV_8UC1)){
+            remapToGray(src, dst, map1_[camera], map2_[camera]);
+            return;
+        }
+        cv::Mat rectified;
+        if (map1_[camera].empty())
+            remapGrid(src, rectified, grid_[camera], cv::INTER_LINEAR);
+        else
+            cv::remap(src, rectified, map1_[camera], map2_[camera], cv::INTER_LINEAR);
+        if (gray && rectified.channels() == 3)
+            cv::cvtColor(rectified, dst, cv::COLOR_BGR2GRAY);
+        else
+            dst = rectified;
+    }
+
+    RectifierStats StereoRectifier::getStats() const {
+        RectifierStats stats;
+        stats.frames = latencies_.size();
+        if (latencies_.empty())
+            return stats;
+        std::vector<double> sorted = latencies_;
+        std::sort(sorted.begin(), sorted.end());
+        for (const double latency : sorted)
+            stats.latencyMean += latency / sorted.size();
+        stats.latencyP50 = sorted[sorted.size() / 2];
+        stats.latencyP99 = sorted[std::min(sorted.size() - 1, (size_t)(0.99 * sorted.size()))];
+        stats.latencyMax = sorted.back();
+        const double elapsed = (lastTick_ - firstTick_) / cv::getTickFrequency();
+        stats.fps = elapsed > 0 ? stats.frames / elapsed : 0;
+        return stats;
+    }
+
+    void StereoRectifier::run(){
+        uint64_t seen = 0;
+        while (true){
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cvStart_.wait(lock, [&](){ return stop_ || generation_ != seen; });
+                if (stop_)
+                    return;
+                seen = generation_;
+            }
+            processBands();
+        }
+    }
+
+    void StereoRectifier::processBands(){
+        // Jobs 0..numBands-1 are the bands of the left image, the others the bands of the right one
+        const size_t numJobs = 2 * numBands_;
+        const int gridRows = 32;                                // Rows of dense map interpolated at a time (grid maps)
+        cv::Mat gridMap;
+        size_t job;
+        while ((job = nextBand_.fetch_add(1)) < numJobs){
+            const int c = job / numBands_;
+            const int band = job % numBands_;
+            const int rowStart = band * imgRes_.height / numBands_;
+            const int rowEnd = (band + 1) * imgRes_.height / numBands_;
+            cv::Mat dst = (c == 0 ? out_[outIdx_].left : out_[outIdx_].right).rowRange(rowStart, rowEnd);
+            if (map1_[c].empty()){
+                for (int row = rowStart; row < rowEnd; row += gridRows){
+                    const int subEnd = std::min(row + gridRows, rowEnd);
+                    expandGridMap(grid_[c], row, subEnd, gridMap);
+                    cv::Mat dstRows = dst.rowRange(row - rowStart, subEnd - rowStart);
+                    cv::remap(*src_[c], dstRows, gridMap, cv::noArray(), cv::INTER_LINEAR);
+                }
+            } else {
+                cv::remap(*src_[c], dst, map1_[c].rowRange(rowStart, rowEnd), map2_[c].rowRange(rowStart, rowEnd), cv::INTER_LINEAR);
+            }
+
+            if (doneBands_.fetch_add(1) + 1 == numJobs){
+                std::lock_guard<std::mutex> lock(mutex_);
+                cvDone_.notify_one();
+            }
+        }
+    }
+
+} // namespace stereocalib
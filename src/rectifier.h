@@ -0,0 +1,115 @@
+#pragma once
+
+#include "stereoCalib.h"
+#include "gridMap.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+
+namespace stereocalib {
+
+    /** A pair of left and right images */
+    struct StereoFrame {
+        cv::Mat left, right;
+    };
+
+    /** Throughput and latency of a rectifier */
+    struct RectifierStats {
+        size_t frames = 0;                      // Rectified frames
+        double fps = 0;                         // Sustained frame rate, from the first to the last frame
+        double latencyMean = 0;                 // Rectification time of a frame [ms]
+        double latencyP50 = 0, latencyP99 = 0, latencyMax = 0;
+    };
+
+    /** Real-time rectification of stereo pairs. The maps are computed once; each pair is split into row bands,
+     * remapped by a persistent pool of worker threads (the calling thread included).
+     * The output is double-buffered: the frame returned by rectify() stays valid until the next-but-one call,
+     * so it can be consumed while the next pair is rectified
+    */
+    class StereoRectifier {
+    public:
+        /**
+         * @param left              Left camera calibration
+         * @param right             Right camera calibration
+         * @param rect              Stereo rectification
+         * @param fixedPointMaps    Use CV_16SC2 maps (faster, 1/32 pixel quantization) instead of CV_32F ones
+         * @param numThreads        Number of threads (0: one per core)
+         * @param numBands          Row bands of each image (0: one per thread)
+        */
+        StereoRectifier(const MonoCalibration &left, const MonoCalibration &right, const Rectification &rect,
+                        const bool fixedPointMaps = true, unsigned int numThreads = 0, unsigned int numBands = 0);
+
+        /** Rectifier from precomputed maps (i.e. the ones of a calibration bundle, used without copies)
+         * @param map1              First maps of the left and right cameras (CV_16SC2 or CV_32FC1)
+         * @param map2              Second maps of the left and right cameras (CV_16UC1 or CV_32FC1)
+         * @param numThreads        Number of threads (0: one per core)
+         * @param numBands          Row bands of each image (0: one per thread)
+        */
+        StereoRectifier(const cv::Mat map1[2], const cv::Mat map2[2], unsigned int numThreads = 0, unsigned int numBands = 0);
+
+        /** Rectifier from grid maps: the dense maps are interpolated band by band, a few rows at a time, and never stored whole
+         * @param grid              Grid maps of the left and right cameras (i.e. the ones exported by stereoRectify --export-grid)
+         * @param numThreads        Number of threads (0: one per core)
+         * @param numBands          Row bands of each image (0: one per thread)
+        */
+        StereoRectifier(const GridMap grid[2], unsigned int numThreads = 0, unsigned int numBands = 0);
+        ~StereoRectifier();
+
+        StereoRectifier(const StereoRectifier&) = delete;
+        StereoRectifier& operator=(const StereoRectifier&) = delete;
+
+        /** Rectify a stereo pair. The result stays valid until the next-but-one call
+         * @param imgL      Left image
+         * @param imgR      Right image
+        */
+        const StereoFrame& rectify(const cv::Mat &imgL, const cv::Mat &imgR);
+
+        /** Rectify a single image on the calling thread, with the maps of the rectifier. Unlike rectify(), it can be
+         * called concurrently (i.e. by callers that process many images in parallel) and does not use the worker pool
+         * @param camera    Camera of the image (0: left, 1: right)
+         * @param src       Source image
+         * @param dst       Rectified image
+         * @param gray      Output a grayscale image (fused with the sampling when the maps are fixed-point, see remapToGray)
+        */
+        void rectifyImage(const int camera, const cv::Mat &src, cv::Mat &dst, const bool gray = false) const;
+
+        /** Return the throughput and latency of the frames rectified so far */
+        RectifierStats getStats() const;
+
+        cv::Size getResolution() const { return imgRes_; }
+
+    private:
+        void startWorkers(unsigned int numThreads, unsigned int numBands);
+        void run();
+        void processBands();
+
+        cv::Size imgRes_;
+        cv::Mat map1_[2], map2_[2];
+        GridMap grid_[2];                               // Used instead of the dense maps when these are empty
+        unsigned int numBands_;
+
+        // Current job
+        const cv::Mat *src_[2] = {nullptr, nullptr};
+        StereoFrame out_[2];                            // Double-buffered output
+        size_t outIdx_ = 0;
+        std::atomic<size_t> nextBand_{0}, doneBands_{0};
+
+        // Worker pool
+        std::vector<std::thread> workers_;
+        std::mutex mutex_;
+        std::condition_variable cvStart_, cvDone_;
+        uint64_t generation_ = 0;
+        bool stop_ = false;
+
+        // Statistics
+        std::vector<double> latencies_;
+        int64_t firstTick_ = 0, lastTick_ = 0;
+    };
+
+} // namespace stereocalib
@@ -0,0 +1,205 @@
+#include "utils.h"
+#include "debugWriter.h"
+#include "videoSource.h"
+#include "stereoCalib.h"
+#include "rectifier.h"
+#include "calibBundle.h"
+#include "gridMap.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <iostream>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+
+/*
+Rectify a stream of stereo pairs (two image folders or two video files) with StereoRectifier.
+Frames are read and decoded by a separate thread, a couple of pairs ahead of the rectification.
+Report the sustained frame rate and the per-frame latency.
+*/
+int main(int argc, char** argv){
+    if (argc < 7){
+        std::cerr << "Usage: ./rectifyStream calibL calibR calibRectify imgFolderL|videoFileL imgFolderR|videoFileR extension "
+            "[--threads N] [--bands N] [--map-format float|fixed|grid] [--grid-map gridmapL.yml gridmapR.yml] [--grid-step px] [--grid-interp linear|cubic] [--max-frames N] [--output dir] [--trace trace.json]\n";
+        return 1;
+    }
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
+    const std::string inputL = argv[4];
+    const std::string inputR = argv[5];
+    const std::string extension = argv[6];
+    const unsigned int numThreads = std::stoul(utils::getOptArg(argc, argv, "--threads", "0"));    // 0: one thread per core
+    const unsigned int numBands = std::stoul(utils::getOptArg(argc, argv, "--bands", "0"));        // 0: one band per thread
+    const std::string mapFormat = utils::getOptArg(argc, argv, "--map-format", "fixed");
+    const size_t maxFrames = std::stoul(utils::getOptArg(argc, argv, "--max-frames", "0"));        // 0: whole stream
+    const std::string outFolder = utils::getOptArg(argc, argv, "--output", "");                    // Empty: do not write
+    const std::vector<std::string> gridMapPaths = utils::getOptArgs(argc, argv, "--grid-map", 2);   // Grid maps exported by stereoRectify
+    const int gridStep = std::stoi(utils::getOptArg(argc, argv, "--grid-step", "16"));              // Grid maps computed here
+    stereocalib::GridInterpolation gridInterpolation;
+    if (mapFormat != "float" && mapFormat != "fixed" && mapFormat != "grid"){
+        std::cerr << "Unknown map format " << mapFormat << ", use float, fixed or grid\n";
+        return 1;
+    }
+    if (!stereocalib::parseGridInterpolation(utils::getOptArg(argc, argv, "--grid-interp", "cubic"), gridInterpolation) || gridStep <= 0){
+        std::cerr << "Invalid grid map settings, use a positive step and linear or cubic interpolation\n";
+        return 1;
+    }
+    if (!gridMapPaths.empty() && mapFormat != "grid"){
+        std::cerr << "--grid-map needs --map-format grid\n";
+        return 1;
+    }
+
+    // Load the calibrations: from a bundle (calibL, read once: calibR and calibRectify are not read), or from the YAML files
+    stereocalib::MonoCalibration calibL, calibR;
+    stereocalib::Rectification rect;
+    stereocalib::CalibrationSet bundle;
+    if (stereocalib::isCalibBundle(argv[1])){
+        // The maps are verified only if they are used
+        if (!stereocalib::readCalibBundle(argv[1], bundle, mapFormat == "fixed") || bundle.cameras.size() < 2 || bundle.rect.P2.empty()){
+            std::cerr << "Cannot read a stereo calibration from the bundle " << argv[1] << "\n";
+            return 1;
+        }
+        calibL = bundle.cameras[0];
+        calibR = bundle.cameras[1];
+        rect = bundle.rect;
+    } else if (!stereocalib::readMonoCalibration(argv[1], calibL, 0) || !stereocalib::readMonoCalibration(argv[2], calibR, 1) ||
+        !stereocalib::readRectification(argv[3], rect)){
+        std::cerr << "Cannot read the calibration files\n";
+        return 1;
+    }
+    // A bundle with fixed-point maps saves their computation: they are used straight from the mapped file
+    const bool bundleMaps = mapFormat == "fixed" && !bundle.map1[0].empty() && !bundle.map1[1].empty();
+    std::unique_ptr<stereocalib::StereoRectifier> rectifierPtr;
+    if (mapFormat == "grid"){
+        // Grid maps: loaded (i.e. exported by stereoRectify --export-grid) or computed from the calibration
+        stereocalib::GridMap grid[2];
+        if (!gridMapPaths.empty()){
+            for (int c = 0; c < 2; c++){
+                if (!stereocalib::readGridMap(gridMapPaths[c], grid[c]) || grid[c].imgRes != calibL.imgRes){
+                    std::cerr << "Invalid grid map " << gridMapPaths[c] << " for images of resolution " << calibL.imgRes << "\n";
+                    return 1;
+                }
+            }
+        } else {
+            grid[0] = stereocalib::computeGridMap(calibL.K, calibL.D, rect.R1, rect.P1, calibL.imgRes, gridStep, gridInterpolation);
+            grid[1] = stereocalib::computeGridMap(calibR.K, calibR.D, rect.R2, rect.P2, calibR.imgRes, gridStep, gridInterpolation);
+        }
+        rectifierPtr.reset(new stereocalib::StereoRectifier(grid, numThreads, numBands));
+        std::cout << "Rectification grid maps " << (gridMapPaths.empty() ? "computed" : "loaded") << " (step " << grid[0].step << ", "
+            << (grid[0].memory() + grid[1].memory()) / 1024.0 << " KB, " << calibL.imgRes << ")\n";
+    } else {
+        rectifierPtr.reset(bundleMaps ?
+            new stereocalib::StereoRectifier(bundle.map1, bundle.map2, numThreads, numBands) :
+            new stereocalib::StereoRectifier(calibL, calibR, rect, mapFormat == "fixed", numThreads, numBands));
+        std::cout << "Rectification maps " << (bundleMaps ? "loaded" : "computed") << " (" << mapFormat << ", " << calibL.imgRes << ")\n";
+    }
+    stereocalib::StereoRectifier &rectifier = *rectifierPtr;
+
+    // Open the input streams
+    const bool videoInput = utils::isVideoInput(inputL) && utils::isVideoInput(inputR);
+    std::vector<std::string> imgPathsL, imgPathsR;
+    utils::VideoFrameSource videoL(videoInput ? inputL : "", 1), videoR(videoInput ? inputR : "", 1);
+    if (videoInput){
+        if (!videoL.isOpened() || !videoR.isOpened()){
+            std::cerr << "Cannot open the videos " << inputL << " and " << inputR << "\n";
+            return 1;
+        }
+    } else {
+        imgPathsL = utils::getImgPaths(inputL, extension);
+        imgPathsR = utils::getImgPaths(inputR, extension);
+        if (imgPathsL.empty() || imgPathsL.size() != imgPathsR.size()){
+            std::cerr << "Error, left and right images must be of the same (non zero) number\n";
+            return 1;
+        }
+    }
+
+    // Reader thread: decode the next pairs while the current one is rectified (at most 2 pairs ahead)
+    std::deque<std::pair<stereocalib::StereoFrame, int64>> readQueue;
+    std::mutex mutex;
+    std::condition_variable cvPush, cvPop;
+    bool readDone = false;
+    std::thread reader([&](){
+        for (size_t k = 0; maxFrames == 0 || k < maxFrames; k++){
+            stereocalib::StereoFrame frame;
+            {
+                TRACE_SCOPE("readFrame");
+                if (videoInput){
+                    int frameIdx;
+                    if (!videoL.read(frame.left, frameIdx) || !videoR.read(frame.right, frameIdx))
+                        break;
+                } else {
+                    if (k >= imgPathsL.size())
+                        break;
+                    frame.left = cv::imread(imgPathsL[k], cv::IMREAD_COLOR);
+                    frame.right = cv::imread(imgPathsR[k], cv::IMREAD_COLOR);
+                }
+            }
+            if (frame.left.size() != rectifier.getResolution() || frame.right.size() != rectifier.getResolution()){
+                std::cerr << "\tFrame " << k << " does not match the calibration resolution. Stopping\n";
+                break;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            cvPop.wait(lock, [&](){ return readQueue.size() < 2; });
+            readQueue.emplace_back(frame, cv::getTickCount());
+            cvPush.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        readDone = true;
+        cvPush.notify_one();
+    });
+
+    // Rectification loop
+    if (!outFolder.empty())
+        fs::create_directories(outFolder);
+    utils::DebugSettings writerSettings;
+    writerSettings.mode = outFolder.empty() ? utils::DebugMode::OFF : utils::DebugMode::ALL;
+    utils::DebugWriter writer(writerSettings);                                         // Writes the rectified images in the background
+    std::vector<double> endToEnd;                                                       // From the end of the decode to the rectified pair [ms]
+    size_t frameIdx = 0;
+    while (true){
+        std::pair<stereocalib::StereoFrame, int64> item;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cvPush.wait(lock, [&](){ return readDone || !readQueue.empty(); });
+            if (readQueue.empty())
+                break;
+            item = std::move(readQueue.front());
+            readQueue.pop_front();
+            cvPop.notify_one();
+        }
+
+        const stereocalib::StereoFrame &rectified = rectifier.rectify(item.first.left, item.first.right);
+        endToEnd.emplace_back(1000.0 * (cv::getTickCount() - item.second) / cv::getTickFrequency());
+        if (!outFolder.empty()){
+            // The rectifier reuses its buffers: the writer gets copies
+            const std::string name = outFolder + "/" + std::to_string(frameIdx);
+            writer.write(name + "_left.png", rectified.left.clone(), cv::Size(), {}, true);
+            writer.write(name + "_right.png", rectified.right.clone(), cv::Size(), {}, true);
+        }
+        frameIdx++;
+        if (frameIdx % 100 == 0)
+            std::cout << "\t" << frameIdx << " frames, " << rectifier.getStats().fps << " FPS\n";
+    }
+    reader.join();
+
+    // Report
+    const stereocalib::RectifierStats stats = rectifier.getStats();
+    std::sort(endToEnd.begin(), endToEnd.end());
+    std::cout << "Rectified " << stats.frames << " stereo pairs\n"
+        << "\tSustained rate: " << stats.fps << " FPS\n"
+        << "\tRectification latency [ms]: mean " << stats.latencyMean << ", p50 " << stats.latencyP50
+        << ", p99 " << stats.latencyP99 << ", max " << stats.latencyMax << "\n";
+    if (!endToEnd.empty())
+        std::cout << "\tQueue + rectification latency [ms]: p50 " << endToEnd[endToEnd.size() / 2]
+            << ", p99 " << endToEnd[std::min(endToEnd.size() - 1, (size_t)(0.99 * endToEnd.size()))] << "\n";
+
+    return 0;
+}
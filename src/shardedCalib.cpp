@@ -0,0 +1,435 @@
+#include "utils.h"
+#include "cornerCache.h"
+#include "cornerLog.h"
+#include "stereoCalib.h"
+#include "calibBundle.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+
+// Global variables
+const std::string logFolder = "./logShardedCalib";           // Calibration output will be stored in this directory
+
+
+/**
+ * Split the images of one camera (or of a stereo pair) into shards and write the manifest
+ *
+ * @param argc          Number of command line arguments
+ * @param argv          Command line arguments (after "plan")
+ */
+int plan(int argc, char** argv);
+
+/**
+ * Detect the corners of the images of one shard and write the partial corner logs, then the shard summary
+ * (<manifest>_shard_<k>.yml, written last: its presence marks the shard as complete)
+ *
+ * @param argc          Number of command line arguments
+ * @param argv          Command line arguments (after "detect")
+ */
+int detect(int argc, char** argv);
+
+/**
+ * Put the corners of all the shards back in the image order, then calibrate (single camera, or both cameras,
+ * stereo and rectification). Output files have the same names and content as the ones of the separate tools
+ *
+ * @param argc          Number of command line arguments
+ * @param argv          Command line arguments (after "merge")
+ */
+int merge(int argc, char** argv);
+
+/**
+ * Write the calibration bundle of merge (nothing if no path is given). Return 0 on success, 1 otherwise
+ *
+ * @param bundlePath    Output path (empty: no bundle)
+ * @param set           Calibration to write
+ * @param withMaps      Add the fixed-point rectification maps (stereo only)
+ */
+int writeBundle(const std::string &bundlePath, stereocalib::CalibrationSet &set, const bool withMaps);
+
+/**
+ * Return the path of a file of a shard, next to the manifest
+ *
+ * @param manifestPath  Path of the manifest
+ * @param shard         Shard index
+ * @param suffix        File suffix (i.e. "_<serial>.bin")
+ */
+std::string getShardPath(const std::string &manifestPath, const int shard, const std::string &suffix);
+
+/**
+ * Return the hash of the content of the manifest (as a string, FileStorage has no 64-bit integers), written in the
+ * shard summaries so that merge never mixes shards of different plans
+ *
+ * @param manifestPath  Path of the manifest
+ */
+std::string getManifestHash(const std::string &manifestPath);
+
+
+/*
+Sharded calibration, for datasets too large for a single process:
+    1) plan:    split the image list into N shards and write a manifest
+    2) detect:  detect the corners of one shard (one process per shard, on any machine that sees the manifest folder)
+    3) merge:   collect the shards in image order and calibrate
+The shards are plain files next to the manifest, so the steps can run as local processes or as batch jobs.
+*/
+int main(int argc, char** argv){
+    const std::string command = argc > 1 ? argv[1] : "";
+    if (command == "plan" && argc >= 10)
+        return plan(argc - 1, argv + 1);
+    if (command == "detect" && argc >= 4)
+        return detect(argc - 1, argv + 1);
+    if (command == "merge" && argc >= 3)
+        return merge(argc - 1, argv + 1);
+
+    std::cerr << "Usage:\n"
+        "\t./shardedCalib plan manifest.yml numShards boardWidth boardHeight cellSize extension imgFolder serial "
+            "[imgFolderR serialR] [--pyramid off|auto|N] [--detector classic|sb] [--fast-reject]\n"
+        "\t./shardedCalib detect manifest.yml shardIdx [--threads N] [--corner-cache dir|off] [--trace trace.json]\n"
+        "\t./shardedCalib merge manifest.yml [--corner-log yaml|binary|both] [--max-views N] [--bundle out.scb] [--bundle-maps] [--trace trace.json]\n";
+    return 1;
+}
+
+
+int plan(int argc, char** argv){
+    const std::string manifestPath = argv[1];
+    const int numShards = std::stoi(argv[2]);
+    const std::string extension = argv[6];
+    const bool stereo = argc > 9 && std::string(argv[9]).rfind("--", 0) != 0;     // Options start right after the serial if mono
+    const int numCameras = stereo ? 2 : 1;
+    if (stereo && argc < 11){
+        std::cerr << "Give both the image folder and the serial of the right camera\n";
+        return 1;
+    }
+    if (numShards <= 0){
+        std::cerr << "The number of shards must be positive\n";
+        return 1;
+    }
+
+    // The image lists are frozen in the manifest: the workers do not list the folders again
+    std::vector<std::string> serials, imgPaths[2];
+    for (int c = 0; c < numCameras; c++){
+        imgPaths[c] = utils::getImgPaths(argv[7 + 2 * c], extension);
+        serials.emplace_back(argv[8 + 2 * c]);
+        if (imgPaths[c].empty()){
+            std::cerr << "No images found in " << argv[7 + 2 * c] << ". Exiting\n";
+            return 1;
+        }
+    }
+    if (stereo && imgPaths[0].size() != imgPaths[1].size()){
+        std::cerr << "Error, left and right images must be of the same number\n";
+        return 1;
+    }
+    const int numImgs = imgPaths[0].size();
+
+    // Contiguous shards of (almost) the same size
+    std::vector<int> shardStarts;
+    for (int k = 0; k <= numShards; k++)
+        shardStarts.emplace_back((int)((int64_t)k * numImgs / numShards));
+
+    const utils::DetectorSettings detectorSettings = utils::getDetectorSettings(argc, argv);
+    cv::FileStorage manifest(manifestPath, cv::FileStorage::WRITE);
+    manifest << "Board_width" << std::stoi(argv[3]);
+    manifest << "Board_height" << std::stoi(argv[4]);
+    manifest << "Cell_size" << std::stof(argv[5]);
+    manifest << "Pyramid_level" << detectorSettings.pyramidLevel;
+    manifest << "Detector" << (detectorSettings.backend == utils::DetectorBackend::SB ? "sb" : "classic");
+    manifest << "Fast_reject" << (int)detectorSettings.fastReject;
+    manifest << "Serials" << serials;
+    manifest << "Shard_starts" << shardStarts;
+    for (int c = 0; c < numCameras; c++)
+        manifest << "Images_" + std::to_string(c) << imgPaths[c];
+    manifest.release();
+    std::cout << "Manifest written to " << manifestPath << ": " << numImgs << (stereo ? " image pairs" : " images")
+        << " in " << numShards << " shards\n";
+    for (int k = 0; k < numShards; k++)
+        std::cout << "\tShard " << k << ": images [" << shardStarts[k] << ", " << shardStarts[k + 1] << ")\n";
+    return 0;
+}
+
+
+int detect(int argc, char** argv){
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
+    const std::string manifestPath = argv[1];
+    const int shard = std::stoi(argv[2]);
+    const int numThreads = std::stoi(utils::getOptArg(argc, argv, "--threads", "0"));   // 0: one thread per core
+    const utils::CornerCache cornerCache = utils::getCornerCache(argc, argv);
+
+    cv::FileStorage manifest(manifestPath, cv::FileStorage::READ);
+    if (!manifest.isOpened()){
+        std::cerr << "Cannot read the manifest " << manifestPath << "\n";
+        return 1;
+    }
+    int boardWidth, boardHeight;
+    std::vector<std::string> serials;
+    std::vector<int> shardStarts;
+    utils::DetectorSettings detectorSettings;
+    manifest["Board_width"] >> boardWidth;
+    manifest["Board_height"] >> boardHeight;
+    std::string detector;
+    int fastReject = 0;
+    manifest["Pyramid_level"] >> detectorSettings.pyramidLevel;
+    manifest["Detector"] >> detector;
+    manifest["Fast_reject"] >> fastReject;
+    detectorSettings.backend = (detector == "sb") ? utils::DetectorBackend::SB : utils::DetectorBackend::CLASSIC;
+    detectorSettings.fastReject = fastReject != 0;
+    manifest["Serials"] >> serials;
+    manifest["Shard_starts"] >> shardStarts;
+    if (shard < 0 || shard + 1 >= (int)shardStarts.size()){
+        std::cerr << "Shard " << shard << " is not in the manifest (" << (int)shardStarts.size() - 1 << " shards)\n";
+        return 1;
+    }
+    const int first = shardStarts[shard], numImgs = shardStarts[shard + 1] - first;
+    const int numCameras = serials.size();
+    std::vector<std::string> imgPaths[2];
+    for (int c = 0; c < numCameras; c++)
+        manifest["Images_" + std::to_string(c)] >> imgPaths[c];
+    std::cout << "Shard " << shard << ": images [" << first << ", " << first + numImgs << ")\n";
+
+    // Detect the corners of all the images of the shard (all cameras)
+    const std::string detectorKey = utils::getDetectorKey(cv::Size(boardWidth, boardHeight), detectorSettings);
+    std::vector<std::vector<cv::Point2f>> detectedCorners[2];
+    std::vector<char> detected[2];
+    std::vector<cv::Size> imgRes[2];
+    for (int c = 0; c < numCameras; c++){
+        detectedCorners[c].resize(numImgs);
+        detected[c].resize(numImgs, false);
+        imgRes[c].resize(numImgs);
+    }
+    const int64 start = cv::getTickCount();
+    utils::parallelFor(numCameras * numImgs, numThreads, [&](size_t j){
+        const int c = j / numImgs;
+        const size_t i = j % numImgs;
+        TRACE_SCOPE("image");
+        utils::ImgSource img(imgPaths[c][first + i]);
+        detected[c][i] = cornerCache.findChessCorners(img.encoded(), detectorKey, boardWidth * boardHeight, [&](std::vector<cv::Point2f> &chessCorners){
+            return utils::findChessCorners(img.gray(), boardWidth, boardHeight, chessCorners, detectorSettings);
+        }, detectedCorners[c][i]);
+        imgRes[c][i] = utils::getImgRes(imgPaths[c][first + i]);
+    });
+    const double detectTime = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+    // All the images of a camera must have the same resolution (checked again across the shards by merge)
+    for (int c = 0; c < numCameras; c++){
+        for (int i = 0; i < numImgs; i++){
+            if (imgRes[c][i] != imgRes[c][0]){
+                std::cerr << "Found inconsistencies in the resolution of the images of " << serials[c] << " (" << imgPaths[c][first + i]
+                    << "). Check your data\n";
+                return 1;
+            }
+        }
+    }
+
+    // Partial corner logs (image indices of the whole dataset), then the summary
+    for (int c = 0; c < numCameras; c++){
+        utils::CornerLogWriter cornerLog(getShardPath(manifestPath, shard, "_" + serials[c] + ".yml"), "image_", utils::CornerLogFormat::BINARY);
+        for (int i = 0; i < numImgs; i++){
+            if (detected[c][i])
+                cornerLog.write(first + i, detectedCorners[c][i]);
+        }
+    }
+    const std::string summaryPath = getShardPath(manifestPath, shard, ".yml");
+    cv::FileStorage summary(summaryPath + ".tmp", cv::FileStorage::WRITE | cv::FileStorage::FORMAT_YAML);
+    summary << "Manifest_hash" << getManifestHash(manifestPath);
+    summary << "Shard_start" << first;
+    summary << "Shard_end" << first + numImgs;
+    summary << "Num_images" << numImgs;
+    for (int c = 0; c < numCameras; c++){
+        summary << "Img_res_" + std::to_string(c) << (numImgs > 0 ? imgRes[c][0] : cv::Size());
+        summary << "Num_found_" + std::to_string(c) << (int)std::count(detected[c].begin(), detected[c].end(), true);
+    }
+    summary << "Detection_time" << detectTime;
+    summary.release();
+    fs::rename(summaryPath + ".tmp", summaryPath);                     // Atomic: merge never sees a partial shard
+    for (int c = 0; c < numCameras; c++)
+        std::cout << "\t" << serials[c] << ": board found in " << std::count(detected[c].begin(), detected[c].end(), true)
+            << "/" << numImgs << " images\n";
+    std::cout << "\tDetection time: " << detectTime << " s. Shard written to " << summaryPath << "\n";
+    utils::DetectorStats::get().print();
+    return 0;
+}
+
+
+int merge(int argc, char** argv){
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
+    const std::string manifestPath = argv[1];
+    const size_t maxViews = std::stoul(utils::getOptArg(argc, argv, "--max-views", "0"));  // 0: use all the views
+    const std::string bundlePath = utils::getOptArg(argc, argv, "--bundle", "");           // Empty: do not write the calibration bundle
+
+    cv::FileStorage manifest(manifestPath, cv::FileStorage::READ);
+    if (!manifest.isOpened()){
+        std::cerr << "Cannot read the manifest " << manifestPath << "\n";
+        return 1;
+    }
+    stereocalib::Board board;
+    std::vector<std::string> serials;
+    std::vector<int> shardStarts;
+    manifest["Board_width"] >> board.width;
+    manifest["Board_height"] >> board.height;
+    manifest["Cell_size"] >> board.cellSize;
+    manifest["Serials"] >> serials;
+    manifest["Shard_starts"] >> shardStarts;
+    const int numCameras = serials.size();
+    const int numShards = (int)shardStarts.size() - 1;
+    const size_t numImgs = shardStarts.back();
+
+    // Every shard must be complete, detected for this manifest (not a previous plan with the same name), with the same image resolution
+    const std::string manifestHash = getManifestHash(manifestPath);
+    std::vector<int> missing;
+    cv::Size imgRes;
+    for (int k = 0; k < numShards; k++){
+        cv::FileStorage summary(getShardPath(manifestPath, k, ".yml"), cv::FileStorage::READ);
+        if (!summary.isOpened()){
+            missing.emplace_back(k);
+            continue;
+        }
+        std::string shardHash;
+        int shardStart = -1, shardEnd = -1, shardImgs;
+        summary["Manifest_hash"] >> shardHash;
+        summary["Shard_start"] >> shardStart;
+        summary["Shard_end"] >> shardEnd;
+        summary["Num_images"] >> shardImgs;
+        if (shardHash != manifestHash || shardStart != shardStarts[k] || shardEnd != shardStarts[k + 1]){
+            std::cerr << "Shard " << k << " was not detected for this manifest (stale shard of a previous plan?). Run detect again\n";
+            return 1;
+        }
+        for (int c = 0; c < numCameras && shardImgs > 0; c++){
+            cv::Size shardRes;
+            summary["Img_res_" + std::to_string(c)] >> shardRes;
+            if (imgRes.empty())
+                imgRes = shardRes;
+            if (shardRes != imgRes){
+                std::cerr << "Shard " << k << " has images of resolution " << shardRes << " instead of " << imgRes << ". Check your data\n";
+                return 1;
+            }
+        }
+    }
+    if (!missing.empty()){
+        std::cerr << missing.size() << " shards are missing or still running:";
+        for (const int k : missing)
+            std::cerr << " " << k;
+        std::cerr << "\n";
+        return 1;
+    }
+
+    // Corners back in the image order
+    std::vector<std::vector<cv::Point2f>> detectedCorners[2];
+    std::vector<char> detected[2];
+    for (int c = 0; c < numCameras; c++){
+        detectedCorners[c].resize(numImgs);
+        detected[c].resize(numImgs, false);
+        for (int k = 0; k < numShards; k++){
+            std::vector<int> imgIdxs;
+            std::vector<std::vector<cv::Point2f>> chessCorners;
+            if (!utils::readCornerLog(getShardPath(manifestPath, k, "_" + serials[c] + ".bin"), imgIdxs, chessCorners)){
+                std::cerr << "Cannot read the corners of shard " << k << " (" << serials[c] << ")\n";
+                return 1;
+            }
+            for (size_t v = 0; v < imgIdxs.size(); v++){
+                if (imgIdxs[v] < shardStarts[k] || imgIdxs[v] >= shardStarts[k + 1] ||
+                    chessCorners[v].size() != (size_t)(board.width * board.height)){
+                    std::cerr << "Corrupt corners of shard " << k << " (" << serials[c] << "): image " << imgIdxs[v] << ". Run detect again\n";
+                    return 1;
+                }
+                detectedCorners[c][imgIdxs[v]] = std::move(chessCorners[v]);
+                detected[c][imgIdxs[v]] = true;
+            }
+        }
+        if (std::count(detected[c].begin(), detected[c].end(), true) == 0){
+            std::cerr << "No chessboard found in the images of " << serials[c] << ". Exiting\n";
+            return 1;
+        }
+    }
+    std::cout << "Merged " << numShards << " shards: " << numImgs << " images of resolution " << imgRes << "\n";
+
+    // Merged corner logs, as written by the calibration tools
+    fs::create_directory(logFolder);
+    const utils::CornerLogFormat cornerLogFormat = utils::getCornerLogFormat(argc, argv);
+    for (int c = 0; c < numCameras; c++){
+        fs::create_directory(logFolder + "/" + serials[c]);
+        utils::CornerLogWriter cornerLog(logFolder + "/" + serials[c] + "/chessCorners.yml", "image_", cornerLogFormat);
+        for (size_t i = 0; i < numImgs; i++){
+            if (detected[c][i])
+                cornerLog.write(i, detectedCorners[c][i]);
+        }
+    }
+
+    // Single camera calibrations (in parallel)
+    stereocalib::MonoCalibration calib[2];
+    utils::parallelFor(numCameras, numCameras, [&](size_t c){
+        std::vector<std::vector<cv::Point2f>> chessCorners2D;
+        for (size_t i = 0; i < numImgs; i++){
+            if (detected[c][i])
+                chessCorners2D.emplace_back(detectedCorners[c][i]);
+        }
+        calib[c] = stereocalib::calibrateMono(chessCorners2D, imgRes, board, maxViews);
+    });
+    for (int c = 0; c < numCameras; c++){
+        const std::string calFilename = logFolder + "/calib_" + serials[c] + ".yml";
+        stereocalib::writeMonoCalibration(calFilename, logFolder + "/info_" + serials[c] + ".yml", serials[c], board, calib[c]);
+        std::cout << "\t" << serials[c] << ": reprojection error " << calib[c].reprError << " with " << calib[c].views.size() << " views\n";
+        std::cout << "\tCalibration written to " << calFilename << "\n";
+    }
+    stereocalib::CalibrationSet set;
+    set.board = board;
+    set.serials = serials;
+    set.cameras.assign(calib, calib + numCameras);
+    if (numCameras == 1)
+        return writeBundle(bundlePath, set, false);
+
+    // Stereo calibration and rectification
+    std::vector<std::vector<cv::Point2f>> chessCorners2DL, chessCorners2DR;
+    for (size_t i = 0; i < numImgs; i++){
+        if (detected[0][i] && detected[1][i]){
+            chessCorners2DL.emplace_back(detectedCorners[0][i]);
+            chessCorners2DR.emplace_back(detectedCorners[1][i]);
+        }
+    }
+    if (chessCorners2DL.empty()){
+        std::cerr << "No image pair with the chessboard found in both the images. Exiting\n";
+        return 1;
+    }
+    const stereocalib::StereoCalibration calibStereo = stereocalib::calibrateStereo(chessCorners2DL, chessCorners2DR, calib[0], calib[1],
+                                                                                board, maxViews);
+    std::cout << "\tStereo reprojection error: " << calibStereo.reprError << " with " << calibStereo.views.size() << " views\n";
+    const std::string stereoName = serials[0] + "_to_" + serials[1];
+    stereocalib::writeStereoCalibration(logFolder + "/calib_stereo_" + stereoName + ".yml", logFolder + "/info_stereo_" + stereoName + ".yml",
+                                        serials[0], serials[1], calibStereo);
+    set.stereo = calibStereo;
+    set.rect = stereocalib::rectify(calib[0], calib[1], calibStereo);
+    stereocalib::writeRectification(logFolder + "/rectify_" + stereoName + ".yml", set.rect);
+    std::cout << "\tStereo calibration and rectification written to " << logFolder << "\n";
+    return writeBundle(bundlePath, set, utils::hasOptFlag(argc, argv, "--bundle-maps"));
+}
+
+
+int writeBundle(const std::string &bundlePath, stereocalib::CalibrationSet &set, const bool withMaps){
+    if (bundlePath.empty())
+        return 0;
+    if (withMaps)
+        stereocalib::addRectificationMaps(set);
+    if (!stereocalib::writeCalibBundle(bundlePath, set)){
+        std::cerr << "Cannot write the calibration bundle " << bundlePath << "\n";
+        return 1;
+    }
+    std::cout << "\tCalibration bundle written to " << bundlePath << "\n";
+    return 0;
+}
+
+
+std::string getShardPath(const std::string &manifestPath, const int shard, const std::string &suffix){
+    const fs::path manifest(manifestPath);
+    return (manifest.parent_path() / (manifest.stem().u8string() + "_shard_" + std::to_string(shard) + suffix)).u8string();
+}
+
+
+std::string getManifestHash(const std::string &manifestPath){
+    std::ifstream in(manifestPath, std::ios::binary);
+    const std::vector<char> content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return std::to_string(utils::hashBytes(content.data(), content.size()));
+}
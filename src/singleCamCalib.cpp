@@ -1,4 +1,12 @@
 #include "utils.h"
+#include "cornerCache.h"
+#include "debugWriter.h"
+#include "cornerLog.h"
+#include "cornerTracker.h"
+#include "videoSource.h"
+#include "viewSelection.h"
+#include "stereoCalib.h"
+#include "calibBundle.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -6,6 +14,7 @@
 #include <opencv2/calib3d/calib3d.hpp>
 
 #include <iostream>
+#include <climits>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
@@ -19,40 +28,57 @@ int main(int argc, char** argv)
     if (argc < 7) 
     {
         std::cerr << "Usage ./singleCamChessCalib boardWidth boardHeight cellSize " 
-            "imgFolder extension camSerial" << std::endl;
+            "imgFolder|videoFile extension camSerial [--threads N] [--pyramid off|auto|N] [--detector classic|sb] [--fast-reject] [--track] [--corner-cache dir|off] "
+            "[--debug-images off|found|failed|outliers|all] [--debug-scale S] [--debug-memory MB] [--debug-threads N] "
+            "[--corner-log yaml|binary|both] [--video-step N] [--min-sharpness S] [--min-motion M] [--min-pose-change P] "
+            "[--max-views N] [--compare-selection] "
+            "[--init-calib calib.yml] [--history corners.bin,...] [--bundle out.scb] [--trace trace.json]" << std::endl;
         return 1;
     }
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
     const int boardWidth = std::stoi(argv[1]);
     const int boardHeight = std::stoi(argv[2]);
     const float cellSize = std::stof(argv[3]);
     const std::string imgFolder = argv[4];
     const std::string extension = argv[5];
     const std::string camSerial = argv[6];
+    const int numThreads = std::stoi(utils::getOptArg(argc, argv, "--threads", "0"));   // 0: one thread per core
+    const utils::DetectorSettings detectorSettings = utils::getDetectorSettings(argc, argv);
+    const bool tracking = utils::hasOptFlag(argc, argv, "--track");                      // Track the corners from frame to frame
+    const utils::CornerCache cornerCache = utils::getCornerCache(argc, argv);
+    utils::DebugWriter debugWriter(utils::getDebugSettings(argc, argv, "found"));
     std::cout << "Input arguments:\n\tboardWidth: " << boardWidth
         << "\n\tboardHeight: " << boardHeight << "\n\tcellSize: " << cellSize 
-        << "\n\tcamSerial: " << camSerial << "\n";
-
-    // Prepare file manager (cv::Filestorage)
-    cv::FileStorage fs;
-
-    // Load the filepaths of the images
-    std::cout << "Loading image filepaths\n";
-    const std::vector<std::string> imgPaths = utils::getImgPaths(imgFolder, extension);
-    if (imgPaths.size() > 0)
-    {   
-        std::cout << "\tFound " << imgPaths.size() << " images\n";
-    } 
-    else 
+        << "\n\tcamSerial: " << camSerial << "\n\tthreads: " << numThreads << "\n";
+
+    // A regular file as input is a video: frames are decoded while streaming, instead of images loaded from the disk
+    const bool videoInput = utils::isVideoInput(imgFolder);
+    std::vector<std::string> imgPaths;
+    cv::Size imgResolution;
+    if (videoInput)
     {
-        std::cout << "\tNo images Found. Exiting\n";
-        return 1;
+        std::cout << "Reading video " << imgFolder << "\n";
     }
+    else
+    {
+        // Load the filepaths of the images
+        std::cout << "Loading image filepaths\n";
+        imgPaths = utils::getImgPaths(imgFolder, extension);
+        if (imgPaths.size() > 0)
+        {   
+            std::cout << "\tFound " << imgPaths.size() << " images\n";
+        } 
+        else 
+        {
+            std::cout << "\tNo images Found. Exiting\n";
+            return 1;
+        }
 
-    // Check that all the images have the same resolution   
-    cv::Size imgResolution;       
-    if(!utils::checkImgsResolution(imgPaths, imgResolution)) {
-        std::cerr << "Found inconsistencies in the image resolutions. Check your data\n";
-        exit(1);
+        // Check that all the images have the same resolution   
+        if(!utils::checkImgsResolution(imgPaths, imgResolution)) {
+            std::cerr << "Found inconsistencies in the image resolutions. Check your data\n";
+            exit(1);
+        }
     }
 
     // Create log folders
@@ -61,101 +87,261 @@ int main(int argc, char** argv)
 
 
     /* 
-    FIND CHESSBOARD CORNERS AND CREATE ASSOCIATED 3D POINTS
+    FIND CHESSBOARD CORNERS
     */
     std::cout << "Looking for chess corners\n";
     std::vector<std::vector<cv::Point2f>> chessCorners2D;                   // Detected chess corners foreach image
-    std::vector<std::vector<cv::Point3f>> chessCorners3D;                   // Associated 3D points foreach corner foreach image
+    std::vector<uint> viewImgIdx;                                           // Index of the image of each view
+    //
+    // Candidate views: name, index (image index or video frame) and detection result
+    std::vector<std::string> imgNames;
+    std::vector<uint> imgIdxs;
+    std::vector<std::vector<cv::Point2f>> detectedCorners;
+    std::vector<char> detected;
+    const cv::Size boardSize(boardWidth, boardHeight);
+    if (!videoInput)
+    {
+        // Detect the corners of all the images in parallel. Results are stored by image index,
+        // so that the logs and the calibration input keep the order of imgPaths.
+        // Tracking splits the sequence in contiguous chunks, each one with its own tracker
+        imgNames = imgPaths;
+        for (uint i = 0; i < imgPaths.size(); i++)
+            imgIdxs.emplace_back(i);
+        detectedCorners.resize(imgPaths.size());
+        detected.resize(imgPaths.size(), false);
+        const std::string detectorKey = utils::getDetectorKey(boardSize, detectorSettings);
+        const size_t numImgs = imgPaths.size();
+        const size_t numChunks = tracking ? std::min(numImgs, 4 * (size_t)std::max(1u, numThreads > 0 ? (unsigned int)numThreads :
+                                                                                        std::thread::hardware_concurrency())) : numImgs;
+        utils::parallelFor(numChunks, numThreads, [&](size_t k)
+        {
+            utils::CornerTracker tracker(boardSize, detectorSettings, tracking);
+            for (size_t i = k * numImgs / numChunks; i < (k + 1) * numImgs / numChunks; i++)
+            {
+                TRACE_SCOPE("image");
+                utils::ImgSource img(imgPaths[i]);
+
+                // Look for chess corners, unless they were already detected in a previous run
+                detected[i] = utils::findSequenceCorners(cornerCache, detectorKey, img, tracker, detectedCorners[i]);
+
+                // Save chessboard corners as image (decoded and drawn in the background)
+                if (debugWriter.wants(detected[i]))
+                    debugWriter.write(logFolder + "/" + camSerial + "/" + std::to_string(i) + ".jpeg", 
+                                            imgPaths[i], boardSize, detectedCorners[i], detected[i]);
+            }
+        });
+    }
+    else
+    {
+        // Stream the video: blurred frames and frames too similar to the last detected one are skipped before
+        // the detection, which runs in parallel on batches of frames. Views with a pose already seen are dropped.
+        // Tracking runs on every decoded frame instead (in order, on this thread), as it relies on the small motion
+        // between consecutive frames: the skipped frames only carry the corners forward, never run the full detector
+        const utils::VideoSettings videoSettings = utils::getVideoSettings(argc, argv);
+        utils::VideoFrameSource video(imgFolder, videoSettings.step);
+        utils::FrameSelector selector(videoSettings);
+        if (!video.isOpened())
+        {
+            std::cerr << "Cannot open the video " << imgFolder << "\n";
+            return 1;
+        }
+        imgResolution = video.getResolution();
+        const size_t batchSize = 2 * std::max(1u, numThreads > 0 ? (unsigned int)numThreads : std::thread::hardware_concurrency());
+        utils::CornerTracker tracker(boardSize, detectorSettings, tracking);
+        int readFrames = 0, detectedFrames = 0, redundantFrames = 0;
+        bool streaming = true;
+        while (streaming)
+        {
+            std::vector<cv::Mat> batch;
+            std::vector<int> batchIdxs;
+            std::vector<std::vector<cv::Point2f>> batchCorners;
+            std::vector<char> batchFound;
+            while (batch.size() < batchSize)
+            {
+                cv::Mat frame;                                              // New buffer for each frame, as the batch holds them
+                int frameIdx;
+                {
+                    TRACE_SCOPE("readFrame");
+                    if (!(streaming = video.read(frame, frameIdx)))
+                        break;
+                }
+                readFrames++;
+                const bool accepted = selector.accept({frame});
+                if (tracking)
+                {
+                    TRACE_SCOPE("image");
+                    cv::Mat frameGray;
+                    std::vector<cv::Point2f> corners;
+                    cv::cvtColor(frame, frameGray, cv::COLOR_BGR2GRAY);
+                    const bool found = tracker.find(frameGray, corners, accepted);
+                    if (accepted)
+                    {
+                        batchCorners.emplace_back(corners);
+                        batchFound.emplace_back(found);
+                    }
+                }
+                if (accepted)
+                {
+                    batch.emplace_back(frame);
+                    batchIdxs.emplace_back(frameIdx);
+                }
+            }
+
+            if (!tracking)
+            {
+                batchCorners.resize(batch.size());
+                batchFound.resize(batch.size(), false);
+                utils::parallelFor(batch.size(), numThreads, [&](size_t b)
+                {
+                    TRACE_SCOPE("image");
+                    cv::Mat frameGray;
+                    cv::cvtColor(batch[b], frameGray, cv::COLOR_BGR2GRAY);
+                    batchFound[b] = utils::findChessCorners(frameGray, boardWidth, boardHeight, batchCorners[b], detectorSettings);
+                });
+            }
+            detectedFrames += batch.size();
+
+            // Keep the results in frame order
+            for (size_t b = 0; b < batch.size(); b++)
+            {
+                if (batchFound[b] && !selector.isNewPose(batchCorners[b], imgResolution))
+                {
+                    redundantFrames++;
+                    continue;
+                }
+                imgNames.emplace_back(imgFolder + "#" + std::to_string(batchIdxs[b]));
+                imgIdxs.emplace_back(batchIdxs[b]);
+                detectedCorners.emplace_back(batchCorners[b]);
+                detected.emplace_back(batchFound[b]);
+                if (debugWriter.wants(batchFound[b]))
+                    debugWriter.write(logFolder + "/" + camSerial + "/" + std::to_string(batchIdxs[b]) + ".jpeg", 
+                                        batch[b], boardSize, batchCorners[b], batchFound[b]);
+            }
+        }
+        std::cout << "\tRead " << readFrames << " frames, " << detectedFrames << " sent to detection, " 
+            << redundantFrames << " dropped as redundant\n";
+        if (readFrames == 0)
+        {
+            std::cerr << "No frames in the video. Exiting\n";
+            return 1;
+        }
+    }
     //
-    for (uint i=0; i<imgPaths.size(); i++) 
+    utils::CornerLogWriter cornerLog(logFolder + "/" + camSerial + "/chessCorners.yml", "image_", utils::getCornerLogFormat(argc, argv));
+    for (uint k=0; k<imgNames.size(); k++) 
     {
-        cv::Mat img, imgGray;
-        img = cv::imread(imgPaths[i], cv::IMREAD_COLOR);       
-        cv::cvtColor(img, imgGray, cv::COLOR_BGR2GRAY);
-
-        // Look for chess corners
-        std::vector<cv::Point2f> chessCorners;
-        const bool found = utils::findChessCorners(imgGray, boardWidth, boardHeight, chessCorners);
-        if (found) 
+        const std::vector<cv::Point2f> &chessCorners = detectedCorners[k];
+        if (detected[k]) 
         {                                                
-            std::cout << "\t" << imgPaths[i] << ": Found\n";
+            std::cout << "\t" << imgNames[k] << ": Found\n";
             
             // Save chessboard corners coordinates
-            fs.open(logFolder + "/" + camSerial + "/chessCorners.yml", cv::FileStorage::APPEND);               
-            fs << "image_" + std::to_string(i) << chessCorners; 
-            fs.release();
-
-            // Save chessboard corners as image
-            utils::saveChessCornersAsImg(logFolder + "/" + camSerial + "/" + std::to_string(i) + ".jpeg", 
-                                    img, cv::Size(boardWidth, boardHeight), chessCorners);
+            cornerLog.write(imgIdxs[k], chessCorners);
 
             chessCorners2D.emplace_back(chessCorners);
+            viewImgIdx.emplace_back(imgIdxs[k]);
         }
         else 
         {                                                      
-            std::cout << "\t" << imgPaths[i] << ": Not found\n";
-            continue;
+            std::cout << "\t" << imgNames[k] << ": Not found\n";
         }
-        
-        // Set up the 3D points starting from the top-left corner of the chessboard. 
-        // Use cellSize to scale them. Assume they are on a plane (z=0)
-        std::vector<cv::Point3f> chessObjPoints;
-        for (int i = 0; i < boardHeight; i++)
+    }
+    utils::DetectorStats::get().print();
+
+    // Recalibration: add the views of previous runs (binary corner logs), without detecting them again.
+    // These views have no image (index UINT_MAX)
+    const std::string history = utils::getOptArg(argc, argv, "--history", "");
+    if (!history.empty())
+    {
+        std::vector<int> historyIdxs;
+        std::vector<std::vector<cv::Point2f>> historyCorners;
+        if (!utils::readCornerHistory(history, boardWidth * boardHeight, historyIdxs, historyCorners))
         {
-            for (int j = 0; j < boardWidth; j++)
-            {
-                chessObjPoints.emplace_back(cv::Point3f((float)j * cellSize, (float)i * cellSize, 0));
-            }
+            std::cerr << "Cannot read the corner logs " << history << "\n";
+            return 1;
         }
-        chessCorners3D.emplace_back(chessObjPoints);
+        for (const auto &chessCorners : historyCorners)
+        {
+            chessCorners2D.emplace_back(chessCorners);
+            viewImgIdx.emplace_back(UINT_MAX);
+        }
+        std::cout << "Added " << historyCorners.size() << " views from previous runs\n";
     }
 
 
     /* 
     START CALIBRATION
     */
-    cv::Mat K, D;                                               // Camera matrix and distortion vector
-    std::vector<cv::Mat> rVecs, tVecs;                          // Rotation and translation of each camera   
-    std::vector<double> intrinsicStd, extrinsicStd;             // Standard deviation of intrinsic and extrinsic params
-    std::vector<double> perViewReprErr;                         // Per-view reprojection error of the corners
-    int flag = 0;                                               // Ignore K4 and K5
-    flag |= cv::CALIB_FIX_K4;
-    flag |= cv::CALIB_FIX_K5;
-    cv::TermCriteria termCrit(cv::TermCriteria::Type::EPS |     // Termination criteria
-                    cv::TermCriteria::Type::MAX_ITER, 
-                    30, 0.001);
+    const stereocalib::Board board{boardWidth, boardHeight, cellSize};
+
+    // Recalibration: start from a previous calibration of the camera instead of solving from scratch
+    const std::string initCalib = utils::getOptArg(argc, argv, "--init-calib", "");
+    stereocalib::MonoCalibration initial;
+    if (!initCalib.empty())
+    {
+        if (!stereocalib::readMonoCalibration(initCalib, initial) || initial.imgRes != imgResolution)
+        {
+            std::cerr << "Invalid initial calibration " << initCalib << " for images of resolution " << imgResolution << "\n";
+            return 1;
+        }
+        std::cout << "Starting from the calibration " << initCalib << "\n";
+    }
+
+    // Solve with the maxViews views that best cover the image and the board poses (0: all the views)
+    const size_t maxViews = std::stoul(utils::getOptArg(argc, argv, "--max-views", "0"));
     std::cout << "Calibrating";
-    const double reprError = cv::calibrateCamera(
-                            chessCorners3D, 
-                            chessCorners2D, imgResolution,
-                            K, D, rVecs, tVecs, 
-                            intrinsicStd, extrinsicStd,
-                            perViewReprErr, flag, termCrit);
-    std::cout << "\n\tOverall reprojection error: " << reprError << "\n";
-
-    // Write calibration results
-    const std::string calFilename = logFolder + "/calib_" + camSerial + ".yml";                  
-    fs.open(calFilename, cv::FileStorage::WRITE);      
-    fs << "Serial" << camSerial;
-    fs << "Img_res" << imgResolution;
-    fs << "K" << K;
-    fs << "D" << D;
-    fs << "Board_width" << boardWidth;
-    fs << "Board_weight" << boardHeight;   
-    fs << "Cell_size" << cellSize;
-    fs.release();
-    std::cout << "\tCalibration written to " << calFilename << "\n";
+    const stereocalib::MonoCalibration calib = stereocalib::calibrateMono(chessCorners2D, imgResolution, board, maxViews, 
+                                                                        initCalib.empty() ? nullptr : &initial);
+    std::cout << "\n\tOverall reprojection error: " << calib.reprError << "\n";
+    std::cout << "\tSolved with " << calib.views.size() << " views in " << calib.solveTime << " s\n";
+    if (calib.views.size() < chessCorners2D.size())
+    {
+        std::cout << "\tSelected " << calib.views.size() << " of " << chessCorners2D.size() << " views\n";
+        std::cout << "\tReprojection error on all the " << chessCorners2D.size() << " views: " 
+            << utils::computeReprError(stereocalib::getBoardPoints(board, chessCorners2D.size()), chessCorners2D, calib.K, calib.D) << "\n";
+
+        // Solve again without selection, for comparison only
+        if (utils::hasOptFlag(argc, argv, "--compare-selection"))
+        {
+            const stereocalib::MonoCalibration calibAll = stereocalib::calibrateMono(chessCorners2D, imgResolution, board, 0, 
+                                                                                    initCalib.empty() ? nullptr : &initial);
+            std::cout << "\tWithout selection: reprojection error " << calibAll.reprError << ", solved with " 
+                << chessCorners2D.size() << " views in " << calibAll.solveTime << " s\n";
+        }
+    }
 
-    // Write calibration info
+    // Save the views that do not fit the calibration (images only: video frames are not kept)
+    if (debugWriter.wantsOutliers() && !videoInput){
+        for (const size_t k : utils::getOutlierViews(calib.perViewReprErr)){
+            const size_t v = calib.views[k];
+            const uint i = viewImgIdx[v];
+            if (i == UINT_MAX)
+                continue;
+            debugWriter.write(logFolder + "/" + camSerial + "/" + std::to_string(i) + ".jpeg", 
+                            imgPaths[i], cv::Size(boardWidth, boardHeight), chessCorners2D[v], true);
+        }
+    }
+
+    // Write calibration results and statistics
+    const std::string calFilename = logFolder + "/calib_" + camSerial + ".yml";                  
     const std::string calInfoFilename = logFolder + "/info_" + camSerial + ".yml";
-    fs.open(calInfoFilename, cv::FileStorage::WRITE);
-    fs << "rVecs" << rVecs;
-    fs << "tVecs" << tVecs;
-    fs << "intrStd" << intrinsicStd;
-    fs << "extrStd" << extrinsicStd;
-    fs << "perViewReprErr" << perViewReprErr;
-    fs.release();
+    stereocalib::writeMonoCalibration(calFilename, calInfoFilename, camSerial, board, calib);
+    std::cout << "\tCalibration written to " << calFilename << "\n";
     std::cout << "\tCalibration statistics written to " << calInfoFilename << "\n";
 
+    // The same calibration in one binary file (single camera bundle), for the consumers that load it at startup
+    const std::string bundlePath = utils::getOptArg(argc, argv, "--bundle", "");
+    if (!bundlePath.empty()){
+        stereocalib::CalibrationSet set;
+        set.board = board;
+        set.serials = {camSerial};
+        set.cameras = {calib};
+        if (!stereocalib::writeCalibBundle(bundlePath, set)){
+            std::cerr << "Cannot write the calibration bundle " << bundlePath << "\n";
+            return 1;
+        }
+        std::cout << "\tCalibration bundle written to " << bundlePath << "\n";
+    }
+
     return 0;
 }
\ No newline at end of file
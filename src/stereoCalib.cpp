@@ -0,0 +1,381 @@
+#include "stereoCalib.h"
+#include "viewSelection.h"
+#include "calibBundle.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <cmath>
+
+namespace stereocalib {
+
+    namespace {
+
+        /** Sum of the squared reprojection errors of a view, and its RMS error (as cv::stereoCalibrate) */
+        double viewError(const std::vector<cv::Point2f> &projected, const std::vector<cv::Point2f> &detected, double &rms){
+            double sqErr = 0;
+            for (size_t k = 0; k < detected.size(); k++){
+                const cv::Point2f d = projected[k] - detected[k];
+                sqErr += d.x * d.x + d.y * d.y;
+            }
+            rms = std::sqrt(sqErr / detected.size());
+            return sqErr;
+        }
+
+        /** Refine the pose of the right camera wrt the left one from an initial pose, with fixed intrinsics: the board pose of each
+         * view is solved on the left image (PnP), then Levenberg-Marquardt on the 6 parameters of the stereo pose minimizes the
+         * reprojection error on the right images. The cost grows linearly with the views (one PnP and one projection each)
+         * @param chessCorners3D    Board points of each view
+         * @param viewsL            Detected corners of each view pair (left)
+         * @param viewsR            Detected corners of each view pair (right)
+         * @param left              Left camera calibration
+         * @param right             Right camera calibration
+         * @param initial           Initial stereo pose
+         * @param termCrit          Termination criteria (max iterations, min relative step)
+         * @param calib             Output stereo calibration (R, T, E, F, errors)
+        */
+        void refineStereoPose(const std::vector<std::vector<cv::Point3f>> &chessCorners3D, const std::vector<std::vector<cv::Point2f>> &viewsL,
+                            const std::vector<std::vector<cv::Point2f>> &viewsR, const MonoCalibration &left, const MonoCalibration &right,
+                            const StereoCalibration &initial, const cv::TermCriteria &termCrit, StereoCalibration &calib){
+            const size_t numViews = viewsL.size();
+            std::vector<cv::Mat> rVecsBoard(numViews), tVecsBoard(numViews);
+            for (size_t v = 0; v < numViews; v++)
+                cv::solvePnP(chessCorners3D[v], viewsL[v], left.K, left.D, rVecsBoard[v], tVecsBoard[v]);
+
+            // Sum of the squared right errors and, optionally, the normal equations (J^T J and J^T e) of the 6 pose parameters
+            auto evaluate = [&](const cv::Mat &pose, cv::Mat *JtJ, cv::Mat *Jte){
+                const cv::Mat rVec = pose.rowRange(0, 3), tVec = pose.rowRange(3, 6);
+                double sqErr = 0;
+                if (JtJ){
+                    *JtJ = cv::Mat::zeros(6, 6, CV_64F);
+                    *Jte = cv::Mat::zeros(6, 1, CV_64F);
+                }
+                for (size_t v = 0; v < numViews; v++){
+                    // Board pose in the right camera: R * Rboard, R * tboard + T
+                    cv::Mat rVecR, tVecR, dr3dr1, dr3dt1, dr3dr2, dr3dt2, dt3dr1, dt3dt1, dt3dr2, dt3dt2, jacobian;
+                    cv::composeRT(rVecsBoard[v], tVecsBoard[v], rVec, tVec, rVecR, tVecR,
+                                dr3dr1, dr3dt1, dr3dr2, dr3dt2, dt3dr1, dt3dt1, dt3dr2, dt3dt2);
+                    std::vector<cv::Point2f> projected;
+                    cv::projectPoints(chessCorners3D[v], rVecR, tVecR, right.K, right.D, projected, JtJ ? jacobian : cv::noArray());
+                    double rms;
+                    sqErr += viewError(projected, viewsR[v], rms);
+                    if (!JtJ)
+                        continue;
+
+                    // Chain rule: the projection jacobian starts with the derivatives wrt the board rotation and translation
+                    const cv::Mat Jr = jacobian.colRange(0, 3), Jt = jacobian.colRange(3, 6);
+                    cv::Mat J;
+                    cv::hconcat(cv::Mat(Jr * dr3dr2 + Jt * dt3dr2), cv::Mat(Jr * dr3dt2 + Jt * dt3dt2), J);
+                    cv::Mat residuals(jacobian.rows, 1, CV_64F);
+                    for (size_t k = 0; k < projected.size(); k++){
+                        residuals.at<double>(2 * k) = projected[k].x - viewsR[v][k].x;
+                        residuals.at<double>(2 * k + 1) = projected[k].y - viewsR[v][k].y;
+                    }
+                    *JtJ += J.t() * J;
+                    *Jte += J.t() * residuals;
+                }
+                return sqErr;
+            };
+
+            cv::Mat pose(6, 1, CV_64F);
+            cv::Rodrigues(initial.R, pose.rowRange(0, 3));
+            pose.at<double>(3) = initial.T[0];
+            pose.at<double>(4) = initial.T[1];
+            pose.at<double>(5) = initial.T[2];
+            cv::Mat JtJ, Jte;
+            double sqErr = evaluate(pose, &JtJ, &Jte);
+            double lambda = 1e-3;
+            for (int iter = 0; iter < termCrit.maxCount && lambda < 1e10; iter++){
+                cv::Mat A = JtJ.clone(), delta;
+                for (int i = 0; i < 6; i++)
+                    A.at<double>(i, i) *= 1 + lambda;
+                if (!cv::solve(A, -Jte, delta, cv::DECOMP_CHOLESKY))
+                    break;
+                const cv::Mat candidate = pose + delta;
+                const double candidateErr = evaluate(candidate, nullptr, nullptr);
+                if (candidateErr >= sqErr){
+                    lambda *= 10;
+                    continue;
+                }
+                pose = candidate;
+                lambda = std::max(lambda / 10, 1e-10);
+                sqErr = evaluate(pose, &JtJ, &Jte);
+                if (cv::norm(delta) < termCrit.epsilon * (cv::norm(pose) + termCrit.epsilon))
+                    break;
+            }
+
+            cv::Rodrigues(pose.rowRange(0, 3), calib.R);
+            calib.T = cv::Vec3d(pose.at<double>(3), pose.at<double>(4), pose.at<double>(5));
+            const cv::Mat Tx = (cv::Mat_<double>(3, 3) << 0, -calib.T[2], calib.T[1], calib.T[2], 0, -calib.T[0], -calib.T[1], calib.T[0], 0);
+            calib.E = Tx * calib.R;
+            calib.F = right.K.inv().t() * calib.E * left.K.inv();
+            calib.F /= calib.F.at<double>(2, 2);
+
+            // Errors of both cameras, as cv::stereoCalibrate: RMS of each view, overall RMS of all the points
+            calib.perViewReprErr.create(numViews, 2, CV_64F);
+            double totalErr = 0;
+            size_t numPoints = 0;
+            for (size_t v = 0; v < numViews; v++){
+                std::vector<cv::Point2f> projectedL, projectedR;
+                cv::Mat rVecR, tVecR;
+                cv::composeRT(rVecsBoard[v], tVecsBoard[v], pose.rowRange(0, 3), pose.rowRange(3, 6), rVecR, tVecR);
+                cv::projectPoints(chessCorners3D[v], rVecsBoard[v], tVecsBoard[v], left.K, left.D, projectedL);
+                cv::projectPoints(chessCorners3D[v], rVecR, tVecR, right.K, right.D, projectedR);
+                totalErr += viewError(projectedL, viewsL[v], calib.perViewReprErr.at<double>(v, 0));
+                totalErr += viewError(projectedR, viewsR[v], calib.perViewReprErr.at<double>(v, 1));
+                numPoints += viewsL[v].size();
+            }
+            calib.reprError = numPoints > 0 ? std::sqrt(totalErr / (2 * numPoints)) : 0;
+        }
+
+    } // namespace
+
+    std::vector<std::vector<cv::Point3f>> getBoardPoints(const Board &board, const size_t numViews){
+        return std::vector<std::vector<cv::Point3f>>(numViews, utils::getChessObjPoints(board.width, board.height, board.cellSize));
+    }
+
+    bool detectCorners(const cv::Mat &img, const Board &board, const utils::DetectorSettings &settings,
+                        std::vector<cv::Point2f> &chessCorners){
+        if (img.channels() == 1)
+            return utils::findChessCorners(img, board.width, board.height, chessCorners, settings);
+        cv::Mat imgGray;
+        cv::cvtColor(img, imgGray, cv::COLOR_BGR2GRAY);
+        return utils::findChessCorners(imgGray, board.width, board.height, chessCorners, settings);
+    }
+
+    MonoCalibration calibrateMono(const std::vector<std::vector<cv::Point2f>> &views, const cv::Size &imgRes, const Board &board,
+                                const size_t maxViews, const MonoCalibration *initial){
+        MonoCalibration calib;
+        calib.imgRes = imgRes;
+
+        // Keep the maxViews views that best cover the image and the board poses: the solver time
+        // grows with the number of views, while redundant views add little accuracy
+        if (maxViews > 0 && views.size() > maxViews){
+            calib.views = utils::selectViews({views}, imgRes, board.size(), maxViews);
+        } else {
+            for (size_t v = 0; v < views.size(); v++)
+                calib.views.emplace_back(v);
+        }
+        const std::vector<std::vector<cv::Point2f>> chessCorners2D = utils::selectElements(views, calib.views);
+        const std::vector<std::vector<cv::Point3f>> chessCorners3D = getBoardPoints(board, chessCorners2D.size());
+
+        int flag = 0;                                               // Ignore K4 and K5
+        flag |= cv::CALIB_FIX_K4;
+        flag |= cv::CALIB_FIX_K5;
+        if (initial){
+            calib.K = initial->K.clone();
+            calib.D = initial->D.clone();
+            flag |= cv::CALIB_USE_INTRINSIC_GUESS;
+        }
+        cv::TermCriteria termCrit(cv::TermCriteria::Type::EPS |     // Termination criteria
+                        cv::TermCriteria::Type::MAX_ITER,
+                        30, 0.001);
+
+        TRACE_SCOPE("calibrateCamera");
+        const int64 solveStart = cv::getTickCount();
+        calib.reprError = cv::calibrateCamera(chessCorners3D, chessCorners2D, imgRes, calib.K, calib.D, calib.rVecs, calib.tVecs,
+                                            calib.intrinsicStd, calib.extrinsicStd, calib.perViewReprErr, flag, termCrit);
+        calib.solveTime = (cv::getTickCount() - solveStart) / cv::getTickFrequency();
+        return calib;
+    }
+
+    StereoCalibration calibrateStereo(const std::vector<std::vector<cv::Point2f>> &viewsL, const std::vector<std::vector<cv::Point2f>> &viewsR,
+                                    const MonoCalibration &left, const MonoCalibration &right, const Board &board,
+                                    const size_t maxViews, const StereoCalibration *initial){
+        StereoCalibration calib;
+        calib.imgRes = left.imgRes;
+
+        // Keep the maxViews view pairs that best cover both images and the board poses
+        if (maxViews > 0 && viewsL.size() > maxViews){
+            calib.views = utils::selectViews({viewsL, viewsR}, left.imgRes, board.size(), maxViews);
+        } else {
+            for (size_t v = 0; v < viewsL.size(); v++)
+                calib.views.emplace_back(v);
+        }
+        const std::vector<std::vector<cv::Point2f>> chessCorners2DL = utils::selectElements(viewsL, calib.views);
+        const std::vector<std::vector<cv::Point2f>> chessCorners2DR = utils::selectElements(viewsR, calib.views);
+        const std::vector<std::vector<cv::Point3f>> chessCorners3D = getBoardPoints(board, chessCorners2DL.size());
+
+        cv::TermCriteria termCrit(cv::TermCriteria::Type::EPS |     // Termination criteria
+                        cv::TermCriteria::Type::MAX_ITER,
+                        30, 0.001);
+
+        // Recalibration: only refine the previous pose (6 parameters) on the old and new views, instead of solving
+        // the board poses and the stereo pose of all the views together
+        if (initial){
+            TRACE_SCOPE("refineStereoPose");
+            const int64 solveStart = cv::getTickCount();
+            refineStereoPose(chessCorners3D, chessCorners2DL, chessCorners2DR, left, right, *initial, termCrit, calib);
+            calib.solveTime = (cv::getTickCount() - solveStart) / cv::getTickFrequency();
+            return calib;
+        }
+
+        int flag = 0;
+        flag |= cv::CALIB_FIX_INTRINSIC;                            // Fix the intrinsics estimated in the single camera calibrations
+
+        // The intrinsics are fixed: work on copies, as stereoCalibrate takes them as input/output
+        cv::Mat KL = left.K.clone(), DL = left.D.clone(), KR = right.K.clone(), DR = right.D.clone();
+        TRACE_SCOPE("stereoCalibrate");
+        const int64 solveStart = cv::getTickCount();
+        calib.reprError = cv::stereoCalibrate(chessCorners3D, chessCorners2DL, chessCorners2DR, KL, DL, KR, DR,
+                                            left.imgRes, calib.R, calib.T, calib.E, calib.F, calib.perViewReprErr, flag, termCrit);
+        calib.solveTime = (cv::getTickCount() - solveStart) / cv::getTickFrequency();
+        return calib;
+    }
+
+    Rectification rectify(const MonoCalibration &left, const MonoCalibration &right, const StereoCalibration &stereo){
+        TRACE_SCOPE("stereoRectify");
+        Rectification rect;
+        cv::stereoRectify(left.K, left.D, right.K, right.D, stereo.imgRes, stereo.R, stereo.T,
+                        rect.R1, rect.R2, rect.P1, rect.P2, rect.Q);
+        return rect;
+    }
+
+    void writeMonoCalibration(const std::string &calFilename, const std::string &infoFilename, const std::string &serial,
+                            const Board &board, const MonoCalibration &calib){
+        TRACE_SCOPE("writeResults");
+        cv::FileStorage fs(calFilename, cv::FileStorage::WRITE);
+        fs << "Serial" << serial;
+        fs << "Img_res" << calib.imgRes;
+        fs << "K" << calib.K;
+        fs << "D" << calib.D;
+        fs << "Board_width" << board.width;
+        fs << "Board_weight" << board.height;
+        fs << "Cell_size" << board.cellSize;
+        fs.release();
+
+        fs.open(infoFilename, cv::FileStorage::WRITE);
+        fs << "rVecs" << calib.rVecs;
+        fs << "tVecs" << calib.tVecs;
+        fs << "intrStd" << calib.intrinsicStd;
+        fs << "extrStd" << calib.extrinsicStd;
+        fs << "perViewReprErr" << calib.perViewReprErr;
+        fs.release();
+    }
+
+    bool readMonoCalibration(const std::string &calFilename, MonoCalibration &calib, const int camera){
+        if (isCalibBundle(calFilename)){
+            CalibrationSet set;
+            if (!readCalibBundle(calFilename, set, false) || set.cameras.empty())
+                return false;
+            const size_t c = set.cameras.size() == 1 ? 0 : camera;     // Single camera bundle (singleCamCalib --bundle)
+            if (c >= set.cameras.size())
+                return false;
+            // Copies: the matrices of the set point into its mapping, released on return
+            calib.imgRes = set.cameras[c].imgRes;
+            calib.K = set.cameras[c].K.clone();
+            calib.D = set.cameras[c].D.clone();
+            return true;
+        }
+        cv::FileStorage fs(calFilename, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        fs["Img_res"] >> calib.imgRes;
+        fs["K"] >> calib.K;
+        fs["D"] >> calib.D;
+        return !calib.K.empty();
+    }
+
+    bool readSerial(const std::string &calFilename, std::string &serial, const int camera){
+        if (isCalibBundle(calFilename)){
+            CalibrationSet set;
+            if (!readCalibBundle(calFilename, set, false) || set.serials.empty())
+                return false;
+            const size_t c = set.serials.size() == 1 ? 0 : camera;
+            if (c >= set.serials.size())
+                return false;
+            serial = set.serials[c];
+            return true;
+        }
+        cv::FileStorage fs(calFilename, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        fs["Serial"] >> serial;
+        return true;
+    }
+
+    bool readBoard(const std::string &calFilename, Board &board){
+        if (isCalibBundle(calFilename)){
+            CalibrationSet set;
+            if (!readCalibBundle(calFilename, set, false))
+                return false;
+            board = set.board;
+            return board.width > 0 && board.height > 0;
+        }
+        cv::FileStorage fs(calFilename, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        fs["Board_width"] >> board.width;
+        fs["Board_weight"] >> board.height;
+        fs["Cell_size"] >> board.cellSize;
+        return board.width > 0 && board.height > 0;
+    }
+
+    void writeStereoCalibration(const std::string &calFilename, const std::string &infoFilename, const std::string &serialL,
+                                const std::string &serialR, const StereoCalibration &calib){
+        TRACE_SCOPE("writeResults");
+        cv::FileStorage fs(calFilename, cv::FileStorage::WRITE);
+        fs << "Serial_left" << serialL;
+        fs << "Serial_right" << serialR;
+        fs << "Img_res" << calib.imgRes;
+        fs << "R" << calib.R;
+        fs << "T" << calib.T;
+        fs << "E" << calib.E;
+        fs << "F" << calib.F;
+        fs.release();
+
+        fs.open(infoFilename, cv::FileStorage::WRITE);
+        fs << "perViewReprErr" << calib.perViewReprErr;
+        fs.release();
+    }
+
+    bool readStereoCalibration(const std::string &calFilename, StereoCalibration &calib){
+        if (isCalibBundle(calFilename)){
+            CalibrationSet set;
+            if (!readCalibBundle(calFilename, set, false))
+                return false;
+            calib.imgRes = set.stereo.imgRes;
+            calib.R = set.stereo.R.clone();
+            calib.T = set.stereo.T;
+            return !calib.R.empty();
+        }
+        cv::FileStorage fs(calFilename, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        fs["Img_res"] >> calib.imgRes;
+        fs["R"] >> calib.R;
+        fs["T"] >> calib.T;
+        return !calib.R.empty();
+    }
+
+    void writeRectification(const std::string &filename, const Rectification &rect){
+        TRACE_SCOPE("writeResults");
+        cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+        fs << "R1" << rect.R1;
+        fs << "R2" << rect.R2;
+        fs << "P1" << rect.P1;
+        fs << "P2" << rect.P2;
+        fs << "Q" << rect.Q;
+        fs.release();
+    }
+
+    bool readRectification(const std::string &filename, Rectification &rect){
+        if (isCalibBundle(filename)){
+            CalibrationSet set;
+            if (!readCalibBundle(filename, set, false))
+                return false;
+            rect = Rectification{set.rect.R1.clone(), set.rect.R2.clone(), set.rect.P1.clone(), set.rect.P2.clone(), set.rect.Q.clone()};
+            return !rect.R1.empty() && !rect.P1.empty();
+        }
+        cv::FileStorage fs(filename, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        fs["R1"] >> rect.R1;
+        fs["R2"] >> rect.R2;
+        fs["P1"] >> rect.P1;
+        fs["P2"] >> rect.P2;
+        fs["Q"] >> rect.Q;
+        return !rect.R1.empty() && !rect.P1.empty();
+    }
+
+} // namespace stereocalib
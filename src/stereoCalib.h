@@ -0,0 +1,158 @@
+#pragma once
+
+#include "utils.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <string>
+
+/*
+libstereocalib: single camera calibration, stereo calibration and rectification on in-memory data
+(images or detected corners). The executables are thin wrappers that read the inputs from disk and
+write the results with the functions below.
+*/
+namespace stereocalib {
+
+    /** Chessboard geometry */
+    struct Board {
+        int width = 0;                                  // Number of corner intersections of the chess row
+        int height = 0;                                 // Number of corner intersections of the chess column
+        float cellSize = 0;                             // Chessboard cell size
+
+        cv::Size size() const { return cv::Size(width, height); }
+    };
+
+    /** Single camera calibration */
+    struct MonoCalibration {
+        cv::Size imgRes;                                // Image resolution
+        cv::Mat K, D;                                   // Camera matrix and distortion vector
+        double reprError = 0;                           // Overall reprojection error of the solved views
+        std::vector<size_t> views;                      // Indices of the solved views among the input ones
+        std::vector<cv::Mat> rVecs, tVecs;              // Pose of each solved view
+        std::vector<double> intrinsicStd, extrinsicStd; // Standard deviation of intrinsic and extrinsic params
+        std::vector<double> perViewReprErr;             // Reprojection error of each solved view
+        double solveTime = 0;                           // Solver time [s]
+    };
+
+    /** Stereo calibration: pose of the right camera wrt the left camera */
+    struct StereoCalibration {
+        cv::Size imgRes;                                // Image resolution
+        cv::Mat R, E, F;                                // Rotation, essential and fundamental matrix
+        cv::Vec3d T;                                    // Translation
+        double reprError = 0;                           // Overall reprojection error of the solved views
+        std::vector<size_t> views;                      // Indices of the solved view pairs among the input ones
+        cv::Mat perViewReprErr;                         // Reprojection error of each solved view pair (left, right)
+        double solveTime = 0;                           // Solver time [s]
+    };
+
+    /** Stereo rectification (see cv::stereoRectify) */
+    struct Rectification {
+        cv::Mat R1, R2, P1, P2, Q;
+    };
+
+    /** Return the 3D board points of numViews views
+     * @param board         Chessboard geometry
+     * @param numViews      Number of views
+    */
+    std::vector<std::vector<cv::Point3f>> getBoardPoints(const Board &board, const size_t numViews);
+
+    /** Find the chessboard corners in an image
+     * @param img           Grayscale or BGR image
+     * @param board         Chessboard geometry
+     * @param settings      Detector settings
+     * @param chessCorners  Output corners
+    */
+    bool detectCorners(const cv::Mat &img, const Board &board, const utils::DetectorSettings &settings,
+                        std::vector<cv::Point2f> &chessCorners);
+
+    /** Calibrate a camera from the corners of its views
+     * @param views         Detected corners of each view
+     * @param imgRes        Image resolution
+     * @param board         Chessboard geometry
+     * @param maxViews      Solve with the maxViews views that best cover the image (0: all the views)
+     * @param initial       Calibration to start from (nullptr: solve from scratch)
+    */
+    MonoCalibration calibrateMono(const std::vector<std::vector<cv::Point2f>> &views, const cv::Size &imgRes, const Board &board,
+                                const size_t maxViews = 0, const MonoCalibration *initial = nullptr);
+
+    /** Calibrate the pose of the right camera wrt the left one, with fixed intrinsics
+     * @param viewsL        Detected corners of each view pair (left)
+     * @param viewsR        Detected corners of each view pair (right)
+     * @param left          Left camera calibration
+     * @param right         Right camera calibration
+     * @param board         Chessboard geometry
+     * @param maxViews      Solve with the maxViews view pairs that best cover the images (0: all the views)
+     * @param initial       Stereo calibration to start from (nullptr: solve from scratch). Only its pose is refined (fast, for
+     *                      rigs that drift slightly): the board poses come from the left views
+    */
+    StereoCalibration calibrateStereo(const std::vector<std::vector<cv::Point2f>> &viewsL, const std::vector<std::vector<cv::Point2f>> &viewsR,
+                                    const MonoCalibration &left, const MonoCalibration &right, const Board &board,
+                                    const size_t maxViews = 0, const StereoCalibration *initial = nullptr);
+
+    /** Compute the rectification of a calibrated stereo pair
+     * @param left          Left camera calibration
+     * @param right         Right camera calibration
+     * @param stereo        Stereo calibration
+    */
+    Rectification rectify(const MonoCalibration &left, const MonoCalibration &right, const StereoCalibration &stereo);
+
+    /** Write a single camera calibration (calib_<serial>.yml format) and its statistics (info_<serial>.yml format)
+     * @param calFilename   Calibration output path
+     * @param infoFilename  Statistics output path
+     * @param serial        Camera serial
+     * @param board         Chessboard geometry
+     * @param calib         Calibration
+    */
+    void writeMonoCalibration(const std::string &calFilename, const std::string &infoFilename, const std::string &serial,
+                            const Board &board, const MonoCalibration &calib);
+
+    /** Read the camera matrix, distortion and resolution of a single camera calibration. Return false if missing
+     * @param calFilename   Calibration path (YAML or calibration bundle)
+     * @param calib         Output calibration
+     * @param camera        Camera to read from a stereo calibration bundle (0: left, 1: right). A single camera bundle holds one
+    */
+    bool readMonoCalibration(const std::string &calFilename, MonoCalibration &calib, const int camera = 0);
+
+    /** Read the serial of the camera of a single camera calibration. Return false if missing
+     * @param calFilename   Calibration path (YAML or calibration bundle)
+     * @param serial        Output serial
+     * @param camera        Camera to read from a stereo calibration bundle (0: left, 1: right). A single camera bundle holds one
+    */
+    bool readSerial(const std::string &calFilename, std::string &serial, const int camera = 0);
+
+    /** Read the chessboard geometry of a single camera calibration. Return false if missing
+     * @param calFilename   Calibration path (YAML or calibration bundle)
+     * @param board         Output chessboard geometry
+    */
+    bool readBoard(const std::string &calFilename, Board &board);
+
+    /** Write a stereo calibration (calib_stereo_<serialL>_to_<serialR>.yml format) and its statistics
+     * @param calFilename   Calibration output path
+     * @param infoFilename  Statistics output path
+     * @param serialL       Left camera serial
+     * @param serialR       Right camera serial
+     * @param calib         Stereo calibration
+    */
+    void writeStereoCalibration(const std::string &calFilename, const std::string &infoFilename, const std::string &serialL,
+                                const std::string &serialR, const StereoCalibration &calib);
+
+    /** Read the pose and resolution of a stereo calibration. Return false if missing
+     * @param calFilename   Calibration path (YAML or calibration bundle)
+     * @param calib         Output stereo calibration
+    */
+    bool readStereoCalibration(const std::string &calFilename, StereoCalibration &calib);
+
+    /** Write a stereo rectification (rectify_<serialL>_to_<serialR>.yml format)
+     * @param filename      Output path
+     * @param rect          Rectification
+    */
+    void writeRectification(const std::string &filename, const Rectification &rect);
+
+    /** Read a stereo rectification. Return false if missing
+     * @param filename      Rectification path (YAML or calibration bundle)
+     * @param rect          Output rectification
+    */
+    bool readRectification(const std::string &filename, Rectification &rect);
+
+} // namespace stereocalib
@@ -1,4 +1,12 @@
 #include "utils.h"
+#include "cornerCache.h"
+#include "debugWriter.h"
+#include "cornerLog.h"
+#include "cornerTracker.h"
+#include "videoSource.h"
+#include "viewSelection.h"
+#include "stereoCalib.h"
+#include "calibBundle.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -6,6 +14,9 @@
 #include <opencv2/calib3d/calib3d.hpp>
 
 #include <iostream>
+#include <sstream>
+#include <map>
+#include <climits>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
@@ -16,121 +27,248 @@ const std::string logFolder = "./logStereoCamCalib";           // Script output
 
 int main(int argc, char** argv){
     if (argc < 6){
-        std::cerr << "Usage: ./stereoCamCalib calibL calibR imgFolderL imgFolderR extension\n";
+        std::cerr << "Usage: ./stereoCamCalib calibL calibR imgFolderL|videoFileL imgFolderR|videoFileR extension [--pyramid off|auto|N] [--detector classic|sb] [--fast-reject] [--track] [--corner-cache dir|off] "
+            "[--debug-images off|found|failed|outliers|all] [--debug-scale S] [--debug-memory MB] [--debug-threads N] [--corner-log yaml|binary|both] "
+            "[--video-step N] [--min-sharpness S] [--min-motion M] [--min-pose-change P] [--max-views N] [--compare-selection] "
+            "[--init-calib calib_stereo.yml] [--history-left cornersL.bin,...] [--history-right cornersR.bin,...] [--bundle out.scb] [--trace trace.json]\n";
         exit(1);
     }
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
     const std::string calibL = argv[1];
     const std::string calibR = argv[2];
     const std::string imgFolderL = argv[3];
     const std::string imgFolderR = argv[4];
     const std::string extension = argv[5];
+    const utils::DetectorSettings detectorSettings = utils::getDetectorSettings(argc, argv);
+    const bool tracking = utils::hasOptFlag(argc, argv, "--track");                      // Track the corners from frame to frame
+    const utils::CornerCache cornerCache = utils::getCornerCache(argc, argv);
+    utils::DebugWriter debugWriter(utils::getDebugSettings(argc, argv, "found"));
     std::cout << "Input arguments:\n\tCalibL: " << calibL
         << "\n\tCalibR: " << calibR << "\n\tImgFolderL size: " << imgFolderL 
         << "\n\tImgFolderR: " << imgFolderR << "\n\tExtension: " << extension << "\n";
     
-    // Prepare file managers (cv::Filestorage)
-    cv::FileStorage fs;
-    cv::FileStorage fsL(calibL, cv::FileStorage::READ);                             // Read left camera configuration file
-    cv::FileStorage fsR(calibR, cv::FileStorage::READ);                             // Read right camera configuration file
-    
-    // Get chessboard info from the single camera calibrations. Check consistency.
-    int boardWidth, boardHeight;
-    float cellSize;
-    if (!utils::loadAndCheckChessboardData(fsL, fsR, boardWidth, boardHeight, cellSize)){
-        std::cerr << "Chessboard data inconsistencies between left and right calibrations. Check your data\n";
+    // Read the single camera calibrations (YAML or calibration bundles) and check that they use the same chessboard
+    stereocalib::MonoCalibration calibCamL, calibCamR;
+    stereocalib::Board boardL, boardR;
+    std::string serialL, serialR;
+    if (!stereocalib::readMonoCalibration(calibL, calibCamL, 0) || !stereocalib::readMonoCalibration(calibR, calibCamR, 1) ||
+        !stereocalib::readBoard(calibL, boardL) || !stereocalib::readBoard(calibR, boardR) ||
+        !stereocalib::readSerial(calibL, serialL, 0) || !stereocalib::readSerial(calibR, serialR, 1)){
+        std::cerr << "Cannot read the single camera calibrations " << calibL << " and " << calibR << "\n";
         return 1;
     }
-    
-    // Load left and right image filepaths
-    const std::vector<std::string> imgPathsL = utils::getImgPaths(imgFolderL, extension);
-    const std::vector<std::string> imgPathsR = utils::getImgPaths(imgFolderR, extension);
-    if (imgPathsL.size() != imgPathsR.size()){
-        std::cerr << "Error, left and right images must be of the same number\n";
+    if (boardL.width != boardR.width || boardL.height != boardR.height || boardL.cellSize != boardR.cellSize){
+        std::cerr << "Chessboard data inconsistencies between left and right calibrations. Check your data\n";
         return 1;
     }
+    const stereocalib::Board board = boardL;
+    const int boardWidth = board.width, boardHeight = board.height;
+    
+    // Regular files as input are synchronized left and right videos, decoded while streaming
+    const bool videoInput = utils::isVideoInput(imgFolderL) && utils::isVideoInput(imgFolderR);
+    std::vector<std::string> imgPathsL, imgPathsR;
+    cv::Size imgResL = calibCamL.imgRes, imgResR = calibCamR.imgRes;
+    if (!videoInput){
+        // Load left and right image filepaths
+        imgPathsL = utils::getImgPaths(imgFolderL, extension);
+        imgPathsR = utils::getImgPaths(imgFolderR, extension);
+        if (imgPathsL.size() != imgPathsR.size()){
+            std::cerr << "Error, left and right images must be of the same number\n";
+            return 1;
+        }
 
-    /* Check that:
-        1)The images have the same resolution of the images used in the single cam calibrations
-        2)Left and right images resolution are equal
-    */ 
-    cv::Size imgResL, imgResR;
-    fsL["Img_res"] >> imgResL;
-    fsR["Img_res"] >> imgResR;
-    if(!utils::checkImgsResolution(imgPathsL, imgResL)){
-        std::cerr << "Found inconsistencies in the resolution of the left images. Check your data\n";
-        exit(1);
-    }
-    if(!utils::checkImgsResolution(imgPathsR, imgResR)){
-        std::cerr << "Found inconsistencies in the resolution of the right images. Check your data\n";
-        exit(1);
-    }
-    if (imgResL != imgResR){
-        std::cerr << "Left and right images must have the same resolution. \n";
-        exit(1);
+        /* Check that:
+            1)The images have the same resolution of the images used in the single cam calibrations
+            2)Left and right images resolution are equal
+        */ 
+        if(!utils::checkImgsResolution(imgPathsL, imgResL)){
+            std::cerr << "Found inconsistencies in the resolution of the left images. Check your data\n";
+            exit(1);
+        }
+        if(!utils::checkImgsResolution(imgPathsR, imgResR)){
+            std::cerr << "Found inconsistencies in the resolution of the right images. Check your data\n";
+            exit(1);
+        }
+        if (imgResL != imgResR){
+            std::cerr << "Left and right images must have the same resolution. \n";
+            exit(1);
+        }
     }
 
-    // Read serial of the cameras
-    std::string serialL, serialR;
-    fsL["Serial"] >> serialL;
-    fsR["Serial"] >> serialR;
-
     // Create log folders
     fs::create_directory(logFolder);
     fs::create_directory(logFolder + "/" + serialL);
     fs::create_directory(logFolder + "/" + serialR);
 
     /* 
-    FIND CHESSBOARD CORNERS AND CREATE ASSOCIATED 3D POINTS
+    FIND CHESSBOARD CORNERS
     */
     std::vector<std::vector<cv::Point2f>> chessCorners2DL, chessCorners2DR;     // Detected chess corners foreach image (left and right)
-    std::vector<std::vector<cv::Point3f>> chessCorners3D;                       // Associated 3D points foreach corner foreach image (same left and right)
+    std::vector<uint> viewImgIdx;                                               // Index of the image pair of each view
     std::cout << "Looking for chess corners\n";
-    for (uint i=0; i<imgPathsL.size(); i++){
-        // Convert images to grayscale
-        cv::Mat imgL, imgR, imgGrayL, imgGrayR;
-        imgL = cv::imread(imgPathsL[i], cv::IMREAD_COLOR);
-        imgR = cv::imread(imgPathsR[i], cv::IMREAD_COLOR);
-        cv::cvtColor(imgL, imgGrayL, cv::COLOR_BGR2GRAY);
-        cv::cvtColor(imgR, imgGrayR, cv::COLOR_BGR2GRAY);
-
-        // Find chess corners
-        bool foundL, foundR;
-        std::vector<cv::Point2f> chessCornersL, chessCornersR;
-        foundL = utils::findChessCorners(imgGrayL, boardWidth, boardHeight, chessCornersL);
-        foundR = utils::findChessCorners(imgGrayR, boardWidth, boardHeight, chessCornersR);
-        std::cout << "\t" << imgPathsL[i] << " - " << imgPathsR[i] << ": ";
-        if (!foundL || !foundR){
+    const std::string detectorKey = utils::getDetectorKey(cv::Size(boardWidth, boardHeight), detectorSettings);
+    const utils::CornerLogFormat cornerLogFormat = utils::getCornerLogFormat(argc, argv);
+    utils::CornerLogWriter cornerLogL(logFolder + "/" + serialL + "/chesscorners.yml", "Image_", cornerLogFormat);
+    utils::CornerLogWriter cornerLogR(logFolder + "/" + serialR + "/chesscorners.yml", "Image_", cornerLogFormat);
+    //
+    // Candidate view pairs: names, index (image index or video frame) and detection results
+    std::vector<std::string> imgNamesL, imgNamesR;
+    std::vector<uint> imgIdxs;
+    std::vector<std::vector<cv::Point2f>> detectedCornersL, detectedCornersR;
+    std::vector<char> detectedL, detectedR;
+    const cv::Size boardSize(boardWidth, boardHeight);
+    utils::CornerTracker trackerL(boardSize, detectorSettings, tracking), trackerR(boardSize, detectorSettings, tracking);  // One per camera
+    if (!videoInput){
+        imgNamesL = imgPathsL;
+        imgNamesR = imgPathsR;
+        for (uint i=0; i<imgPathsL.size(); i++){
+            TRACE_SCOPE("imagePair");
+
+            // Decode the images straight to grayscale
+            utils::ImgSource imgL(imgPathsL[i]), imgR(imgPathsR[i]);
+
+            // Find chess corners, unless they were already detected in a previous run
+            bool foundL, foundR;
+            std::vector<cv::Point2f> chessCornersL, chessCornersR;
+            foundL = utils::findSequenceCorners(cornerCache, detectorKey, imgL, trackerL, chessCornersL);
+            foundR = utils::findSequenceCorners(cornerCache, detectorKey, imgR, trackerR, chessCornersR);
+
+            // Save chessboard corners as image (decoded and drawn in the background)
+            if (debugWriter.wants(foundL && foundR)){
+                debugWriter.write(logFolder + "/" + serialL + "/" + std::to_string(i) + ".jpeg", 
+                                        imgPathsL[i], boardSize, chessCornersL, foundL);
+                debugWriter.write(logFolder + "/" + serialR + "/" + std::to_string(i) + ".jpeg", 
+                                        imgPathsR[i], boardSize, chessCornersR, foundR);
+            }
+
+            imgIdxs.emplace_back(i);
+            detectedCornersL.emplace_back(chessCornersL);
+            detectedCornersR.emplace_back(chessCornersR);
+            detectedL.emplace_back(foundL);
+            detectedR.emplace_back(foundR);
+        }
+    } else {
+        // Stream both videos: blurred frames and frames too similar to the last detected ones are skipped
+        // before the detection. Views with a pose already seen (in the left camera) are dropped.
+        // With tracking, the skipped frames are still tracked (only carrying the corners forward), so that
+        // the selected ones are tracked from the previous frame, with a small motion
+        const utils::VideoSettings videoSettings = utils::getVideoSettings(argc, argv);
+        utils::VideoFrameSource videoL(imgFolderL, videoSettings.step), videoR(imgFolderR, videoSettings.step);
+        utils::FrameSelector selector(videoSettings);
+        if (!videoL.isOpened() || !videoR.isOpened()){
+            std::cerr << "Cannot open the videos " << imgFolderL << " and " << imgFolderR << "\n";
+            return 1;
+        }
+        imgResL = videoL.getResolution();
+        imgResR = videoR.getResolution();
+        if (imgResL != imgResR){
+            std::cerr << "Left and right videos must have the same resolution. \n";
+            exit(1);
+        }
+        int readFrames = 0, detectedFrames = 0, redundantFrames = 0;
+        cv::Mat frameL, frameR, frameGrayL, frameGrayR;
+        int frameIdx, frameIdxR;
+        while (videoL.read(frameL, frameIdx) && videoR.read(frameR, frameIdxR)){
+            readFrames++;
+            const bool accepted = selector.accept({frameL, frameR});
+            if (!accepted && !tracking)
+                continue;
+            TRACE_SCOPE("imagePair");
+
+            std::vector<cv::Point2f> chessCornersL, chessCornersR;
+            cv::cvtColor(frameL, frameGrayL, cv::COLOR_BGR2GRAY);
+            cv::cvtColor(frameR, frameGrayR, cv::COLOR_BGR2GRAY);
+            const bool foundL = trackerL.find(frameGrayL, chessCornersL, accepted);
+            const bool foundR = trackerR.find(frameGrayR, chessCornersR, accepted);
+            if (!accepted)
+                continue;
+            detectedFrames++;
+            if (foundL && foundR && !selector.isNewPose(chessCornersL, imgResL)){
+                redundantFrames++;
+                continue;
+            }
+
+            // The frame buffers are reused by the next read: the writer gets a copy
+            if (debugWriter.wants(foundL && foundR)){
+                debugWriter.write(logFolder + "/" + serialL + "/" + std::to_string(frameIdx) + ".jpeg", 
+                                        frameL.clone(), boardSize, chessCornersL, foundL);
+                debugWriter.write(logFolder + "/" + serialR + "/" + std::to_string(frameIdx) + ".jpeg", 
+                                        frameR.clone(), boardSize, chessCornersR, foundR);
+            }
+
+            imgNamesL.emplace_back(imgFolderL + "#" + std::to_string(frameIdx));
+            imgNamesR.emplace_back(imgFolderR + "#" + std::to_string(frameIdx));
+            imgIdxs.emplace_back(frameIdx);
+            detectedCornersL.emplace_back(chessCornersL);
+            detectedCornersR.emplace_back(chessCornersR);
+            detectedL.emplace_back(foundL);
+            detectedR.emplace_back(foundR);
+        }
+        std::cout << "\tRead " << readFrames << " frame pairs, " << detectedFrames << " sent to detection, " 
+            << redundantFrames << " dropped as redundant\n";
+    }
+    //
+    for (uint k=0; k<imgNamesL.size(); k++){
+        const uint i = imgIdxs[k];
+        const std::vector<cv::Point2f> &chessCornersL = detectedCornersL[k], &chessCornersR = detectedCornersR[k];
+        std::cout << "\t" << imgNamesL[k] << " - " << imgNamesR[k] << ": ";
+        if (!detectedL[k] || !detectedR[k]){
             std::cout << " Not found\n";
             continue;
         } else {
             std::cout << " Found\n";
             chessCorners2DL.emplace_back(chessCornersL);
             chessCorners2DR.emplace_back(chessCornersR);
+            viewImgIdx.emplace_back(i);
             
             // Save chessboard corners coordinates
-            fs.open(logFolder + "/" + serialL + "/chesscorners.yml", cv::FileStorage::APPEND);
-            fs << "Image_" + std::to_string(i) << chessCornersL;
-            fs.release();
-            fs.open(logFolder + "/" + serialR + "/chesscorners.yml", cv::FileStorage::APPEND);
-            fs << "Image_" + std::to_string(i) << chessCornersR;
-            fs.release();
-
-            // Save chessboard corners as image
-            utils::saveChessCornersAsImg(logFolder + "/" + serialL + "/" + std::to_string(i) + ".jpeg", 
-                                    imgL, cv::Size(boardWidth, boardHeight), chessCornersL);
-            utils::saveChessCornersAsImg(logFolder + "/" + serialR + "/" + std::to_string(i) + ".jpeg", 
-                                    imgR, cv::Size(boardWidth, boardHeight), chessCornersR);
+            cornerLogL.write(i, chessCornersL);
+            cornerLogR.write(i, chessCornersR);
         }
-        
-        // Set up the 3D points starting from the top-left corner of the chessboard. 
-        // Use cellSize to scale them. Assume they are on a plane (z=0)
-        std::vector<cv::Point3f> chessObjPoints;
-        for (int i = 0; i < boardHeight; i++){
-            for (int j = 0; j < boardWidth; j++){
-                chessObjPoints.emplace_back(cv::Point3f((float)j * cellSize, (float)i * cellSize, 0));
+    }
+    utils::DetectorStats::get().print();
+
+    // Recalibration: add the view pairs of previous runs (binary corner logs). The logs are given as pairs
+    // (i-th left log with i-th right log) and the views are paired by image index within each pair of logs only,
+    // as the indices of different runs overlap. These views have no image (index UINT_MAX).
+    // Without --init-calib all the views are solved again together (bound the cost with --max-views); with it, only the
+    // previous pose is refined on them, at the cost of one board pose per view
+    const std::string historyL = utils::getOptArg(argc, argv, "--history-left", "");
+    const std::string historyR = utils::getOptArg(argc, argv, "--history-right", "");
+    if (!historyL.empty() || !historyR.empty()){
+        std::vector<std::string> logsL, logsR;
+        std::string path;
+        for (std::stringstream ss(historyL); std::getline(ss, path, ',');)
+            logsL.emplace_back(path);
+        for (std::stringstream ss(historyR); std::getline(ss, path, ',');)
+            logsR.emplace_back(path);
+        if (logsL.size() != logsR.size()){
+            std::cerr << "--history-left and --history-right must list the same number of corner logs\n";
+            return 1;
+        }
+        size_t numHistory = 0;
+        for (size_t l = 0; l < logsL.size(); l++){
+            std::vector<int> historyIdxsL, historyIdxsR;
+            std::vector<std::vector<cv::Point2f>> historyCornersL, historyCornersR;
+            if (!utils::readCornerHistory(logsL[l], boardWidth * boardHeight, historyIdxsL, historyCornersL) ||
+                !utils::readCornerHistory(logsR[l], boardWidth * boardHeight, historyIdxsR, historyCornersR)){
+                std::cerr << "Cannot read the corner logs " << logsL[l] << " and " << logsR[l] << "\n";
+                return 1;
+            }
+            std::map<int, size_t> rightViews;
+            for (size_t k = 0; k < historyIdxsR.size(); k++)
+                rightViews[historyIdxsR[k]] = k;
+            for (size_t k = 0; k < historyIdxsL.size(); k++){
+                const auto it = rightViews.find(historyIdxsL[k]);
+                if (it == rightViews.end())
+                    continue;
+                chessCorners2DL.emplace_back(historyCornersL[k]);
+                chessCorners2DR.emplace_back(historyCornersR[it->second]);
+                viewImgIdx.emplace_back(UINT_MAX);
+                numHistory++;
             }
         }
-        chessCorners3D.emplace_back(chessObjPoints);
+        std::cout << "Added " << numHistory << " view pairs from previous runs\n";
     }
 
 
@@ -138,50 +276,79 @@ int main(int argc, char** argv){
     START STEREO CALIBRATION
     */
     std::cout << "Starting stereo calibration\n";
-    cv::Mat KL, KR, DL, DR;                                             // Load single camera calibrations
-    fsL["K"] >> KL;
-    fsL["D"] >> DL;
-    fsR["K"] >> KR;
-    fsR["D"] >> DR;
-    
-    //--
-    cv::Mat R, F, E;                                                    // Rotation, fundamental and essential matrix (of the right image wrt the left image)
-    cv::Vec3d T;                                                        // Translation vector (of the right image wrt the left image)
-    cv::Mat perViewReprErr;                                             // Per-view reprojection error of the corners
-    int flag = 0;
-    flag |= cv::CALIB_FIX_INTRINSIC;                                    // Fix the intrinsics (KL, KR, DL, DR) estimated in the single camera calibrations
-    //flag |= cv::CALIB_USE_INTRINSIC_GUESS;
-    cv::TermCriteria termCrit(cv::TermCriteria::Type::EPS |             // Termination criteria
-                    cv::TermCriteria::Type::MAX_ITER, 
-                    30, 0.001);
-    //--
-    const double reprError = cv::stereoCalibrate(chessCorners3D, chessCorners2DL, chessCorners2DR, KL, DL, KR, DR, 
-        imgResL, R, T, E, F, perViewReprErr, flag, termCrit);
-    std::cout << "\tOverall reprojection error: " << reprError << "\n";
-    
-    // Write calibration results
-    std::string calFilename = logFolder + "/calib_stereo_" + serialL + "_to_" + serialR + ".yml";
-    //--
-    fs.open(calFilename, cv::FileStorage::WRITE);         
-    fs << "Serial_left" << serialL;
-    fs << "Serial_right" << serialR;
-    fs << "Img_res" << imgResL;
-    fs << "R" << R;
-    fs << "T" << T;
-    fs << "E" << E;
-    fs << "F" << F;
-    fs.release();
-    fsL.release();
-    fsR.release();
-    std::cout << "\tCalibration written to " << calFilename << "\n";
+    calibCamL.imgRes = imgResL;
+    calibCamR.imgRes = imgResR;
 
-    // Write calibration info
+    // Recalibration: refine the pose of a previous stereo calibration instead of solving it from scratch
+    const std::string initCalib = utils::getOptArg(argc, argv, "--init-calib", "");
+    stereocalib::StereoCalibration initial;
+    if (!initCalib.empty()){
+        if (!stereocalib::readStereoCalibration(initCalib, initial) || initial.imgRes != imgResL){
+            std::cerr << "Invalid initial calibration " << initCalib << " for images of resolution " << imgResL << "\n";
+            return 1;
+        }
+        std::cout << "\tStarting from the calibration " << initCalib << "\n";
+    }
+
+    // Solve with the maxViews view pairs that best cover both images and the board poses (0: all the views)
+    const size_t maxViews = std::stoul(utils::getOptArg(argc, argv, "--max-views", "0"));
+    const stereocalib::StereoCalibration calib = stereocalib::calibrateStereo(chessCorners2DL, chessCorners2DR, calibCamL, calibCamR, 
+                                                                            board, maxViews, initCalib.empty() ? nullptr : &initial);
+    std::cout << "\tOverall reprojection error: " << calib.reprError << "\n";
+    std::cout << "\tSolved with " << calib.views.size() << " views in " << calib.solveTime << " s\n";
+    if (calib.views.size() < chessCorners2DL.size()){
+        std::cout << "\tSelected " << calib.views.size() << " of " << chessCorners2DL.size() << " views\n";
+        std::cout << "\tReprojection error on all the " << chessCorners2DL.size() << " views: " 
+            << utils::computeStereoReprError(stereocalib::getBoardPoints(board, chessCorners2DL.size()), chessCorners2DL, chessCorners2DR, 
+                                            calibCamL.K, calibCamL.D, calibCamR.K, calibCamR.D, calib.R, calib.T) << "\n";
+
+        // Solve again without selection, for comparison only
+        if (utils::hasOptFlag(argc, argv, "--compare-selection")){
+            const stereocalib::StereoCalibration calibAll = stereocalib::calibrateStereo(chessCorners2DL, chessCorners2DR, calibCamL, calibCamR, 
+                                                                                        board, 0, initCalib.empty() ? nullptr : &initial);
+            std::cout << "\tWithout selection: reprojection error " << calibAll.reprError << ", solved with " 
+                << chessCorners2DL.size() << " views in " << calibAll.solveTime << " s\n";
+        }
+    }
+
+    // Save the views that do not fit the calibration (error of the worst camera of each pair, images only)
+    if (debugWriter.wantsOutliers() && !videoInput){
+        std::vector<double> perViewMaxErr;
+        for (int k = 0; k < calib.perViewReprErr.rows; k++)
+            perViewMaxErr.emplace_back(std::max(calib.perViewReprErr.at<double>(k, 0), calib.perViewReprErr.at<double>(k, 1)));
+        for (const size_t k : utils::getOutlierViews(perViewMaxErr)){
+            const size_t v = calib.views[k];
+            const uint i = viewImgIdx[v];
+            if (i == UINT_MAX)
+                continue;
+            debugWriter.write(logFolder + "/" + serialL + "/" + std::to_string(i) + ".jpeg", 
+                            imgPathsL[i], cv::Size(boardWidth, boardHeight), chessCorners2DL[v], true);
+            debugWriter.write(logFolder + "/" + serialR + "/" + std::to_string(i) + ".jpeg", 
+                            imgPathsR[i], cv::Size(boardWidth, boardHeight), chessCorners2DR[v], true);
+        }
+    }
+    
+    // Write calibration results and statistics
+    const std::string calFilename = logFolder + "/calib_stereo_" + serialL + "_to_" + serialR + ".yml";
     const std::string calInfoFilename = logFolder + "/info_stereo_" + serialL + "_to_" + serialR + ".yml";
-    fs.open(calInfoFilename, cv::FileStorage::WRITE);
-    fs << "perViewReprErr" << perViewReprErr;
-    fs.release();
+    stereocalib::writeStereoCalibration(calFilename, calInfoFilename, serialL, serialR, calib);
+    std::cout << "\tCalibration written to " << calFilename << "\n";
     std::cout << "\tCalibration statistics written to " << calInfoFilename << "\n";
 
+    // The cameras and their pose in one binary file (no rectification: stereoRectify reads it as calibStereo and completes it)
+    const std::string bundlePath = utils::getOptArg(argc, argv, "--bundle", "");
+    if (!bundlePath.empty()){
+        stereocalib::CalibrationSet set;
+        set.board = board;
+        set.serials = {serialL, serialR};
+        set.cameras = {calibCamL, calibCamR};
+        set.stereo = calib;
+        if (!stereocalib::writeCalibBundle(bundlePath, set)){
+            std::cerr << "Cannot write the calibration bundle " << bundlePath << "\n";
+            return 1;
+        }
+        std::cout << "\tCalibration bundle written to " << bundlePath << "\n";
+    }
 
     return 0;
 }
\ No newline at end of file
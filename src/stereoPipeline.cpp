@@ -0,0 +1,208 @@
+#include "utils.h"
+#include "cornerCache.h"
+#include "debugWriter.h"
+#include "cornerLog.h"
+#include "stereoCalib.h"
+#include "calibBundle.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <iostream>
+#include <algorithm>
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+
+// Global variables
+const std::string logFolder = "./logStereoPipeline";           // Script output will be stored in this directory
+
+
+/*
+Full stereo calibration in a single process: singleCamCalib (left and right), stereoCamCalib and stereoRectify.
+The corners of each image are detected once and shared by the single camera and the stereo calibrations.
+Output files have the same names and content as the ones of the separate tools.
+*/
+int main(int argc, char** argv){
+    if (argc < 9){
+        std::cerr << "Usage: ./stereoPipeline boardWidth boardHeight cellSize imgFolderL imgFolderR extension serialL serialR "
+            "[--threads N] [--pyramid off|auto|N] [--detector classic|sb] [--fast-reject] [--corner-cache dir|off] [--debug-images off|found|failed|all] "
+            "[--debug-scale S] [--debug-memory MB] [--debug-threads N] [--corner-log yaml|binary|both] [--max-views N] [--bundle out.scb] [--bundle-maps] [--trace trace.json]\n";
+        return 1;
+    }
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
+    const int boardWidth = std::stoi(argv[1]);
+    const int boardHeight = std::stoi(argv[2]);
+    const float cellSize = std::stof(argv[3]);
+    const std::string imgFolders[2] = {argv[4], argv[5]};
+    const std::string extension = argv[6];
+    const std::string serials[2] = {argv[7], argv[8]};
+    const int numThreads = std::stoi(utils::getOptArg(argc, argv, "--threads", "0"));   // 0: one thread per core
+    const size_t maxViews = std::stoul(utils::getOptArg(argc, argv, "--max-views", "0"));  // 0: use all the views
+    const std::string bundlePath = utils::getOptArg(argc, argv, "--bundle", "");           // Empty: do not write the calibration bundle
+    const utils::DetectorSettings detectorSettings = utils::getDetectorSettings(argc, argv);
+    const utils::CornerCache cornerCache = utils::getCornerCache(argc, argv);
+    utils::DebugWriter debugWriter(utils::getDebugSettings(argc, argv, "found"));
+    std::cout << "Input arguments:\n\tboardWidth: " << boardWidth
+        << "\n\tboardHeight: " << boardHeight << "\n\tcellSize: " << cellSize
+        << "\n\tImgFolderL: " << imgFolders[0] << "\n\tImgFolderR: " << imgFolders[1]
+        << "\n\tSerials: " << serials[0] << " - " << serials[1] << "\n\tthreads: " << numThreads << "\n";
+
+    // Load left and right image filepaths
+    std::vector<std::string> imgPaths[2];
+    cv::Size imgRes[2];
+    for (int c = 0; c < 2; c++){
+        imgPaths[c] = utils::getImgPaths(imgFolders[c], extension);
+        if (imgPaths[c].empty()){
+            std::cerr << "No images found in " << imgFolders[c] << ". Exiting\n";
+            return 1;
+        }
+        if (!utils::checkImgsResolution(imgPaths[c], imgRes[c])){
+            std::cerr << "Found inconsistencies in the resolution of the images in " << imgFolders[c] << ". Check your data\n";
+            return 1;
+        }
+    }
+    if (imgPaths[0].size() != imgPaths[1].size()){
+        std::cerr << "Error, left and right images must be of the same number\n";
+        return 1;
+    }
+    if (imgRes[0] != imgRes[1]){
+        std::cerr << "Left and right images must have the same resolution. \n";
+        return 1;
+    }
+    const size_t numImgs = imgPaths[0].size();
+    const cv::Size imgResolution = imgRes[0];
+    std::cout << "\tFound " << numImgs << " image pairs\n";
+
+    // Create log folders
+    fs::create_directory(logFolder);
+    for (int c = 0; c < 2; c++)
+        fs::create_directory(logFolder + "/" + serials[c]);
+
+
+    /*
+    FIND CHESSBOARD CORNERS, ONCE FOR EACH IMAGE OF BOTH CAMERAS
+    */
+    std::cout << "Looking for chess corners\n";
+    const cv::Size boardSize(boardWidth, boardHeight);
+    const std::string detectorKey = utils::getDetectorKey(boardSize, detectorSettings);
+    std::vector<std::vector<cv::Point2f>> detectedCorners[2];
+    std::vector<char> detected[2];
+    for (int c = 0; c < 2; c++){
+        detectedCorners[c].resize(numImgs);
+        detected[c].resize(numImgs, false);
+    }
+    utils::parallelFor(2 * numImgs, numThreads, [&](size_t j){
+        const int c = j / numImgs;
+        const size_t i = j % numImgs;
+        TRACE_SCOPE("image");
+        utils::ImgSource img(imgPaths[c][i]);
+
+        // Look for chess corners, unless they were already detected in a previous run
+        detected[c][i] = cornerCache.findChessCorners(img.encoded(), detectorKey, boardWidth * boardHeight, [&](std::vector<cv::Point2f> &chessCorners){
+            return utils::findChessCorners(img.gray(), boardWidth, boardHeight, chessCorners, detectorSettings);
+        }, detectedCorners[c][i]);
+
+        // Save chessboard corners as image (decoded and drawn in the background)
+        if (debugWriter.wants(detected[c][i]))
+            debugWriter.write(logFolder + "/" + serials[c] + "/" + std::to_string(i) + ".jpeg",
+                                imgPaths[c][i], boardSize, detectedCorners[c][i], detected[c][i]);
+    });
+
+    // Save chessboard corners coordinates, and print the detection results
+    const utils::CornerLogFormat cornerLogFormat = utils::getCornerLogFormat(argc, argv);
+    for (int c = 0; c < 2; c++){
+        utils::CornerLogWriter cornerLog(logFolder + "/" + serials[c] + "/chessCorners.yml", "image_", cornerLogFormat);
+        for (size_t i = 0; i < numImgs; i++){
+            if (detected[c][i])
+                cornerLog.write(i, detectedCorners[c][i]);
+        }
+    }
+    for (size_t i = 0; i < numImgs; i++){
+        std::cout << "\t" << imgPaths[0][i] << " - " << imgPaths[1][i] << ": "
+            << (detected[0][i] ? "Found" : "Not found") << " - " << (detected[1][i] ? "Found" : "Not found") << "\n";
+    }
+    utils::DetectorStats::get().print();
+    for (int c = 0; c < 2; c++){
+        if (std::count(detected[c].begin(), detected[c].end(), true) == 0){
+            std::cerr << "No chessboard found in the images of " << serials[c] << ". Exiting\n";
+            return 1;
+        }
+    }
+
+
+    /*
+    SINGLE CAMERA CALIBRATIONS (LEFT AND RIGHT IN PARALLEL)
+    */
+    std::cout << "Calibrating the single cameras\n";
+    const stereocalib::Board board{boardWidth, boardHeight, cellSize};
+    stereocalib::MonoCalibration calib[2];
+    utils::parallelFor(2, 2, [&](size_t c){
+        // Every image where the board was found in this camera is a view
+        std::vector<std::vector<cv::Point2f>> chessCorners2D;
+        for (size_t i = 0; i < numImgs; i++){
+            if (detected[c][i])
+                chessCorners2D.emplace_back(detectedCorners[c][i]);
+        }
+        calib[c] = stereocalib::calibrateMono(chessCorners2D, imgResolution, board, maxViews);
+    });
+    for (int c = 0; c < 2; c++){
+        const std::string calFilename = logFolder + "/calib_" + serials[c] + ".yml";
+        stereocalib::writeMonoCalibration(calFilename, logFolder + "/info_" + serials[c] + ".yml", serials[c], board, calib[c]);
+        std::cout << "\t" << serials[c] << ": reprojection error " << calib[c].reprError << " with " << calib[c].views.size() << " views\n";
+        std::cout << "\tCalibration written to " << calFilename << "\n";
+    }
+
+
+    /*
+    STEREO CALIBRATION
+    */
+    std::cout << "Starting stereo calibration\n";
+    std::vector<std::vector<cv::Point2f>> chessCorners2DL, chessCorners2DR;
+    for (size_t i = 0; i < numImgs; i++){
+        if (detected[0][i] && detected[1][i]){
+            chessCorners2DL.emplace_back(detectedCorners[0][i]);
+            chessCorners2DR.emplace_back(detectedCorners[1][i]);
+        }
+    }
+    if (chessCorners2DL.empty()){
+        std::cerr << "No image pair with the chessboard found in both the images. Exiting\n";
+        return 1;
+    }
+    const stereocalib::StereoCalibration calibStereo = stereocalib::calibrateStereo(chessCorners2DL, chessCorners2DR, calib[0], calib[1], 
+                                                                                board, maxViews);
+    std::cout << "\tOverall reprojection error: " << calibStereo.reprError << " with " << calibStereo.views.size() << " views\n";
+    const std::string stereoName = serials[0] + "_to_" + serials[1];
+    stereocalib::writeStereoCalibration(logFolder + "/calib_stereo_" + stereoName + ".yml", logFolder + "/info_stereo_" + stereoName + ".yml", 
+                                        serials[0], serials[1], calibStereo);
+    std::cout << "\tCalibration written to " << logFolder + "/calib_stereo_" + stereoName + ".yml" << "\n";
+
+
+    /*
+    STEREO RECTIFICATION
+    */
+    const stereocalib::Rectification rect = stereocalib::rectify(calib[0], calib[1], calibStereo);
+    stereocalib::writeRectification(logFolder + "/rectify_" + stereoName + ".yml", rect);
+    std::cout << "Stereo rectification written to " << logFolder + "/rectify_" + stereoName + ".yml" << "\n";
+
+    // Everything in one binary file, for the consumers that load the calibration at startup
+    if (!bundlePath.empty()){
+        stereocalib::CalibrationSet set;
+        set.board = board;
+        set.serials = {serials[0], serials[1]};
+        set.cameras = {calib[0], calib[1]};
+        set.stereo = calibStereo;
+        set.rect = rect;
+        if (utils::hasOptFlag(argc, argv, "--bundle-maps"))
+            stereocalib::addRectificationMaps(set);
+        if (!stereocalib::writeCalibBundle(bundlePath, set)){
+            std::cerr << "Cannot write the calibration bundle " << bundlePath << "\n";
+            return 1;
+        }
+        std::cout << "Calibration bundle written to " << bundlePath << "\n";
+    }
+
+    return 0;
+}
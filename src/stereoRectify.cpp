@@ -1,3 +1,7 @@
+#include "stereoCalib.h"
+#include "gridMap.h"
+#include "calibBundle.h"
+
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/core/core.hpp>
 
@@ -11,50 +15,91 @@ const std::string logFolder = "./logStereoRectify";           // Script output w
 
 int main(int argc, char** argv){
     if (argc < 4){
-        std::cerr << "Usage ./stereoRectify calibL calibR calibStereo" << std::endl;
+        std::cerr << "Usage ./stereoRectify calibL calibR calibStereo [--export-grid step] [--grid-interp linear|cubic] [--bundle out.scb] [--bundle-maps] [--trace trace.json]" << std::endl;
         exit(1);
     }
-    cv::Vec3d T;
-    cv::Mat KL,KR,DL,DR,R;
-    cv::FileStorage fsL(argv[1], cv::FileStorage::READ);
-    cv::FileStorage fsR(argv[2], cv::FileStorage::READ);
-    cv::FileStorage fsS(argv[3], cv::FileStorage::READ);
-
-    cv::Size imgRes;
-    fsS["Img_res"] >> imgRes;
-    std::cout << imgRes << std::endl;
- 
-    // Read calibration of the single cameras
-    fsL["K"] >> KL;
-    fsL["D"] >> DL;
-    fsR["K"] >> KR;
-    fsR["D"] >> DR;
-
-    // Read R and T between the left and right cameras
-    fsS["R"] >> R;
-    fsS["T"] >> T;
+    utils::TraceSession traceSession(utils::getOptArg(argc, argv, "--trace", ""));     // Stage timings (written at exit)
+    const int gridStep = std::stoi(utils::getOptArg(argc, argv, "--export-grid", "0"));    // 0: do not export the grid maps
+    const std::string bundlePath = utils::getOptArg(argc, argv, "--bundle", "");           // Empty: do not write the calibration bundle
+    stereocalib::GridInterpolation gridInterpolation;
+    if (!stereocalib::parseGridInterpolation(utils::getOptArg(argc, argv, "--grid-interp", "cubic"), gridInterpolation)){
+        std::cerr << "Unknown grid interpolation, use linear or cubic\n";
+        return 1;
+    }
+    // Read calibration of the single cameras and R and T between the left and right cameras
+    stereocalib::MonoCalibration calibL, calibR;
+    stereocalib::StereoCalibration calibStereo;
+    if (!stereocalib::readMonoCalibration(argv[1], calibL, 0) || !stereocalib::readMonoCalibration(argv[2], calibR, 1) ||
+        !stereocalib::readStereoCalibration(argv[3], calibStereo)){
+        std::cerr << "Cannot read the calibration files\n";
+        return 1;
+    }
+    std::cout << calibStereo.imgRes << std::endl;
 
     // Create log folders
     fs::create_directory(logFolder);
 
     // Compute P1, P2, R1, R2 and Q with stereoRectification
-    cv::Mat RL, RR, PL, PR, Q;
-    cv::stereoRectify(KL, DL, KR, DR, imgRes, R, T, RL, RR, PL, PR, Q);
+    const stereocalib::Rectification rect = stereocalib::rectify(calibL, calibR, calibStereo);
     std::cout << "Stereo rectification computed\n";
 
     // Write results
     std::string serialL, serialR;
-    fsS["Serial_left"] >> serialL;
-    fsS["Serial_right"] >> serialR;
+    stereocalib::Board board;
+    if (stereocalib::isCalibBundle(argv[3])){
+        stereocalib::CalibrationSet input;
+        if (!stereocalib::readCalibBundle(argv[3], input, false) || input.serials.size() < 2){
+            std::cerr << "Cannot read the serials of both cameras from the bundle " << argv[3] << "\n";
+            return 1;
+        }
+        serialL = input.serials[0];
+        serialR = input.serials[1];
+        board = input.board;
+    } else {
+        // The board comes from the left camera calibration, YAML or bundle
+        cv::FileStorage fsS(argv[3], cv::FileStorage::READ);
+        fsS["Serial_left"] >> serialL;
+        fsS["Serial_right"] >> serialR;
+        if (!stereocalib::readBoard(argv[1], board)){
+            std::cerr << "Cannot read the chessboard geometry from " << argv[1] << "\n";
+            return 1;
+        }
+    }
     const std::string fsOutName = logFolder + "/rectify_" + serialL + "_to_" + serialR + ".yml";
-    //--
-    cv::FileStorage fsOut(fsOutName, cv::FileStorage::WRITE);
-    fsOut << "R1" << RL;
-    fsOut << "R2" << RR;
-    fsOut << "P1" << PL;
-    fsOut << "P2" << PR;
-    fsOut << "Q" << Q;
+    stereocalib::writeRectification(fsOutName, rect);
     std::cout << "\tResults written to " << fsOutName << "\n";
 
+    // Everything in one binary file, for the consumers that load the calibration at startup
+    if (!bundlePath.empty()){
+        stereocalib::CalibrationSet set;
+        set.board = board;
+        set.serials = {serialL, serialR};
+        set.cameras = {calibL, calibR};
+        set.stereo = calibStereo;
+        set.rect = rect;
+        if (utils::hasOptFlag(argc, argv, "--bundle-maps"))
+            stereocalib::addRectificationMaps(set);
+        if (!stereocalib::writeCalibBundle(bundlePath, set)){
+            std::cerr << "Cannot write the calibration bundle " << bundlePath << "\n";
+            return 1;
+        }
+        std::cout << "\tCalibration bundle written to " << bundlePath << "\n";
+    }
+
+    // Export the compact rectification maps (see checkRectification --map-format grid)
+    if (gridStep > 0){
+        const stereocalib::MonoCalibration *calibs[2] = {&calibL, &calibR};
+        const cv::Mat *Rs[2] = {&rect.R1, &rect.R2}, *Ps[2] = {&rect.P1, &rect.P2};
+        const std::string serials[2] = {serialL, serialR};
+        for (int c = 0; c < 2; c++){
+            const stereocalib::GridMap grid = stereocalib::computeGridMap(calibs[c]->K, calibs[c]->D, *Rs[c], *Ps[c], calibStereo.imgRes,
+                                                                        gridStep, gridInterpolation);
+            const std::string gridName = logFolder + "/gridmap_" + serials[c] + ".yml";
+            stereocalib::writeGridMap(gridName, grid);
+            std::cout << "\tGrid map written to " << gridName << " (" << grid.memory() / 1024.0 << " KB, max deviation "
+                << stereocalib::gridMapMaxError(grid, calibs[c]->K, calibs[c]->D, *Rs[c], *Ps[c]) << " px)\n";
+        }
+    }
+
     return 0;
 }
\ No newline at end of file
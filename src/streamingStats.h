@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <cmath>
+
+namespace utils {
+
+    /** Exact count, mean, standard deviation, min and max of a stream of values (Welford's update).
+     * Accumulators of separate streams are merged exactly (Chan et al.), so each thread can keep its own
+    */
+    class RunningStats {
+    public:
+        void add(const double value){
+            count_++;
+            const double delta = value - mean_;
+            mean_ += delta / count_;
+            m2_ += delta * (value - mean_);
+            min_ = std::min(min_, value);
+            max_ = std::max(max_, value);
+        }
+
+        void merge(const RunningStats &other){
+            if (other.count_ == 0)
+                return;
+            const uint64_t count = count_ + other.count_;
+            const double delta = other.mean_ - mean_;
+            mean_ += delta * other.count_ / count;
+            m2_ += other.m2_ + delta * delta * ((double)count_ * other.count_ / count);
+            count_ = count;
+            min_ = std::min(min_, other.min_);
+            max_ = std::max(max_, other.max_);
+        }
+
+        uint64_t count() const { return count_; }
+        double mean() const { return mean_; }
+        double std() const { return count_ > 1 ? std::sqrt(m2_ / (count_ - 1)) : 0; }     // Sample standard deviation
+        double min() const { return min_; }
+        double max() const { return max_; }
+
+    private:
+        uint64_t count_ = 0;
+        double mean_ = 0, m2_ = 0;
+        double min_ = std::numeric_limits<double>::infinity(), max_ = -std::numeric_limits<double>::infinity();
+    };
+
+    /** Mergeable quantile sketch of non-negative values with relative accuracy (logarithmic buckets, as DDSketch):
+     * a quantile is returned within relativeAccuracy of the true one. Values below minValue share a single bucket.
+     * Memory grows with the log of the value range, not with the number of values
+    */
+    class QuantileSketch {
+    public:
+        /**
+         * @param relativeAccuracy  Relative error of the quantiles (i.e. 0.005: 0.5%)
+         * @param minValue          Smallest value told apart from 0
+        */
+        explicit QuantileSketch(const double relativeAccuracy = 0.005, const double minValue = 1e-4)
+            : gamma_((1 + relativeAccuracy) / (1 - relativeAccuracy)), logGamma_(std::log(gamma_)), minValue_(minValue) {}
+
+        void add(const double value){
+            count_++;
+            if (value < minValue_){
+                zeroCount_++;
+                return;
+            }
+            const int key = (int)std::ceil(std::log(value) / logGamma_);
+            if (buckets_.empty()){
+                offset_ = key;
+                buckets_.assign(1, 0);
+            } else if (key < offset_){
+                buckets_.insert(buckets_.begin(), offset_ - key, 0);
+                offset_ = key;
+            } else if (key >= offset_ + (int)buckets_.size()){
+                buckets_.resize(key - offset_ + 1, 0);
+            }
+            buckets_[key - offset_]++;
+        }
+
+        /** Merge a sketch with the same accuracy */
+        void merge(const QuantileSketch &other){
+            for (size_t b = 0; b < other.buckets_.size(); b++){
+                const int key = other.offset_ + (int)b;
+                if (other.buckets_[b] == 0)
+                    continue;
+                if (buckets_.empty()){
+                    offset_ = key;
+                    buckets_.assign(1, 0);
+                } else if (key < offset_){
+                    buckets_.insert(buckets_.begin(), offset_ - key, 0);
+                    offset_ = key;
+                } else if (key >= offset_ + (int)buckets_.size()){
+                    buckets_.resize(key - offset_ + 1, 0);
+                }
+                buckets_[key - offset_] += other.buckets_[b];
+            }
+            zeroCount_ += other.zeroCount_;
+            count_ += other.count_;
+        }
+
+        /** Return the q-quantile (q in [0,1]), NaN if empty */
+        double quantile(const double q) const {
+            if (count_ == 0)
+                return std::numeric_limits<double>::quiet_NaN();
+            const uint64_t rank = (uint64_t)(std::min(std::max(q, 0.0), 1.0) * (count_ - 1));
+            uint64_t seen = zeroCount_;
+            if (rank < seen)
+                return 0;
+            for (size_t b = 0; b < buckets_.size(); b++){
+                seen += buckets_[b];
+                if (rank < seen)        // Middle of the bucket (gamma^(key-1), gamma^key]
+                    return 2 * std::pow(gamma_, offset_ + (int)b) / (gamma_ + 1);
+            }
+            return 2 * std::pow(gamma_, offset_ + (int)buckets_.size() - 1) / (gamma_ + 1);
+        }
+
+        uint64_t count() const { return count_; }
+
+    private:
+        double gamma_, logGamma_, minValue_;
+        std::vector<uint64_t> buckets_;             // Counts of the buckets offset_, offset_+1, ...
+        int offset_ = 0;
+        uint64_t zeroCount_ = 0, count_ = 0;
+    };
+
+} // namespace utils
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+
+namespace utils {
+
+    /** Pool of worker threads running tasks that may submit further tasks (i.e. the next stage of a job).
+     * Each worker has its own deque: it runs its newest task first, so a job tends to stay on the thread whose caches
+     * hold its data, and when its deque is empty it steals the oldest task of another worker.
+     * Tasks must handle their own errors: an exception escaping a task is reported and dropped
+    */
+    class TaskPool {
+    public:
+        /** @param numThreads    Number of worker threads (0 means one per hardware thread) */
+        explicit TaskPool(unsigned int numThreads = 0){
+            if (numThreads == 0)
+                numThreads = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned int t = 0; t < numThreads; t++)
+                queues_.emplace_back(new Queue());
+            for (unsigned int t = 0; t < numThreads; t++)
+                workers_.emplace_back(&TaskPool::run, this, t);
+        }
+
+        ~TaskPool(){
+            wait();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cvTask_.notify_all();
+            for (auto &worker : workers_)
+                worker.join();
+        }
+
+        TaskPool(const TaskPool&) = delete;
+        TaskPool& operator=(const TaskPool&) = delete;
+
+        size_t numThreads() const { return workers_.size(); }
+
+        /** Queue a task: on the deque of the calling worker, or round robin when called from outside the pool
+         * @param task      Function to run
+        */
+        void submit(std::function<void()> task){
+            const size_t q = current().pool == this ? current().worker : nextQueue_++ % queues_.size();
+            pending_++;
+            {
+                std::lock_guard<std::mutex> lock(queues_[q]->mutex);
+                queues_[q]->tasks.emplace_back(std::move(task));
+                queued_++;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);           // A worker going to sleep sees queued_ or gets the notification
+            }
+            cvTask_.notify_one();
+        }
+
+        /** Block until every submitted task (and the tasks they submitted) has run. Not to be called from a task */
+        void wait(){
+            std::unique_lock<std::mutex> lock(mutex_);
+            cvIdle_.wait(lock, [&](){ return pending_ == 0; });
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        /** Pool and index of the worker running on this thread */
+        struct WorkerId {
+            const TaskPool *pool = nullptr;
+            size_t worker = 0;
+        };
+
+        static WorkerId& current(){
+            static thread_local WorkerId id;
+            return id;
+        }
+
+        /** Take the newest task of the worker, else steal the oldest one of the others */
+        bool take(const size_t worker, std::function<void()> &task){
+            {
+                Queue &own = *queues_[worker];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.tasks.empty()){
+                    task = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                    queued_--;
+                    return true;
+                }
+            }
+            for (size_t k = 1; k < queues_.size(); k++){
+                Queue &other = *queues_[(worker + k) % queues_.size()];
+                std::lock_guard<std::mutex> lock(other.mutex);
+                if (!other.tasks.empty()){
+                    task = std::move(other.tasks.front());
+                    other.tasks.pop_front();
+                    queued_--;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run(const size_t worker){
+            current() = WorkerId{this, worker};
+            std::function<void()> task;
+            while (true){
+                if (!take(worker, task)){
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cvTask_.wait(lock, [&](){ return stop_ || queued_ > 0; });
+                    if (stop_ && queued_ == 0)
+                        return;
+                    continue;
+                }
+                try {
+                    task();
+                } catch (const std::exception &e){
+                    std::cerr << "Task failed: " << e.what() << "\n";
+                } catch (...){
+                    std::cerr << "Task failed\n";
+                }
+                task = nullptr;                                     // Release the captures before reporting completion
+                if (--pending_ == 0){
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    cvIdle_.notify_all();
+                }
+            }
+        }
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::vector<std::thread> workers_;
+        std::atomic<size_t> pending_{0};                            // Submitted and not finished yet
+        std::atomic<size_t> queued_{0};                             // Waiting in the deques
+        std::atomic<size_t> nextQueue_{0};
+        std::mutex mutex_;
+        std::condition_variable cvTask_, cvIdle_;
+        bool stop_ = false;
+    };
+
+} // namespace utils
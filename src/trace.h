@@ -0,0 +1,155 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <sys/resource.h>
+
+namespace utils {
+
+    /** Collector of timed stages. When disabled (the default), a scoped timer costs one relaxed atomic load.
+     * When enabled, each timer adds a complete event ("ph": "X") to an in-memory list, written at the end of
+     * the run as a Chrome trace (chrome://tracing, ui.perfetto.dev) together with a summary table
+    */
+    class Tracer {
+    public:
+        static Tracer& get(){
+            static Tracer tracer;
+            return tracer;
+        }
+
+        bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+        void enable(){
+            start_ = std::chrono::steady_clock::now();
+            enabled_.store(true, std::memory_order_relaxed);
+        }
+
+        /** Microseconds since the tracer was enabled */
+        int64_t now() const {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_).count();
+        }
+
+        /** Add a complete event
+         * @param name      Stage name. Must be a string literal (it is not copied)
+         * @param start     Start time [us]
+         * @param duration  Duration [us]
+        */
+        void record(const char *name, const int64_t start, const int64_t duration){
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto id = threadIds_.emplace(std::this_thread::get_id(), threadIds_.size()).first->second;
+            events_.push_back(Event{name, start, duration, id});
+        }
+
+        /** Write the events as a Chrome trace and print the per-stage summary
+         * @param tracePath     Output path of the trace
+        */
+        void write(const std::string &tracePath){
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::ofstream out(tracePath);
+            out << "{\"traceEvents\": [\n";
+            for (size_t k = 0; k < events_.size(); k++){
+                const Event &e = events_[k];
+                out << "  {\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << e.tid
+                    << ", \"ts\": " << e.start << ", \"dur\": " << e.duration << "}" << (k + 1 < events_.size() ? ",\n" : "\n");
+            }
+            out << "]}\n";
+
+            // Summary: latency percentiles of each stage
+            std::map<std::string, std::vector<int64_t>> stages;
+            for (const Event &e : events_)
+                stages[e.name].push_back(e.duration);
+            std::cout << "Trace written to " << tracePath << "\n"
+                << std::left << std::setw(24) << "Stage" << std::right << std::setw(8) << "Count" << std::setw(12) << "Total[ms]"
+                << std::setw(10) << "p50[ms]" << std::setw(10) << "p90[ms]" << std::setw(10) << "p99[ms]" << std::setw(10) << "Max[ms]" << "\n";
+            for (auto &stage : stages){
+                std::vector<int64_t> &durations = stage.second;
+                std::sort(durations.begin(), durations.end());
+                int64_t total = 0;
+                for (const int64_t d : durations)
+                    total += d;
+                auto percentile = [&](const double p){ return durations[std::min(durations.size() - 1, (size_t)(p * durations.size()))] / 1000.0; };
+                std::cout << std::left << std::setw(24) << stage.first << std::right << std::setw(8) << durations.size()
+                    << std::fixed << std::setprecision(2) << std::setw(12) << total / 1000.0 << std::setw(10) << percentile(0.5)
+                    << std::setw(10) << percentile(0.9) << std::setw(10) << percentile(0.99) << std::setw(10) << durations.back() / 1000.0 << "\n";
+            }
+            std::cout.unsetf(std::ios::fixed);
+
+            // Peak resident set size (ru_maxrss is in KB on Linux)
+            struct rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) == 0)
+                std::cout << "Peak RSS: " << usage.ru_maxrss / 1024 << " MB\n";
+        }
+
+    private:
+        struct Event {
+            const char *name;
+            int64_t start, duration;
+            size_t tid;
+        };
+
+        Tracer() = default;
+
+        std::atomic<bool> enabled_{false};
+        std::chrono::steady_clock::time_point start_;
+        std::mutex mutex_;
+        std::vector<Event> events_;
+        std::map<std::thread::id, size_t> threadIds_;
+    };
+
+    /** Time the enclosing scope as a stage of the trace (see TRACE_SCOPE) */
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(const char *name) : name_(Tracer::get().enabled() ? name : nullptr) {
+            if (name_)
+                start_ = Tracer::get().now();
+        }
+
+        ~ScopedTimer(){
+            if (name_)
+                Tracer::get().record(name_, start_, Tracer::get().now() - start_);
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        const char *name_;
+        int64_t start_ = 0;
+    };
+
+    /** Tracing of a whole run: enabled if tracePath is not empty, written when the session ends */
+    class TraceSession {
+    public:
+        /** @param tracePath     Output path of the Chrome trace (empty: tracing disabled) */
+        explicit TraceSession(const std::string &tracePath) : tracePath_(tracePath) {
+            if (!tracePath_.empty())
+                Tracer::get().enable();
+        }
+
+        ~TraceSession(){
+            if (!tracePath_.empty())
+                Tracer::get().write(tracePath_);
+        }
+
+        TraceSession(const TraceSession&) = delete;
+        TraceSession& operator=(const TraceSession&) = delete;
+
+    private:
+        std::string tracePath_;
+    };
+
+} // namespace utils
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+/** Time the enclosing scope as the stage "name" (a string literal) */
+#define TRACE_SCOPE(name) utils::ScopedTimer TRACE_CONCAT(traceScope_, __LINE__)(name)
@@ -1,23 +1,108 @@
 #pragma once
 
+#include "trace.h"
+
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <limits>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
 namespace utils {
 
+    /** Return the value of an optional command line argument given as "--name value".
+     * Return defaultValue if the argument is missing
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+     * @param name          Name of the argument (i.e. "--threads")
+     * @param defaultValue  Value returned when the argument is not given
+    */
+    inline std::string getOptArg(int argc, char** argv, const std::string &name, const std::string &defaultValue){
+        for (int i = 1; i < argc - 1; i++){
+            if (name == argv[i])
+                return argv[i+1];
+        }
+        return defaultValue;
+    }
+
+    /** Return the values of an optional command line argument given as "--name value1 ... valueN".
+     * Return an empty vector if the argument is missing or has less than numValues values
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+     * @param name          Name of the argument (i.e. "--grid-map")
+     * @param numValues     Number of values
+    */
+    inline std::vector<std::string> getOptArgs(int argc, char** argv, const std::string &name, const int numValues){
+        for (int i = 1; i < argc - numValues; i++){
+            if (name == argv[i])
+                return std::vector<std::string>(argv + i + 1, argv + i + 1 + numValues);
+        }
+        return {};
+    }
+
+    /** Return true if the optional command line flag (i.e. "--compare-selection") is given
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+     * @param name          Name of the flag
+    */
+    inline bool hasOptFlag(int argc, char** argv, const std::string &name){
+        for (int i = 1; i < argc; i++){
+            if (name == argv[i])
+                return true;
+        }
+        return false;
+    }
+
+    /** Run job(i) for each i in [0, n) on a pool of worker threads. Each worker picks the next 
+     * unprocessed index, so the jobs must store their results by index to preserve the input order
+     * @param n             Number of jobs
+     * @param numThreads    Number of worker threads (0 means one per hardware thread)
+     * @param job           Function executed for each index
+    */
+    inline void parallelFor(const size_t n, unsigned int numThreads, const std::function<void(size_t)> &job){
+        if (numThreads == 0)
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        numThreads = std::min<size_t>(numThreads, n);
+
+        std::atomic<size_t> next(0);
+        auto worker = [&](){
+            for (size_t i = next++; i < n; i = next++)
+                job(i);
+        };
+
+        // Run single threaded without spawning anything
+        if (numThreads <= 1){
+            worker();
+            return;
+        }
+
+        std::vector<std::thread> pool;
+        for (unsigned int t = 0; t < numThreads; t++)
+            pool.emplace_back(worker);
+        for (auto &thread : pool)
+            thread.join();
+    }
+
     /** Return the global filepaths of the images having the given extension
      * @param path          Source path
      * @param extension     Image extension
      * @param sort          Sort the filepaths alphabetically
     */ 
-    std::vector<std::string> getImgPaths(const std::string path, const std::string extension, const bool sort=true) {
+    inline std::vector<std::string> getImgPaths(const std::string path, const std::string extension, const bool sort=true) {
+        TRACE_SCOPE("getImgPaths");
         std::vector<std::string> imgPaths;
         
         // Get path of files matching the given extension
@@ -34,16 +119,164 @@ namespace utils {
         return imgPaths;
     }
 
+    /** Read an unsigned integer of the given number of bytes from a buffer
+     * @param buf           Source buffer
+     * @param numBytes      Number of bytes of the integer (up to 4)
+     * @param bigEndian     Byte order of the integer
+    */
+    inline uint32_t readUInt(const unsigned char *buf, const int numBytes, const bool bigEndian){
+        uint32_t value = 0;
+        for (int i = 0; i < numBytes; i++)
+            value |= (uint32_t)buf[bigEndian ? i : numBytes - 1 - i] << (8 * (numBytes - 1 - i));
+        return value;
+    }
+
+    /** Look for a tag (SHORT or LONG) among the entries of a TIFF image file directory (IFD). 
+     * Used both for TIFF files and for the EXIF block of JPEG files
+     * @param entries       Buffer with the 12-bytes IFD entries
+     * @param numEntries    Number of entries in the buffer
+     * @param bigEndian     Byte order of the TIFF structure ("MM" or "II")
+     * @param tag           Tag to look for
+     * @param value         Output value of the tag
+    */
+    inline bool readTiffTag(const unsigned char *entries, const size_t numEntries, const bool bigEndian, const uint16_t tag, uint32_t &value){
+        for (size_t e = 0; e < numEntries; e++){
+            const unsigned char *entry = entries + 12 * e;
+            if (readUInt(entry, 2, bigEndian) != tag)
+                continue;
+            const uint16_t type = readUInt(entry + 2, 2, bigEndian);            // 3: SHORT, 4: LONG
+            value = readUInt(entry + 8, type == 3 ? 2 : 4, bigEndian);
+            return type == 3 || type == 4;
+        }
+        return false;
+    }
+
+    /** Read the resolution of an image from its file header, without decoding the pixels.
+     * Support PNG, JPEG (with EXIF orientation, as applied by cv::imread), TIFF, BMP and PNM.
+     * Return false if the format is unknown or the header is malformed
+     * @param imgPath       Path to the image
+     * @param imgRes        Resolution of the image (output)
+    */
+    inline bool readImgResFromHeader(const std::string &imgPath, cv::Size &imgRes){
+        std::ifstream file(imgPath, std::ios::binary);
+        unsigned char head[32] = {0};
+        if (!file.read(reinterpret_cast<char*>(head), sizeof(head)) && file.gcount() < 26)
+            return false;
+
+        // PNG: the IHDR chunk always comes first
+        if (head[0] == 0x89 && head[1] == 'P' && head[2] == 'N' && head[3] == 'G'){
+            imgRes = cv::Size(readUInt(head + 16, 4, true), readUInt(head + 20, 4, true));
+            return true;
+        }
+
+        // BMP: BITMAPINFOHEADER, negative height for top-down bitmaps
+        if (head[0] == 'B' && head[1] == 'M'){
+            const int32_t height = (int32_t)readUInt(head + 22, 4, false);
+            imgRes = cv::Size((int32_t)readUInt(head + 18, 4, false), std::abs(height));
+            return true;
+        }
+
+        // PNM (P1-P6): "P5 <width> <height> ..." with optional comments
+        if (head[0] == 'P' && head[1] >= '1' && head[1] <= '6'){
+            file.clear();
+            file.seekg(2);
+            int dims[2];
+            for (int &dim : dims){
+                file >> std::ws;
+                while (file.peek() == '#'){
+                    file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                    file >> std::ws;
+                }
+                if (!(file >> dim))
+                    return false;
+            }
+            imgRes = cv::Size(dims[0], dims[1]);
+            return true;
+        }
+
+        // TIFF: width and height tags are in the first IFD, which can be anywhere in the file
+        if ((head[0] == 'I' && head[1] == 'I' && head[2] == 42) || (head[0] == 'M' && head[1] == 'M' && head[3] == 42)){
+            const bool bigEndian = head[0] == 'M';
+            unsigned char count[2];
+            file.clear();
+            file.seekg(readUInt(head + 4, 4, bigEndian));
+            if (!file.read(reinterpret_cast<char*>(count), 2))
+                return false;
+            std::vector<unsigned char> entries(12 * readUInt(count, 2, bigEndian));
+            if (!file.read(reinterpret_cast<char*>(entries.data()), entries.size()))
+                return false;
+            uint32_t width, height;
+            if (!readTiffTag(entries.data(), entries.size() / 12, bigEndian, 256, width) || 
+                !readTiffTag(entries.data(), entries.size() / 12, bigEndian, 257, height))
+                return false;
+            imgRes = cv::Size(width, height);
+            return true;
+        }
+
+        // JPEG: walk the markers up to the Start Of Frame
+        if (head[0] == 0xFF && head[1] == 0xD8){
+            uint32_t orientation = 1;
+            file.clear();
+            file.seekg(2);
+            unsigned char marker[4];
+            while (file.read(reinterpret_cast<char*>(marker), 4)){
+                if (marker[0] != 0xFF)
+                    return false;
+                const size_t length = readUInt(marker + 2, 2, true);
+                // SOF0-SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+                if (marker[1] >= 0xC0 && marker[1] <= 0xCF && marker[1] != 0xC4 && marker[1] != 0xC8 && marker[1] != 0xCC){
+                    unsigned char sof[5];
+                    if (!file.read(reinterpret_cast<char*>(sof), 5))
+                        return false;
+                    imgRes = cv::Size(readUInt(sof + 3, 2, true), readUInt(sof + 1, 2, true));
+                    if (orientation >= 5 && orientation <= 8)                   // Rotated by 90 degrees
+                        imgRes = cv::Size(imgRes.height, imgRes.width);
+                    return true;
+                }
+                // APP1: EXIF block, look for the orientation tag
+                if (marker[1] == 0xE1 && length > 16){
+                    std::vector<unsigned char> app1(length - 2);
+                    if (!file.read(reinterpret_cast<char*>(app1.data()), app1.size()))
+                        return false;
+                    // "Exif\0\0", then a TIFF header and the offset of the first IFD
+                    const unsigned char *tiff = app1.data() + 6;
+                    const bool bigEndian = tiff[0] == 'M';
+                    const size_t ifd = readUInt(tiff + 4, 4, bigEndian);
+                    if (std::equal(app1.begin(), app1.begin() + 4, "Exif") && 6 + ifd + 2 <= app1.size()){
+                        const size_t numEntries = std::min<size_t>(readUInt(tiff + ifd, 2, bigEndian), (app1.size() - 8 - ifd) / 12);
+                        readTiffTag(tiff + ifd + 2, numEntries, bigEndian, 0x0112, orientation);
+                    }
+                    continue;
+                }
+                file.seekg(length - 2, std::ios::cur);
+            }
+        }
+
+        return false;
+    }
+
+    /** Return the resolution of an image. Read it from the file header when the format is known, 
+     * otherwise decode the whole image
+     * @param imgPath       Path to the image
+    */
+    inline cv::Size getImgRes(const std::string &imgPath){
+        cv::Size imgRes;
+        if (readImgResFromHeader(imgPath, imgRes))
+            return imgRes;
+        return cv::imread(imgPath, cv::IMREAD_COLOR).size();
+    }
+
      /** Check that all the images in the path have the expected resolution
      * 
      * @param imgPaths      Paths to the images
      * @param imgRes        Detected resolution of the images (output)
     */ 
-    bool checkImgsResolution(const std::vector<std::string> &imgPaths, cv::Size &imgRes){
-        const cv::Size expectedRes = cv::imread(imgPaths[0], cv::IMREAD_COLOR).size();
+    inline bool checkImgsResolution(const std::vector<std::string> &imgPaths, cv::Size &imgRes){
+        TRACE_SCOPE("checkImgsResolution");
+        const cv::Size expectedRes = getImgRes(imgPaths[0]);
         
         for (uint i = 0; i < imgPaths.size(); i++){
-            if (cv::imread(imgPaths[i], cv::IMREAD_COLOR).size() != expectedRes)
+            if (getImgRes(imgPaths[i]) != expectedRes)
                 return false;
         }
 
@@ -51,20 +284,178 @@ namespace utils {
         return true;
     }
 
-    /** Return all the images with the given extension
+    /** Image read from disk. The encoded file is read once and decoded straight to grayscale;
+     * the color image is decoded from the same bytes only when it is requested (i.e. for debug images)
+    */
+    class ImgSource {
+    public:
+        /** @param path      Path to the image */
+        explicit ImgSource(const std::string &path) : path_(path) {
+            TRACE_SCOPE("readFile");
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (file){
+                encoded_.resize(file.tellg());
+                file.seekg(0);
+                file.read(reinterpret_cast<char*>(encoded_.data()), encoded_.size());
+            }
+        }
+
+        /** Return the grayscale image, decoding it on the first call */
+        const cv::Mat& gray(){
+            if (gray_.empty() && !encoded_.empty()){
+                TRACE_SCOPE("decode");
+                gray_ = cv::imdecode(encoded_, cv::IMREAD_GRAYSCALE);
+            }
+            return gray_;
+        }
+
+        /** Return the BGR image, decoding it on the first call */
+        const cv::Mat& color(){
+            if (color_.empty() && !encoded_.empty()){
+                TRACE_SCOPE("decode");
+                color_ = cv::imdecode(encoded_, cv::IMREAD_COLOR);
+            }
+            return color_;
+        }
+
+        /** Return the content of the file, as stored on disk */
+        const std::vector<unsigned char>& encoded() const { return encoded_; }
+
+        const std::string& path() const { return path_; }
+
+    private:
+        std::string path_;
+        std::vector<unsigned char> encoded_;        // Content of the file, as stored on disk (few MB at most)
+        cv::Mat gray_, color_;
+    };
+
+    /** Chessboard corner detector */
+    enum class DetectorBackend {
+        CLASSIC,                        // cv::findChessboardCorners, then cornerSubPix
+        SB                              // cv::findChessboardCornersSB (sector based, subpixel accurate on its own)
+    };
+
+    /** Settings of the chessboard corner detector */
+    struct DetectorSettings {
+        int pyramidLevel = 0;           // Pyramid level used to find the board (0: full resolution, -1: automatic)
+        DetectorBackend backend = DetectorBackend::CLASSIC;
+        bool fastReject = false;        // Screen the image with the fast board check (downscaled) before the detector
+    };
+
+    /** Parse the detector settings from the optional command line arguments:
+     *      --pyramid off|auto|N    Find the board on a downscaled image, then refine at full resolution
+     *      --detector classic|sb   Detector backend (default: classic)
+     *      --fast-reject           Skip the detector on the images failing the fast board check
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+    */
+    inline DetectorSettings getDetectorSettings(int argc, char** argv){
+        DetectorSettings settings;
+        const std::string pyramid = getOptArg(argc, argv, "--pyramid", "off");
+        settings.pyramidLevel = (pyramid == "off") ? 0 : (pyramid == "auto") ? -1 : std::stoi(pyramid);
+        settings.backend = (getOptArg(argc, argv, "--detector", "classic") == "sb") ? DetectorBackend::SB : DetectorBackend::CLASSIC;
+        settings.fastReject = hasOptFlag(argc, argv, "--fast-reject");
+        return settings;
+    }
+
+    /** Images entering and passing each stage of the corner search (tracking, fast check, detector),
+     * over the whole process (cache hits excluded) */
+    class DetectorStats {
+    public:
+        static DetectorStats& get(){
+            static DetectorStats stats;
+            return stats;
+        }
+
+        std::atomic<uint64_t> screened{0}, screenPassed{0};         // Fast board check
+        std::atomic<uint64_t> detected{0}, detectFound{0};          // Full detector
+        std::atomic<uint64_t> tracked{0}, trackPassed{0};           // Optical flow tracking (see CornerTracker)
+
+        /** Print the hit/miss counts of the stages that ran (nothing if no detector ran) */
+        void print() const {
+            if (detected == 0 && screened == 0 && tracked == 0)
+                return;
+            std::cout << "Detector stages:\n";
+            if (tracked > 0)
+                std::cout << "\tTracking: " << trackPassed << " tracked, " << tracked - trackPassed << " lost of " << tracked << "\n";
+            if (screened > 0)
+                std::cout << "\tFast check: " << screenPassed << " passed, " << screened - screenPassed << " rejected of " << screened << "\n";
+            std::cout << "\tDetector: " << detectFound << " found, " << detected - detectFound << " not found of " << detected << "\n";
+        }
+    };
+
+    /** Choose the pyramid level on which to look for the board. Assume the board spans at least a third of 
+     * the shorter image side and keep cells of at least 10 pixels, on images not smaller than 480 pixels
+     * @param imgRes        Full image resolution
+     * @param boardSize     Width and height of the chessboard
+    */
+    inline int getAutoPyramidLevel(const cv::Size &imgRes, const cv::Size &boardSize){
+        const int minSide = std::min(imgRes.width, imgRes.height);
+        const int maxCells = std::max(boardSize.width, boardSize.height) + 1;
+        int level = 0;
+        while ((minSide >> (level + 1)) >= 480 && (minSide >> (level + 1)) / (3.0 * maxCells) >= 10)
+            level++;
+        return level;
+    }
+
+    /** Find the chessboard corners of an image, as a cascade: optional fast board check on a downscaled image
+     * (most images without a full board stop here), detector, then subpixel refinement
      * @param imgGray           Source gray image
      * @param boardWidth        Number of corner intersection of the chess row
      * @param boardHeight       Number of corner intersection of the chess column
      * @param chessCorners      Output vector of corners 2D coordinates 
+     * @param settings          Detector settings
     */ 
-    bool findChessCorners(cv::Mat &imgGray, const int &boardWidth, const int &boardHeight, std::vector<cv::Point2f> &chessCorners){
-        bool found = cv::findChessboardCorners(imgGray, cv::Size(boardWidth, boardHeight), chessCorners);                               
-            
-        // If all corners were found, refine corner positions
+    inline bool findChessCorners(const cv::Mat &imgGray, const int &boardWidth, const int &boardHeight, std::vector<cv::Point2f> &chessCorners,
+                            const DetectorSettings &settings = DetectorSettings()){
+        const cv::Size boardSize(boardWidth, boardHeight);
+        const cv::TermCriteria subPixCrit(cv::TermCriteria::Type::EPS | cv::TermCriteria::Type::MAX_ITER, 30, 0.001);
+        const int level = (settings.pyramidLevel < 0) ? getAutoPyramidLevel(imgGray.size(), boardSize) : settings.pyramidLevel;
+        // The fast check is screened on images of about 640 pixels: larger ones only make it slower
+        int screenLevel = 0;
+        while (settings.fastReject && (std::max(imgGray.cols, imgGray.rows) >> screenLevel) > 640)
+            screenLevel++;
+        DetectorStats &stats = DetectorStats::get();
+
+        // Build the pyramid: pyramid[0] is the source image, each level halves the resolution
+        std::vector<cv::Mat> pyramid(std::max(level, screenLevel) + 1);
+        pyramid[0] = imgGray;
+        for (size_t l = 1; l < pyramid.size(); l++)
+            cv::pyrDown(pyramid[l-1], pyramid[l]);
+
+        chessCorners.clear();
+        if (settings.fastReject){
+            TRACE_SCOPE("checkChessboard");
+            stats.screened++;
+            if (!cv::checkChessboard(pyramid[screenLevel], boardSize))
+                return false;
+            stats.screenPassed++;
+        }
+
+        bool found;
+        {
+            TRACE_SCOPE("findChessboardCorners");
+            stats.detected++;
+            found = (settings.backend == DetectorBackend::SB) ? cv::findChessboardCornersSB(pyramid[level], boardSize, chessCorners) :
+                                                                cv::findChessboardCorners(pyramid[level], boardSize, chessCorners);
+            if (found)
+                stats.detectFound++;
+        }
+
+        // If all corners were found, refine corner positions. Coming from a coarser level, 
+        // scale the corners up and refine them at each level down to the full resolution
+        // (the SB corners are already refined at the level they were found on)
         if (found){
-            cv::cornerSubPix(imgGray, chessCorners, cv::Size(5,5), cv::Size(-1,-1),                                                     
-                            cv::TermCriteria(cv::TermCriteria::Type::EPS | 
-                            cv::TermCriteria::Type::MAX_ITER, 30, 0.001));
+            TRACE_SCOPE("cornerSubPix");
+            for (int l = level; l >= 0; l--){
+                if (l < level){
+                    for (auto &corner : chessCorners)
+                        corner *= 2.f;                          // pyrDown centers pixel i on pixel 2i
+                } else if (settings.backend == DetectorBackend::SB){
+                    continue;
+                }
+                cv::cornerSubPix(pyramid[l], chessCorners, cv::Size(5,5), cv::Size(-1,-1), subPixCrit);
+            }
         }
 
         return found;
@@ -76,7 +467,7 @@ namespace utils {
      * @param boardSize     Width and height of the chessboard
      * @param chessCorners  Chess corners
      */
-    void saveChessCornersAsImg(const std::string& filepath, cv::Mat& img, const cv::Size &boardSize, std::vector<cv::Point2f> &chessCorners)
+    inline void saveChessCornersAsImg(const std::string& filepath, const cv::Mat& img, const cv::Size &boardSize, std::vector<cv::Point2f> &chessCorners)
     {   
         // Create new image to avoid editing img
         cv::Mat chessImg = img.clone();
@@ -85,6 +476,22 @@ namespace utils {
         cv::imwrite(filepath, chessImg);
     }
 
+    /** Return the 3D points of the chessboard corners, starting from the top-left corner of the chessboard. 
+     * Use cellSize to scale them. Assume they are on a plane (z=0)
+     * @param boardWidth    Number of corner intersection of the chess row
+     * @param boardHeight   Number of corner intersection of the chess column
+     * @param cellSize      Chessboard cell size
+    */
+    inline std::vector<cv::Point3f> getChessObjPoints(const int boardWidth, const int boardHeight, const float cellSize){
+        std::vector<cv::Point3f> chessObjPoints;
+        for (int i = 0; i < boardHeight; i++){
+            for (int j = 0; j < boardWidth; j++){
+                chessObjPoints.emplace_back(cv::Point3f((float)j * cellSize, (float)i * cellSize, 0));
+            }
+        }
+        return chessObjPoints;
+    }
+
     /** Load chessboard data (width, height, cell size) from left and right calibration files. Check their consistency.
      * Return false if consistencies are found
      * 
@@ -95,7 +502,7 @@ namespace utils {
      * @param cellSize      Out chessboard cell size
      * 
     */
-    bool loadAndCheckChessboardData(const cv::FileStorage &fsL, const cv::FileStorage &fsR, int &boardWidth, int &boardHeight, float &cellSize){
+    inline bool loadAndCheckChessboardData(const cv::FileStorage &fsL, const cv::FileStorage &fsR, int &boardWidth, int &boardHeight, float &cellSize){
         int boardWidthL, boardWidthR, boardHeightL, boardHeightR;
         float cellSizeL, cellSizeR;
 
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "utils.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+namespace utils {
+
+    /** Settings of the video input mode */
+    struct VideoSettings {
+        int step = 1;                       // Only consider one frame every step frames
+        double minSharpness = 20;           // Min variance of the Laplacian of the frame thumbnail (blur rejection)
+        double minMotion = 2;               // Min mean absolute difference [gray levels] from the last detected frame thumbnail
+        double minPoseChange = 0.02;        // Min mean corner displacement from any kept view, relative to the image diagonal
+    };
+
+    /** Parse the video settings from the optional command line arguments:
+     *      --video-step N              Frame decimation
+     *      --min-sharpness S           Blur rejection threshold
+     *      --min-motion M              Static scene rejection threshold
+     *      --min-pose-change P         Redundant view rejection threshold
+     * @param argc          Number of command line arguments
+     * @param argv          Command line arguments
+    */
+    inline VideoSettings getVideoSettings(int argc, char** argv){
+        VideoSettings settings;
+        settings.step = std::max(1, std::stoi(getOptArg(argc, argv, "--video-step", "1")));
+        settings.minSharpness = std::stod(getOptArg(argc, argv, "--min-sharpness", "20"));
+        settings.minMotion = std::stod(getOptArg(argc, argv, "--min-motion", "2"));
+        settings.minPoseChange = std::stod(getOptArg(argc, argv, "--min-pose-change", "0.02"));
+        return settings;
+    }
+
+    /** Return true if the input path is a video file rather than an image folder
+     * @param path          Input path
+    */
+    inline bool isVideoInput(const std::string &path){
+        return fs::is_regular_file(path);
+    }
+
+    /** Sequential reader of the frames of a video file. Decimated frames are grabbed but not retrieved,
+     * so they are not converted to BGR
+    */
+    class VideoFrameSource {
+    public:
+        /**
+         * @param path      Path to the video file
+         * @param step      Return one frame every step frames
+        */
+        VideoFrameSource(const std::string &path, const int step) : capture_(path), step_(step) {}
+
+        bool isOpened() const { return capture_.isOpened(); }
+
+        cv::Size getResolution() const {
+            return cv::Size((int)capture_.get(cv::CAP_PROP_FRAME_WIDTH), (int)capture_.get(cv::CAP_PROP_FRAME_HEIGHT));
+        }
+
+        /** Read the next frame. Return false at the end of the stream
+         * @param frame     Output BGR frame
+         * @param frameIdx  Index of the frame in the video (output)
+        */
+        bool read(cv::Mat &frame, int &frameIdx){
+            for (int s = 1; s < step_ && nextIdx_ > 0; s++, nextIdx_++){
+                if (!capture_.grab())
+                    return false;
+            }
+            if (!capture_.read(frame) || frame.empty())
+                return false;
+            frameIdx = nextIdx_++;
+            return true;
+        }
+
+    private:
+        cv::VideoCapture capture_;
+        int step_;
+        int nextIdx_ = 0;
+    };
+
+    /** Cheap selection of the video frames worth a chessboard detection, and of the detected views
+     * worth a place in the calibration. Frames are compared on small grayscale thumbnails
+    */
+    class FrameSelector {
+    public:
+        explicit FrameSelector(const VideoSettings &settings) : settings_(settings) {}
+
+        /** Return true if the frames (one per camera) are sharp and the scene moved since the last accepted frames.
+         * Only the first camera is used for the motion test
+         * @param frames    BGR frames
+        */
+        bool accept(const std::vector<cv::Mat> &frames){
+            std::vector<cv::Mat> thumbs(frames.size());
+            for (size_t c = 0; c < frames.size(); c++){
+                const double scale = 320.0 / std::max(1, frames[c].cols);
+                cv::Mat thumbColor;
+                cv::resize(frames[c], thumbColor, cv::Size(), std::min(1.0, scale), std::min(1.0, scale), cv::INTER_AREA);
+                cv::cvtColor(thumbColor, thumbs[c], cv::COLOR_BGR2GRAY);
+
+                // Blur rejection: variance of the Laplacian
+                cv::Mat laplacian;
+                cv::Scalar mean, stdDev;
+                cv::Laplacian(thumbs[c], laplacian, CV_64F);
+                cv::meanStdDev(laplacian, mean, stdDev);
+                if (stdDev[0] * stdDev[0] < settings_.minSharpness)
+                    return false;
+            }
+
+            // Static scene rejection
+            if (!lastThumb_.empty()){
+                cv::Mat diff;
+                cv::absdiff(thumbs[0], lastThumb_, diff);
+                if (cv::mean(diff)[0] < settings_.minMotion)
+                    return false;
+            }
+            lastThumb_ = thumbs[0];
+            return true;
+        }
+
+        /** Return true if the board pose differs from the ones of all the kept views, and keep it
+         * @param chessCorners  Detected corners
+         * @param imgRes        Image resolution
+        */
+        bool isNewPose(const std::vector<cv::Point2f> &chessCorners, const cv::Size &imgRes){
+            const double minChange = settings_.minPoseChange * std::hypot(imgRes.width, imgRes.height);
+            for (const auto &kept : keptViews_){
+                double accum = 0;
+                for (size_t k = 0; k < chessCorners.size(); k++)
+                    accum += std::hypot(chessCorners[k].x - kept[k].x, chessCorners[k].y - kept[k].y);
+                if (accum / chessCorners.size() < minChange)
+                    return false;
+            }
+            keptViews_.emplace_back(chessCorners);
+            return true;
+        }
+
+    private:
+        VideoSettings settings_;
+        cv::Mat lastThumb_;
+        std::vector<std::vector<cv::Point2f>> keptViews_;
+    };
+
+} // namespace utils
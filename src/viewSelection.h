@@ -0,0 +1,181 @@
+#pragma once
+
+#include "utils.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+namespace utils {
+
+    /** Select up to maxViews views, greedily maximizing the coverage of the image plane and the diversity of the board poses.
+     * At each step the view with the highest score is added, where the score is the sum of:
+     *      - coverage gain: each grid cell touched by the corners of the view counts 1/(1+n), with n the number of
+     *        already selected views touching it, normalized by the number of cells
+     *      - pose diversity: mean distance of the 4 outer board corners from the closest selected view,
+     *        relative to the image diagonal (from the first camera)
+     * With more cameras (stereo), the coverage of all the cameras is summed.
+     * Return the indices of the selected views, sorted
+     *
+     * @param cameraViews   Corners of each view, for each camera
+     * @param imgRes        Image resolution
+     * @param boardSize     Width and height of the chessboard
+     * @param maxViews      Number of views to select
+     * @param gridSize      Number of grid cells along each image side
+    */
+    inline std::vector<size_t> selectViews(const std::vector<std::vector<std::vector<cv::Point2f>>> &cameraViews, const cv::Size &imgRes,
+                                    const cv::Size &boardSize, const size_t maxViews, const int gridSize = 8){
+        const size_t numViews = cameraViews.empty() ? 0 : cameraViews[0].size();
+        std::vector<size_t> selected;
+        if (numViews <= maxViews){
+            for (size_t v = 0; v < numViews; v++)
+                selected.emplace_back(v);
+            return selected;
+        }
+
+        // Grid cells touched by each view, for each camera
+        const int numCells = gridSize * gridSize;
+        std::vector<std::vector<std::vector<int>>> viewCells(cameraViews.size(), std::vector<std::vector<int>>(numViews));
+        for (size_t c = 0; c < cameraViews.size(); c++){
+            for (size_t v = 0; v < numViews; v++){
+                std::vector<char> touched(numCells, false);
+                for (const auto &corner : cameraViews[c][v]){
+                    const int cx = std::min(gridSize - 1, std::max(0, (int)(corner.x * gridSize / imgRes.width)));
+                    const int cy = std::min(gridSize - 1, std::max(0, (int)(corner.y * gridSize / imgRes.height)));
+                    touched[cy * gridSize + cx] = true;
+                }
+                for (int cell = 0; cell < numCells; cell++){
+                    if (touched[cell])
+                        viewCells[c][v].emplace_back(cell);
+                }
+            }
+        }
+
+        // Pose descriptor: the 4 outer corners of the board, in the first camera
+        const int w = boardSize.width, h = boardSize.height;
+        const double diagonal = std::hypot(imgRes.width, imgRes.height);
+        auto poseDistance = [&](const size_t a, const size_t b){
+            const auto &ca = cameraViews[0][a], &cb = cameraViews[0][b];
+            double accum = 0;
+            for (const int k : {0, w - 1, (h - 1) * w, h * w - 1})
+                accum += std::hypot(ca[k].x - cb[k].x, ca[k].y - cb[k].y);
+            return accum / (4 * diagonal);
+        };
+
+        std::vector<std::vector<int>> cellCount(cameraViews.size(), std::vector<int>(numCells, 0));
+        std::vector<double> minPoseDist(numViews, 1.0);                 // Distance from the closest selected view
+        std::vector<char> isSelected(numViews, false);
+        while (selected.size() < maxViews){
+            size_t best = 0;
+            double bestScore = -1;
+            for (size_t v = 0; v < numViews; v++){
+                if (isSelected[v])
+                    continue;
+                double coverage = 0;
+                for (size_t c = 0; c < cameraViews.size(); c++){
+                    for (const int cell : viewCells[c][v])
+                        coverage += 1.0 / (1 + cellCount[c][cell]);
+                }
+                const double score = coverage / numCells + minPoseDist[v];
+                if (score > bestScore){
+                    bestScore = score;
+                    best = v;
+                }
+            }
+
+            isSelected[best] = true;
+            selected.emplace_back(best);
+            for (size_t c = 0; c < cameraViews.size(); c++){
+                for (const int cell : viewCells[c][best])
+                    cellCount[c][cell]++;
+            }
+            for (size_t v = 0; v < numViews; v++)
+                minPoseDist[v] = std::min(minPoseDist[v], poseDistance(v, best));
+        }
+
+        std::sort(selected.begin(), selected.end());
+        return selected;
+    }
+
+    /** Return the elements of a vector at the given indices
+     * @param vec           Source vector
+     * @param indices       Indices of the elements to keep
+    */
+    template <typename T>
+    std::vector<T> selectElements(const std::vector<T> &vec, const std::vector<size_t> &indices){
+        std::vector<T> out;
+        out.reserve(indices.size());
+        for (const size_t idx : indices)
+            out.emplace_back(vec[idx]);
+        return out;
+    }
+
+    /** Return the RMS reprojection error of a set of views given the camera intrinsics.
+     * The pose of each view is estimated with solvePnP, so views not used in the calibration can be evaluated too
+     * @param objPoints     3D board points of each view
+     * @param imgPoints     Detected corners of each view
+     * @param K             Camera matrix
+     * @param D             Distortion coefficients
+    */
+    inline double computeReprError(const std::vector<std::vector<cv::Point3f>> &objPoints, const std::vector<std::vector<cv::Point2f>> &imgPoints,
+                            const cv::Mat &K, const cv::Mat &D){
+        double accum = 0;
+        size_t numPoints = 0;
+        for (size_t v = 0; v < objPoints.size(); v++){
+            cv::Mat rVec, tVec;
+            std::vector<cv::Point2f> projected;
+            cv::solvePnP(objPoints[v], imgPoints[v], K, D, rVec, tVec);
+            cv::projectPoints(objPoints[v], rVec, tVec, K, D, projected);
+            for (size_t k = 0; k < projected.size(); k++){
+                const cv::Point2f diff = projected[k] - imgPoints[v][k];
+                accum += diff.x * diff.x + diff.y * diff.y;
+            }
+            numPoints += projected.size();
+        }
+        return numPoints > 0 ? std::sqrt(accum / numPoints) : 0;
+    }
+
+    /** Return the RMS reprojection error of a set of stereo views given the intrinsics and the relative pose of the cameras.
+     * The pose of each view is estimated with solvePnP in the left camera and moved to the right one with R and T
+     * @param objPoints     3D board points of each view
+     * @param imgPointsL    Detected corners of each view (left)
+     * @param imgPointsR    Detected corners of each view (right)
+     * @param KL, DL        Left camera matrix and distortion coefficients
+     * @param KR, DR        Right camera matrix and distortion coefficients
+     * @param R, T          Rotation and translation of the right camera wrt the left camera
+    */
+    inline double computeStereoReprError(const std::vector<std::vector<cv::Point3f>> &objPoints, const std::vector<std::vector<cv::Point2f>> &imgPointsL,
+                                const std::vector<std::vector<cv::Point2f>> &imgPointsR, const cv::Mat &KL, const cv::Mat &DL,
+                                const cv::Mat &KR, const cv::Mat &DR, const cv::Mat &R, const cv::Vec3d &T){
+        double accum = 0;
+        size_t numPoints = 0;
+        for (size_t v = 0; v < objPoints.size(); v++){
+            cv::Mat rVecL, tVecL, RL, rVecR;
+            cv::solvePnP(objPoints[v], imgPointsL[v], KL, DL, rVecL, tVecL);
+            cv::Rodrigues(rVecL, RL);
+            cv::Rodrigues(R * RL, rVecR);
+            const cv::Mat tVecR = R * tVecL + cv::Mat(T);
+
+            for (int c = 0; c < 2; c++){
+                const std::vector<cv::Point2f> &imgPoints = (c == 0) ? imgPointsL[v] : imgPointsR[v];
+                std::vector<cv::Point2f> projected;
+                if (c == 0)
+                    cv::projectPoints(objPoints[v], rVecL, tVecL, KL, DL, projected);
+                else
+                    cv::projectPoints(objPoints[v], rVecR, tVecR, KR, DR, projected);
+                for (size_t k = 0; k < projected.size(); k++){
+                    const cv::Point2f diff = projected[k] - imgPoints[k];
+                    accum += diff.x * diff.x + diff.y * diff.y;
+                }
+                numPoints += projected.size();
+            }
+        }
+        return numPoints > 0 ? std::sqrt(accum / numPoints) : 0;
+    }
+
+} // namespace utils